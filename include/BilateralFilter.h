@@ -27,6 +27,12 @@
 #include "OctreeIterator.h"
 #include <cmath>
 #include <cassert>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 /**
  * @class TBilateralFilter
  * @brief class providing access to the bilateral filter 
@@ -68,6 +74,26 @@ class TBilateralFilter
         /**min number of neighbors so a point is not removed*/
         static const size_t MIN_NEIGHBORS=5;
 
+        /**neighborhood scratch buffers, one per thread, reused by every
+         * query so that filtering a point does not allocate*/
+        std::vector< TNeighborBuffer<T> > m_scratch;
+
+        /**filtered points of the current pass, one buffer per thread,
+         * inserted in the octree once the pass is over*/
+        std::vector< std::vector<T> > m_staging;
+
+        /**concatenation of the staging buffers*/
+        std::vector<T> m_merged;
+
+        /**precomputed neighborhoods of the initial set (CSR rows sorted by
+         * increasing distance, NULL if none were given)*/
+        const size_t *m_initialOffsets;
+        const unsigned int *m_initialIndices;
+        const float *m_initialSqDistances;
+
+        /**samples of the initial set, by sample index*/
+        std::vector<T*> m_initialSamples;
+
     public ://constructors+destructors
         /**Default Constructor
          */
@@ -108,6 +134,19 @@ class TBilateralFilter
          */
         unsigned int getNextSetIndex() const;
 
+        /**give precomputed neighborhoods of the initial set so that the first
+         * iteration does not query the octree. Row i lists the indices of
+         * the samples around sample i, sorted by increasing squared
+         * distance and computed for a radius at least equal to the
+         * filter radius. The arrays must outlive the filtering.
+         * @param offsets row offsets (number of samples + 1)
+         * @param indices neighbor sample indices
+         * @param sqdistances neighbor squared distances
+         */
+        void setInitialNeighborhoods(const size_t *offsets,
+                                     const unsigned int *indices,
+                                     const float *sqdistances);
+
 
     public : //filter methods
 
@@ -142,23 +181,45 @@ class TBilateralFilter
          * @param parent cell containing the point and whose size
          * corresponds to the processing radius
          * @param nextindex index of the set to save the iteration result to
+         * (unused: the filtered point goes to the staging buffer of the
+         * calling thread)
          */
          void applyBilateralFilter(T &p, TOctreeNode<T> *parent,
                               unsigned int nextindex);
 
+        /**get the scratch neighborhood buffer of the calling thread
+         * @return scratch buffer
+         */
+         TNeighborBuffer<T>& getScratchBuffer();
+
+        /**get the staging buffer of the calling thread
+         * @return staging buffer
+         */
+         std::vector<T>& getStagingBuffer();
+
+        /**insert the staged points of the pass in the octree
+         * @param nextindex index of the set to save the points to
+         */
+         void flushStagedPoints(unsigned int nextindex);
+
+        /**index the samples of the initial set of a cell
+         * @param cell cell to index
+         */
+         void indexInitialSamples(TOctreeNode<T> *cell);
+
         /**perform local PCA: the weighted barycenter and normal to the local 
          * regression plane are computed
          * The algorithm for decomposing 3x3 real symmetric matrices is
          * described in [Smith, 1961]
-         * @param neighbors list of neighbors
-         * @param distances distances from the neighbors to the center point 
+         * @param neighbors neighbors and their square distances to the
+         * center point
          * @param bar barycenter of the distance-weighted neighbors
          * @param nx estimated normal (x coeff)
          * @param ny estimated normal (y coeff)
          * @param nz estimated normal (z coeff)
          */
-         void performLocalPCA(const std::list<T*> &neighbors,
-                              const std::list<double> &distances, Point &bar,
+         void performLocalPCA(const TNeighborBuffer<T> &neighbors,
+                              Point &bar,
                               double &nx, double &ny, double &nz) const;
 };
 
@@ -171,6 +232,9 @@ TBilateralFilter<T>::TBilateralFilter()
     m_niter = 0;
     m_weight = 0.0;
     m_setIndex = 0;
+    m_initialOffsets = NULL;
+    m_initialIndices = NULL;
+    m_initialSqDistances = NULL;
 }
 
 template<class T>
@@ -188,6 +252,15 @@ TBilateralFilter<T>::TBilateralFilter(TOctree<T>* octree,
     m_weight = - 4.5/(radius*radius);//= -1/(2*(1/3radius)^2)
     m_normal_weight = -4.5/(m_normal_radius * m_normal_radius); 
     m_setIndex = m_iterator->getSetIndex();
+    m_initialOffsets = NULL;
+    m_initialIndices = NULL;
+    m_initialSqDistances = NULL;
+#ifdef _OPENMP
+    m_scratch.resize(omp_get_max_threads());
+#else
+    m_scratch.resize(1);
+#endif
+    m_staging.resize(m_scratch.size());
 }
 
 
@@ -209,6 +282,8 @@ void TBilateralFilter<T>::setSetIndex(unsigned int index)
 {
     m_setIndex = index;
     m_iterator->setSetIndex(m_setIndex);
+    //the previous pass may have created cells containing the new set
+    m_iterator->buildCellTable();
 }
 
 template<class T>
@@ -217,6 +292,18 @@ unsigned int TBilateralFilter<T>::getNextSetIndex() const
   return (m_setIndex == 1 ? 2:1);
 }
 
+template<class T>
+void TBilateralFilter<T>::setInitialNeighborhoods(const size_t *offsets,
+                                                  const unsigned int *indices,
+                                                  const float *sqdistances)
+{
+    m_initialOffsets = offsets;
+    m_initialIndices = indices;
+    m_initialSqDistances = sqdistances;
+    m_initialSamples.assign(m_octree->getNpoints(), (T*)NULL);
+    indexInitialSamples(m_octree->getRoot());
+}
+
 
     template<class T>
 void TBilateralFilter<T>::parallelApplyBilateralFilter()
@@ -242,40 +329,31 @@ void TBilateralFilter<T>::parallelApplyBilateralFilter()
         << m_octree->getSize()/(double)pow2(m_octree->getDepth()-depth)
         <<" ; dilatation radius "<<d<<std::endl;
 
-    typename TOctree<T>::OctreeNode_collection node_collection;
-
-    m_octree->getNodes(depth, root, node_collection);
+    //the filtered points are staged per thread and inserted after each
+    //pass, so the cells can all be processed concurrently
+    std::vector< TOctreeNode<T>* > nodes;
+    m_octree->getNodes(depth, root, nodes);
+    const int nnodes = (int)nodes.size();
 
     for(unsigned int n = 0; n < m_niter ; ++n)
     {
         unsigned int nextindex = getNextSetIndex();
 
-        for(unsigned int i = 0; i < 8; ++i)
-        {
-
 #ifdef _OPENMP
-#pragma omp parallel for default(shared)
+#pragma omp parallel for default(shared) schedule(dynamic, 1)
 #endif
-            for(int j = 0; j < (int)node_collection[i].size(); ++j)
-            {
-                TOctreeNode<T> *node = node_collection[i][j];
-                applyBilateralFilter(node, nextindex);
-            }
-        }
+        for(int j = 0; j < nnodes; ++j)
+            applyBilateralFilter(nodes[j], nextindex);
+
+        flushStagedPoints(nextindex);
 
         if(m_setIndex > 0)
         {
-            for(unsigned int i = 0; i < 8; ++i)
-            {
 #ifdef _OPENMP
-#pragma omp parallel for default(shared)
+#pragma omp parallel for default(shared) schedule(dynamic, 16)
 #endif
-                for(int j = 0; j < (int)node_collection[i].size(); ++j)
-                {
-                    TOctreeNode<T> *node = node_collection[i][j];
-                    node->clearSet(m_setIndex);
-                }
-            }
+            for(int j = 0; j < nnodes; ++j)
+                nodes[j]->clearSet(m_setIndex);
         }
         setSetIndex(nextindex);
         std::cout<<"Iteration "<<(n+1)<<" done."<<std::endl;
@@ -292,6 +370,7 @@ void TBilateralFilter<T>::applyBilateralFilter()
         unsigned int nextindex = getNextSetIndex();
         TOctreeNode<T> *root = m_octree->getRoot();
         applyBilateralFilter(root, nextindex);
+        flushStagedPoints(nextindex);
         if(m_setIndex > 0)
             m_octree->clearSet(m_setIndex);
         setSetIndex(nextindex);
@@ -326,7 +405,7 @@ void TBilateralFilter<T>::applyBilateralFilter(TOctreeNode<T>* cell,
 {
     if(cell->getDepth() == 0)
     {
-        typename std::deque<T>::iterator pi;
+        typename TOctreeNode<T>::point_iterator pi;
         for(pi = cell->points_begin(m_setIndex);
                 pi != cell->points_end(m_setIndex); ++pi)
         {
@@ -346,18 +425,29 @@ void TBilateralFilter<T>::applyBilateralFilter(TOctreeNode<T>* cell,
 
 template<class T>
 void TBilateralFilter<T>::applyBilateralFilter(T& p, TOctreeNode<T>* parent,
-                                     const unsigned int index)
+                                     const unsigned int /*nextindex*/)
 {
-    std::list< T* > neighbors;
-    std::list<double> distances;
-    m_iterator->getNeighbors(p, parent, neighbors, distances);
+    TNeighborBuffer<T> &neighbors = getScratchBuffer();
+    if(m_setIndex == 0 && m_initialOffsets != NULL)
+    {
+        //rows are sorted: stop at the first sample outside the radius
+        const float sqradius = (float)(m_radius * m_radius);
+        neighbors.clear();
+        for(size_t j = m_initialOffsets[p.index()];
+                j < m_initialOffsets[p.index() + 1]
+                && m_initialSqDistances[j] < sqradius; ++j)
+            neighbors.push_back(m_initialSamples[m_initialIndices[j]],
+                                m_initialSqDistances[j]);
+    }
+    else
+        m_iterator->getNeighbors(p, parent, neighbors);
  
     if(neighbors.size()<MIN_NEIGHBORS)
         return;//not enough neighbors
 
     Point barycenter;
     double nx,ny,nz;
-    performLocalPCA(neighbors, distances, barycenter, nx, ny, nz);
+    performLocalPCA(neighbors, barycenter, nx, ny, nz);
 
     if(nx * p.nx() + ny * p.ny() + nz * p.nz() < 0)
     {
@@ -369,17 +459,17 @@ void TBilateralFilter<T>::applyBilateralFilter(T& p, TOctreeNode<T>* parent,
     double diffx,diffy,diffz,h,wc,ws;
     double sum = 0.0;
     double normalizer = 0.0;
-    std::list<double>::iterator itd = distances.begin();  
-    typename std::list<T*>::iterator it;
-    for(it = neighbors.begin(); it != neighbors.end(); ++it, ++itd)
+    const size_t nneighbors = neighbors.size();
+    for(size_t i = 0; i < nneighbors; ++i)
     {
-      diffx = (*it)->x() - p.x();
-      diffy = (*it)->y() - p.y();
-      diffz = (*it)->z() - p.z();
+      const T *q = neighbors.neighbors[i];
+      diffx = q->x() - p.x();
+      diffy = q->y() - p.y();
+      diffz = q->z() - p.z();
       h = nx * diffx + ny * diffy + nz * diffz;
 
       wc = exp( h*h * m_normal_weight);
-      ws = exp((*itd) * m_weight);
+      ws = exp(neighbors.sqdistances[i] * m_weight);
       double w = wc * ws;
 
       sum = sum + w * h;
@@ -397,13 +487,67 @@ void TBilateralFilter<T>::applyBilateralFilter(T& p, TOctreeNode<T>* parent,
             p.nx(), p.ny(), p.nz());
     pnew.setIndex(p.index());
 
-    m_octree->addPoint(pnew, index);
+    getStagingBuffer().push_back(pnew);
+}
+
+
+template<class T>
+void TBilateralFilter<T>::indexInitialSamples(TOctreeNode<T>* cell)
+{
+    if(cell == NULL)
+        return;
+    if(cell->getDepth() == 0)
+    {
+        typename TOctreeNode<T>::point_iterator pi;
+        for(pi = cell->points_begin(0); pi != cell->points_end(0); ++pi)
+            m_initialSamples[pi->index()] = &(*pi);
+    }
+    else
+    {
+        for(unsigned int i = 0; i < 8 ; ++i)
+            indexInitialSamples(cell->getChild(i));
+    }
+}
+
+
+template<class T>
+TNeighborBuffer<T>& TBilateralFilter<T>::getScratchBuffer()
+{
+#ifdef _OPENMP
+    return m_scratch[omp_get_thread_num()];
+#else
+    return m_scratch[0];
+#endif
+}
+
+
+template<class T>
+std::vector<T>& TBilateralFilter<T>::getStagingBuffer()
+{
+#ifdef _OPENMP
+    return m_staging[omp_get_thread_num()];
+#else
+    return m_staging[0];
+#endif
 }
 
 
 template<class T>
-void TBilateralFilter<T>::performLocalPCA(const std::list< T* >& neighbors,
-        const std::list< double >& distances,
+void TBilateralFilter<T>::flushStagedPoints(unsigned int nextindex)
+{
+    m_merged.clear();
+    for(size_t t = 0; t < m_staging.size(); ++t)
+    {
+        m_merged.insert(m_merged.end(), m_staging[t].begin(),
+                        m_staging[t].end());
+        m_staging[t].clear();
+    }
+    m_octree->addPoints(m_merged.begin(), m_merged.end(), nextindex);
+}
+
+
+template<class T>
+void TBilateralFilter<T>::performLocalPCA(const TNeighborBuffer<T>& neighbors,
         Point& bar,
         double& nx, double& ny, double& nz) const
 {
@@ -413,15 +557,11 @@ void TBilateralFilter<T>::performLocalPCA(const std::list< T* >& neighbors,
     a00 = a01 = a02 = a11 = a12 = a22 = 0.0;
     double sum_w = 0.0;
 
-    typename std::list<T*>::const_iterator ni;
-    typename std::list<double>::const_iterator di;
-
-
-    for(ni = neighbors.begin(), di = distances.begin() ;
-            ni != neighbors.end() ; ++ni, ++di)
+    const size_t nneighbors = neighbors.size();
+    for(size_t i = 0; i < nneighbors; ++i)
     {
-        const T* s = *ni;
-        const double w = exp((*di)*m_weight);
+        const T* s = neighbors.neighbors[i];
+        const double w = exp(neighbors.sqdistances[i]*m_weight);
 
         double temp = sum_w + w;
         double dx = s->x() - xo;
@@ -0,0 +1,181 @@
+/**
+ * @file ConvexRegion.h
+ * @brief declares a convex region bounded by planes, used for range
+ * queries on the octree (boxes, oriented boxes, view frustums)
+ * @copyright This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CONVEX_REGION_H
+#define CONVEX_REGION_H
+
+#include <cmath>
+#include "Point.h"
+
+/**
+ * @class ConvexRegion
+ * @brief Intersection of half-spaces a*x + b*y + c*z + d >= 0
+ *
+ * Axis-aligned boxes, oriented boxes and view frustums are all built as
+ * sets of planes, so that the octree classifies its cells against any of
+ * them the same way.
+ */
+class ConvexRegion
+{
+    public :
+        /** @brief position of a cell relative to the region*/
+        enum Classification
+        {
+            OUTSIDE = 0,
+            INTERSECTS = 1,
+            INSIDE = 2
+        };
+
+        /** @brief maximal number of planes*/
+        static const int MAX_PLANES = 6;
+
+        /** @brief default constructor: the whole space
+         */
+        ConvexRegion() {
+            m_nplanes = 0;
+        }
+
+        /** @brief axis-aligned box
+         * @param lower lower corner
+         * @param upper upper corner
+         * @return region
+         */
+        static ConvexRegion box(const Point &lower, const Point &upper) {
+            ConvexRegion region;
+            region.addPlane(1, 0, 0, -lower.x());
+            region.addPlane(-1, 0, 0, upper.x());
+            region.addPlane(0, 1, 0, -lower.y());
+            region.addPlane(0, -1, 0, upper.y());
+            region.addPlane(0, 0, 1, -lower.z());
+            region.addPlane(0, 0, -1, upper.z());
+            return region;
+        }
+
+        /** @brief oriented box
+         * @param center center of the box
+         * @param axes three orthonormal axes of the box (one per row)
+         * @param half half extents of the box along its axes
+         * @return region
+         */
+        static ConvexRegion orientedBox(const Point &center,
+                                        const double axes[3][3],
+                                        const double half[3]) {
+            ConvexRegion region;
+            for(int i = 0; i < 3; ++i)
+            {
+                double c = axes[i][0] * center.x() + axes[i][1] * center.y()
+                    + axes[i][2] * center.z();
+                region.addPlane(axes[i][0], axes[i][1], axes[i][2],
+                                half[i] - c);
+                region.addPlane(-axes[i][0], -axes[i][1], -axes[i][2],
+                                half[i] + c);
+            }
+            return region;
+        }
+
+        /** @brief part of the view frustum projecting inside a rectangle
+         * of normalized device coordinates
+         * @param mvp projection * view * model matrix (column-major, as
+         * OpenGL and glm store it)
+         * @param minx rectangle lower x (in [-1, 1])
+         * @param miny rectangle lower y
+         * @param maxx rectangle upper x
+         * @param maxy rectangle upper y
+         * @return region
+         */
+        static ConvexRegion frustum(const float mvp[16],
+                                    double minx, double miny,
+                                    double maxx, double maxy) {
+            //row i of the matrix: mvp[i], mvp[4 + i], mvp[8 + i], mvp[12 + i]
+            //x_clip >= minx * w_clip and so on
+            ConvexRegion region;
+            region.addPlane(mvp[0] - minx * mvp[3], mvp[4] - minx * mvp[7],
+                            mvp[8] - minx * mvp[11], mvp[12] - minx * mvp[15]);
+            region.addPlane(maxx * mvp[3] - mvp[0], maxx * mvp[7] - mvp[4],
+                            maxx * mvp[11] - mvp[8], maxx * mvp[15] - mvp[12]);
+            region.addPlane(mvp[1] - miny * mvp[3], mvp[5] - miny * mvp[7],
+                            mvp[9] - miny * mvp[11], mvp[13] - miny * mvp[15]);
+            region.addPlane(maxy * mvp[3] - mvp[1], maxy * mvp[7] - mvp[5],
+                            maxy * mvp[11] - mvp[9], maxy * mvp[15] - mvp[13]);
+            return region;
+        }
+
+        /** @brief add a bounding plane (ignored beyond MAX_PLANES)
+         * @param a x coefficient
+         * @param b y coefficient
+         * @param c z coefficient
+         * @param d constant term
+         */
+        void addPlane(double a, double b, double c, double d) {
+            if(m_nplanes == MAX_PLANES)
+                return;
+            m_planes[m_nplanes][0] = a;
+            m_planes[m_nplanes][1] = b;
+            m_planes[m_nplanes][2] = c;
+            m_planes[m_nplanes][3] = d;
+            m_nplanes++;
+        }
+
+        /** @brief check if a point is inside the region
+         * @param x x coordinate
+         * @param y y coordinate
+         * @param z z coordinate
+         * @return true if inside
+         */
+        bool contains(double x, double y, double z) const {
+            for(int i = 0; i < m_nplanes; ++i)
+                if(m_planes[i][0] * x + m_planes[i][1] * y
+                   + m_planes[i][2] * z + m_planes[i][3] < 0)
+                    return false;
+            return true;
+        }
+
+        /** @brief classify a cube against the region: for each plane,
+         * the cube corners furthest along and against the normal tell if
+         * the cube is fully on one side
+         * @param origin lower corner of the cube
+         * @param size side of the cube
+         * @return OUTSIDE, INTERSECTS or INSIDE (INTERSECTS may be
+         * returned for cubes outside near the region corners)
+         */
+        Classification classify(const Point &origin, double size) const {
+            bool inside = true;
+            for(int i = 0; i < m_nplanes; ++i)
+            {
+                const double *p = m_planes[i];
+                double center = p[0] * (origin.x() + 0.5 * size)
+                    + p[1] * (origin.y() + 0.5 * size)
+                    + p[2] * (origin.z() + 0.5 * size) + p[3];
+                double radius = 0.5 * size * (fabs(p[0]) + fabs(p[1])
+                                              + fabs(p[2]));
+                if(center + radius < 0)
+                    return OUTSIDE;
+                if(center - radius < 0)
+                    inside = false;
+            }
+            return inside ? INSIDE : INTERSECTS;
+        }
+
+    private :
+
+        /** @brief plane coefficients*/
+        double m_planes[MAX_PLANES][4];
+
+        /** @brief number of planes*/
+        int m_nplanes;
+};
+
+#endif
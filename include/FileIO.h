@@ -4,6 +4,15 @@
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+#include <cstring>
+#ifdef _WIN32
+#include "Dirent/dirent.h"
+#else
+#include <dirent.h>
+#endif
 
 using namespace std;
 
@@ -12,13 +21,16 @@ public:
 	FileIO();
 	static void savePointsAsObj(const std::string dataPath, float* points, int* regions, int num);
     static float* openBinaryPointsFile(const std::string dataPath, int size);
-	static void savePointsAsBinaryFile();
+    static bool savePointsAsBinaryFile(const std::string dataPath, const float* points, const float* amp, int num);
     static int getFileSize(const std::string dataPath);
+    static bool savePng(const std::string dataPath, const unsigned char* rgb, int width, int height);
+    static void listFiles(const std::string dirPath, std::vector<std::string>& files);
+    static std::string baseName(const std::string path);
 };
 
-FileIO::FileIO(){}
+inline FileIO::FileIO(){}
 
-void FileIO::savePointsAsObj(const std::string dataPath, float* points, int* regions, int num){
+inline void FileIO::savePointsAsObj(const std::string dataPath, float* points, int* regions, int num){
     std::ofstream wf(dataPath, std::ios::out);
 	for (int i = 0; i < num; i++) {
 		wf << "v " << points[i * 3] << " " << points[i * 3 + 1] << " " << points[i * 3 + 2] << " " << regions[i] << endl;
@@ -26,7 +38,7 @@ void FileIO::savePointsAsObj(const std::string dataPath, float* points, int* reg
 	wf.close();
 }
 
-int FileIO::getFileSize(const std::string dataPath) {
+inline int FileIO::getFileSize(const std::string dataPath) {
     std::ifstream rf(dataPath, std::ios::binary | std::ios::in);
     // calculate number of points
     rf.seekg(0, std::ios::end);
@@ -34,7 +46,7 @@ int FileIO::getFileSize(const std::string dataPath) {
     rf.close();
     return size;
 }
-float* FileIO::openBinaryPointsFile(const std::string dataPath, int size) {
+inline float* FileIO::openBinaryPointsFile(const std::string dataPath, int size) {
     float* points = new float[size];
     std::ifstream rf(dataPath, std::ios::binary | std::ios::in);
     rf.read((char*)points, size);
@@ -42,7 +54,122 @@ float* FileIO::openBinaryPointsFile(const std::string dataPath, int size) {
     return points;
 }
 
-void FileIO::savePointsAsBinaryFile() {
+// same layout as the files openBinaryPointsFile reads: x, y, z, amplitude
+inline bool FileIO::savePointsAsBinaryFile(const std::string dataPath, const float* points, const float* amp, int num) {
+    std::ofstream wf(dataPath, std::ios::binary | std::ios::out);
+    if (!wf) {
+        return false;
+    }
+    std::vector<float> record(4 * 4096);
+    for (int first = 0; first < num; first += 4096) {
+        int count = std::min(num - first, 4096);
+        for (int i = 0; i < count; i++) {
+            memcpy(&record[i * 4], points + (first + i) * 3, 3 * sizeof(float));
+            record[i * 4 + 3] = amp[first + i];
+        }
+        wf.write((const char*)record.data(), count * 4 * sizeof(float));
+    }
+    return (bool)wf;
+}
+
+// 8 bits RGB, rows from top to bottom. The image data is stored without
+// compression (deflate stored blocks), any PNG reader opens it.
+inline bool FileIO::savePng(const std::string dataPath, const unsigned char* rgb, int width, int height) {
+    std::ofstream wf(dataPath, std::ios::binary | std::ios::out);
+    if (!wf) {
+        return false;
+    }
+    uint32_t table[256];
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        }
+        table[n] = c;
+    }
+    auto put32 = [](std::vector<unsigned char>& out, uint32_t v) {
+        out.push_back(v >> 24);
+        out.push_back((v >> 16) & 0xff);
+        out.push_back((v >> 8) & 0xff);
+        out.push_back(v & 0xff);
+    };
+    auto chunk = [&](const char* type, const std::vector<unsigned char>& data) {
+        std::vector<unsigned char> out;
+        put32(out, (uint32_t)data.size());
+        out.insert(out.end(), type, type + 4);
+        out.insert(out.end(), data.begin(), data.end());
+        uint32_t crc = 0xffffffffu;
+        for (size_t i = 4; i < out.size(); i++) {
+            crc = table[(crc ^ out[i]) & 0xff] ^ (crc >> 8);
+        }
+        put32(out, crc ^ 0xffffffffu);
+        wf.write((const char*)out.data(), out.size());
+    };
+    const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    wf.write((const char*)signature, 8);
+
+    std::vector<unsigned char> header;
+    put32(header, width);
+    put32(header, height);
+    header.push_back(8); // bit depth
+    header.push_back(2); // RGB
+    header.push_back(0);
+    header.push_back(0);
+    header.push_back(0);
+    chunk("IHDR", header);
+
+    // rows with filter type 0, in a zlib stream of stored blocks
+    size_t rowSize = (size_t)width * 3 + 1;
+    std::vector<unsigned char> raw(rowSize * height);
+    for (int y = 0; y < height; y++) {
+        raw[y * rowSize] = 0;
+        memcpy(&raw[y * rowSize + 1], rgb + (size_t)y * width * 3, width * 3);
+    }
+    std::vector<unsigned char> zlib;
+    zlib.push_back(0x78);
+    zlib.push_back(0x01);
+    size_t pos = 0;
+    do {
+        size_t len = std::min(raw.size() - pos, (size_t)65535);
+        zlib.push_back(pos + len == raw.size() ? 1 : 0);
+        zlib.push_back(len & 0xff);
+        zlib.push_back(len >> 8);
+        zlib.push_back(~len & 0xff);
+        zlib.push_back((~len >> 8) & 0xff);
+        zlib.insert(zlib.end(), raw.begin() + pos, raw.begin() + pos + len);
+        pos += len;
+    } while (pos < raw.size());
+    uint32_t a = 1, b = 0;
+    for (size_t i = 0; i < raw.size(); i++) {
+        a = (a + raw[i]) % 65521;
+        b = (b + a) % 65521;
+    }
+    put32(zlib, (b << 16) | a);
+    chunk("IDAT", zlib);
+    chunk("IEND", std::vector<unsigned char>());
+    return (bool)wf;
+}
+
+inline void FileIO::listFiles(const std::string dirPath, std::vector<std::string>& files) {
+    DIR* dir = opendir(dirPath.c_str());
+    if (dir == NULL) {
+        return;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_type == DT_REG) {
+            files.push_back(dirPath + "/" + entry->d_name);
+        }
+    }
+    closedir(dir);
+    std::sort(files.begin(), files.end());
+}
 
+// file name without its directory and extension
+inline std::string FileIO::baseName(const std::string path) {
+    size_t slash = path.find_last_of("/\\");
+    std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+    size_t dot = name.find_last_of('.');
+    return dot == std::string::npos ? name : name.substr(0, dot);
 }
 #endif
\ No newline at end of file
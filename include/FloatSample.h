@@ -0,0 +1,136 @@
+/**
+ * @file FloatSample.h
+ * @brief declares a compact single precision sample
+ * @copyright This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FLOAT_SAMPLE_H
+#define FLOAT_SAMPLE_H
+
+#include "Point.h"
+#include "types.h"
+
+/**
+ * @class FloatSample
+ * @brief Compact input sample: single precision position and index only
+ * (16 bytes instead of 56 for Sample).
+ *
+ * It can replace Sample as the point type of TOctree, TOctreeIterator and
+ * TBilateralFilter: the type the templates are instantiated with is the
+ * precision policy of the whole octree. Normals are not part of the
+ * sample, they read as 0 and, when needed, are stored apart from the
+ * points (e.g. as octree property columns).
+ */
+class FloatSample
+{
+    public :
+        /** @brief default constructor*/
+        FloatSample() {
+            m_x = m_y = m_z = 0.f;
+            m_index = -1;
+        }
+
+        /** @brief constructor from coordinates
+         * @param x x coordinate
+         * @param y y coordinate
+         * @param z z coordinate
+         */
+        FloatSample(double x, double y, double z) {
+            m_x = (float)x;
+            m_y = (float)y;
+            m_z = (float)z;
+            m_index = -1;
+        }
+
+        /** @brief constructor from coordinates and normal (the normal is
+         * not stored)
+         */
+        FloatSample(double x, double y, double z,
+                    double /*nx*/, double /*ny*/, double /*nz*/) {
+            m_x = (float)x;
+            m_y = (float)y;
+            m_z = (float)z;
+            m_index = -1;
+        }
+
+        /** @brief access x coordinate
+         * @return x
+         */
+        double x() const {
+            return m_x;
+        }
+
+        /** @brief access y coordinate
+         * @return y
+         */
+        double y() const {
+            return m_y;
+        }
+
+        /** @brief access z coordinate
+         * @return z
+         */
+        double z() const {
+            return m_z;
+        }
+
+        /** @brief get x normal component (not stored)
+         * @return 0
+         */
+        double nx() const {
+            return 0.0;
+        }
+
+        /** @brief get y normal component (not stored)
+         * @return 0
+         */
+        double ny() const {
+            return 0.0;
+        }
+
+        /** @brief get z normal component (not stored)
+         * @return 0
+         */
+        double nz() const {
+            return 0.0;
+        }
+
+        /** @brief get index of the sample
+         * @return index
+         */
+        int index() const {
+            return m_index;
+        }
+
+        /** @brief set the sample index
+         * @param index to set
+         */
+        void setIndex(int index) {
+            m_index = index;
+        }
+
+        /** @brief the sample as a double precision point (queries)
+         */
+        operator Point() const {
+            return Point(m_x, m_y, m_z);
+        }
+
+    private :
+
+        /** @brief coordinates*/
+        float m_x, m_y, m_z;
+
+        /** @brief sample index*/
+        int m_index;
+};
+
+#endif
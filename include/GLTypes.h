@@ -0,0 +1,11 @@
+#ifndef GL_TYPES_H
+#define GL_TYPES_H
+
+// Scalar types of the GL API the point arrays are declared with. The
+// processing code needs these and no GL loader, so that it builds on machines
+// without OpenGL; they are the types glad declares, and repeating a typedef
+// of the same type is allowed.
+typedef float GLfloat;
+typedef unsigned short GLushort;
+
+#endif
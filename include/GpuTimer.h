@@ -0,0 +1,27 @@
+#ifndef GPU_TIMER_H
+#define GPU_TIMER_H
+
+#include <glad/glad.h>
+
+// GPU duration of a draw pass, from GL_TIME_ELAPSED queries read back a few
+// frames later so that the pipeline is never waited on. The results go to
+// the profiler on its GPU timeline, at the time the pass was issued.
+class GpuTimer {
+public:
+    static const int QUERIES = 4;
+    GpuTimer();
+    void create(const char* name);
+    void destroy();
+    void begin();
+    void end();
+    void poll();
+private:
+    const char* name;
+    GLuint queries[QUERIES];
+    double issued[QUERIES];
+    bool pending[QUERIES];
+    int current;
+    bool active;
+};
+
+#endif
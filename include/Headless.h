@@ -0,0 +1,32 @@
+#ifndef HEADLESS_H
+#define HEADLESS_H
+
+#include <string>
+
+using namespace std;
+
+// Offscreen rendering of scans to PNG, for reports. A batch renders every
+// file of a directory, each in its own worker process:
+//   3DSonalVis --batch <dir> [--out <dir>] [--jobs <n>] [options]
+// and a worker renders one file:
+//   3DSonalVis --render <file> [--out <dir>] [options]
+// with the options --size <width> <height>, --turntable <frames> (camera
+// presets when 0), --threshold <amplitude threshold> and --threads <n>.
+// The GL context is the one of a hidden window, drawing into a framebuffer
+// object: a software OpenGL 3.3 driver (Mesa llvmpipe) works on machines
+// without a GPU.
+struct HeadlessOptions {
+    string outDir;
+    int width, height;
+    int turntable;
+    float threshold;
+    int jobs;
+    int threads;
+    HeadlessOptions();
+};
+
+int runHeadless(int argc, char** argv);
+int renderScan(const string& path, const HeadlessOptions& options);
+int renderBatch(const string& executable, const string& dir, const HeadlessOptions& options);
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef ID_PICKER_H
+#define ID_PICKER_H
+
+#include <glad/glad.h>
+
+// Picking through an offscreen integer render target: the points are drawn
+// with their render slot + 1 (0 for the background) in a small window around
+// the cursor, which is read back asynchronously through two pixel buffer
+// objects. A result is mapped one frame or more later, once the fence of its
+// readback has been passed, so the pipeline never waits on the CPU.
+class IdPicker {
+public:
+    int width, height;
+    int radius;
+
+    IdPicker();
+    void create(int width, int height, int radius);
+    void destroy();
+    void begin(int x, int y);
+    void end(unsigned int tag);
+    bool poll(unsigned int& slot, unsigned int& tag);
+    void discard();
+private:
+    GLuint fbo, idTexture, depthBuffer;
+    GLuint pbos[2];
+    GLsync fences[2];
+    unsigned int tags[2];
+    int current;
+    int readX, readY, readSize;
+};
+
+#endif
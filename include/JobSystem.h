@@ -0,0 +1,57 @@
+#ifndef JOB_SYSTEM_H
+#define JOB_SYSTEM_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+using namespace std;
+
+// A long operation run by a worker thread. The worker reports its progress
+// and checks for cancellation through report(); the result is handed over by
+// finish, called on the main thread at a frame boundary once the run is over.
+class Job {
+public:
+    enum State { QUEUED, RUNNING, DONE, CANCELLED };
+    string name;
+    atomic<int> state;
+    atomic<float> progress;
+    atomic<bool> cancelled;
+    function<void(Job&)> run;
+    function<void()> finish;
+
+    Job(const string& name);
+    bool report(float progress);
+    void cancel();
+};
+
+// Fixed pool of workers taking the jobs in submission order. poll() is
+// called once per frame: it hands over the results of the finished jobs and
+// forgets the cancelled ones.
+class JobSystem {
+public:
+    JobSystem();
+    ~JobSystem();
+    void start(unsigned int workers);
+    void stop();
+    shared_ptr<Job> submit(const string& name, function<void(Job&)> run, function<void()> finish);
+    void poll();
+    bool isBusy() const;
+    vector<shared_ptr<Job> > getJobs() const;
+private:
+    vector<thread> workers;
+    deque<shared_ptr<Job> > queue;
+    vector<shared_ptr<Job> > jobs;
+    mutable mutex lock;
+    condition_variable wakeup;
+    bool stopping;
+    void work();
+};
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef LOD_HIERARCHY_H
+#define LOD_HIERARCHY_H
+
+#include <vector>
+#include <algorithm>
+
+#include "ConvexRegion.h"
+
+using namespace std;
+
+// span [first, first + count) of the render order
+typedef pair<unsigned int, unsigned int> RenderSpan;
+
+// Level of detail hierarchy for rendering. Every octree node keeps a spatially
+// uniform subset of the points of its cube (one per cell of a 16^3 grid) that
+// its ancestors did not take; the leaves keep all the remaining points. The
+// points are reordered so that the representatives of each node are a
+// contiguous range of the render order, and a frame draws the ranges of the
+// nodes it selects. The nodes are the tiles the GPU positions are quantized in.
+// Removing points compacts each node in its own slots, so
+// that only the ranges of the nodes that lost points change.
+class LodHierarchy {
+public:
+    struct Node {
+        float origin[3];
+        float size;
+        unsigned int first, count, slots;
+        int children[8];
+    };
+    unsigned int version;
+    unsigned int stride;
+    vector<Node> nodes;
+    vector<unsigned int> order;
+
+    LodHierarchy();
+    bool isValid(unsigned int version) const;
+    void build(const float* points, int num, unsigned int version, unsigned int capacity = 4096, unsigned int stride = 3);
+    void compact(const int* remap, unsigned int version, vector<RenderSpan>& changed);
+    void clear();
+    int findNode(unsigned int slot) const;
+    unsigned int select(const ConvexRegion& frustum, const float eye[3], float pixelFactor, float minPixels, unsigned int budget, vector<int>& selected) const;
+private:
+    void buildNode(int node, const float* points, unsigned int begin, unsigned int end, int depth, unsigned int capacity, vector<unsigned int>& tmp, vector<unsigned char>& cls, vector<int>& cells);
+};
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef NEIGHBORHOOD_CACHE_H
+#define NEIGHBORHOOD_CACHE_H
+
+#include <vector>
+#include <algorithm>
+
+#include "types.h"
+
+using namespace std;
+
+// Radius neighborhoods of every point of a cloud version, computed at the
+// radius of the stage that needs them. Each row is sorted by increasing
+// distance so that a later stage using a smaller radius only reads the
+// beginning of the rows.
+class NeighborhoodCache {
+public:
+    float radius;
+    unsigned int version;
+    vector<size_t> offsets;
+    vector<unsigned int> indices;
+    vector<float> sqDistances;
+
+    NeighborhoodCache();
+    bool isValid(unsigned int version, float radius) const;
+    void assign(vector<size_t>& rowOffsets, vector<unsigned int>& rowIndices, vector<float>& rowSqDistances, int num, float radius, unsigned int version);
+    void compact(const bool* keep, int num, unsigned int version);
+    void clear();
+    size_t count(int i, float sqRadius) const;
+    const unsigned int* row(int i) const;
+};
+
+#endif
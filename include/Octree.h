@@ -21,9 +21,15 @@
 #include "utilities.h"
 #include "Point.h"
 #include "OctreeNode.h"
+#include "ConvexRegion.h"
 #include <cstdio>
+#include <cmath>
+#include <limits>
+#include <algorithm>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <fstream>
 #include <vector>
 
 /**
@@ -122,11 +128,88 @@ class TOctree
         void addInitialPoint(T &pt);
 
         /** @brief Adding a point to the octree
+         * (not thread-safe: parallel insertions go through addPoints)
          * @param pt point to add
          * @param index index of the list to add the point to (0,1,2)
          */
         void addPoint(T &pt, unsigned int index);
 
+        /** @brief Adding a batch of points to a set without locking:
+         * the points are sorted by leaf, the missing leaves are created
+         * sequentially, then each leaf receives its run of points in
+         * parallel. The points of a leaf keep their order in the batch.
+         * @param begin begin random access iterator of the batch
+         * @param end end random access iterator of the batch
+         * @param index index of the list to add the points to (1,2)
+         */
+        template<class Iterator>
+        void addPoints(Iterator begin, Iterator end, unsigned int index);
+
+    public : //range queries
+
+        /** @brief get the points of a set inside a region (axis-aligned
+         * box, oriented box or frustum, see ConvexRegion). Cells fully
+         * inside the region are taken whole, cells fully outside are
+         * skipped, only the points of the boundary leaves are tested.
+         * The subtrees a few levels below the root are processed in
+         * parallel; the points come out in octree order.
+         * @param region region, with classify(origin, size) and
+         * contains(x, y, z) methods
+         * @param[out] points points inside the region
+         * @param index index of the set to query
+         */
+        template<class Region>
+        void getPointsInRegion(const Region &region, std::vector<T*> &points,
+                               unsigned int index = 0);
+
+        /** @brief pick the first point along a ray: among the points
+         * of a set inside the cone of given half-angle around the ray,
+         * the one closest to the ray origin along the ray. The nodes are
+         * visited front to back with slab tests against their bounding
+         * boxes inflated by the cone radius, and the nodes entered beyond
+         * the best point found are skipped.
+         * @param origin origin of the ray (e.g. the eye)
+         * @param direction direction of the ray (not necessarily unit)
+         * @param tan_radius tangent of the cone half-angle (pick radius
+         * divided by the distance it is measured at)
+         * @param index index of the set to query
+         * @return picked point, NULL if there is none in the cone
+         */
+        T* pickOnRay(const Point &origin, const Point &direction,
+                     double tan_radius, unsigned int index = 0);
+
+    public : //removing points
+
+        /** @brief remove points given by their position and sample index:
+         * each point is looked for in the leaf its position falls in, the
+         * leaves are compacted and the nodes left empty are pruned
+         * bottom-up. The cost is proportional to the number of points
+         * removed (and the size of their leaves).
+         * Iterators built on the octree must rebuild their cell table.
+         * @param begin begin iterator of the points to remove
+         * @param end end iterator of the points to remove
+         * @param index index of the set to remove the points from
+         * @return number of removed points
+         */
+        template<class Iterator>
+        unsigned int removePoints(Iterator begin, Iterator end,
+                                  unsigned int index = 0);
+
+        /** @brief remove the points of a box matching a predicate: only
+         * the leaves intersecting the box are visited, every point of
+         * these leaves is given to the predicate. The leaves are compacted
+         * and the nodes left empty are pruned bottom-up.
+         * Iterators built on the octree must rebuild their cell table.
+         * @param lower lower corner of the box
+         * @param upper upper corner of the box
+         * @param pred predicate, true for the points to remove
+         * @param index index of the set to remove the points from
+         * @return number of removed points
+         */
+        template<class Predicate>
+        unsigned int removePoints(const Point &lower, const Point &upper,
+                                  Predicate pred, unsigned int index = 0);
+
         /**
          * @brief Adding a batch of points to the octree
          * @param begin begin iterator of the batch
@@ -136,6 +219,20 @@ class TOctree
         template<class Iterator>
         unsigned int addInitialPoints(Iterator begin, Iterator end);
 
+        /**
+         * @brief Adding a batch of points to an empty octree in one pass:
+         * the Morton codes of the points are computed and radix sorted in
+         * parallel, then the nodes are built bottom-up from the boundaries
+         * of the runs of equal codes
+         * Falls back to addInitialPoints if the octree is not empty or
+         * too deep for 64 bits Morton codes
+         * @param begin begin random access iterator of the batch
+         * @param end end random access iterator of the batch
+         * @return number of added points
+         */
+        template<class Iterator>
+        unsigned int bulkAddInitialPoints(Iterator begin, Iterator end);
+
         /** @brief print the mean number of points per non empty cell
          * at each level
          */
@@ -165,7 +262,21 @@ class TOctree
          */
         void clearSet(unsigned int index);
 
-        /** @brief add a property to the vector of properties
+        /** @brief declare the sample properties once for all samples:
+         * nprop columns of nsamples values each, stored in single or
+         * double precision. Existing properties are discarded.
+         * @param nsamples number of samples
+         * @param nprop number of values per sample
+         * @param single_precision store the values as floats if true,
+         * as doubles otherwise
+         */
+        void declareProperties(size_t nsamples, size_t nprop,
+                               bool single_precision = true);
+
+        /** @brief add the properties of one more sample (all set to 0)
+         * the number of values must match the declared property count
+         * (it is declared by the first call if no property exists yet, in
+         * double precision unless declareProperties chose floats before)
          * @param nprop number of values per sample property
          */
         void addProperty(size_t nprop);
@@ -184,11 +295,71 @@ class TOctree
          */
         double getProperty(size_t sample_index, size_t prop_index) const;
 
+        /** @brief set a whole property column
+         * @param prop_index index of the property
+         * @param values one value per sample, read every stride elements
+         * @param stride distance between two consecutive values
+         */
+        template<class V>
+        void setPropertyColumn(size_t prop_index, const V *values,
+                               size_t stride = 1);
+
+        /** @brief get a whole property column
+         * @param prop_index index of the property
+         * @param[out] values one value per sample, written every stride
+         * elements
+         * @param stride distance between two consecutive values
+         */
+        template<class V>
+        void getPropertyColumn(size_t prop_index, V *values,
+                               size_t stride = 1) const;
+
+        /** @brief get the values of a property for a list of samples
+         * @param prop_index index of the property
+         * @param indices sample indices
+         * @param n number of sample indices
+         * @param[out] values one value per index, written every stride
+         * elements
+         * @param stride distance between two consecutive values
+         */
+        template<class V>
+        void gatherPropertyColumn(size_t prop_index,
+                                  const unsigned int *indices, size_t n,
+                                  V *values, size_t stride = 1) const;
+
         /**get the number of properties per point
          @return size of the sample properties
          */
         size_t getNproperties();
 
+    public : //snapshots
+
+        /** @brief save the octree structure and its initial set to a
+         * snapshot file, so that it can be restored without sorting the
+         * points again. The file is a fixed header followed by the nodes
+         * (pre-order) and the sample indices of the points (leaf order),
+         * as flat arrays of fixed size records, so it can be mapped as is.
+         * Coordinates, properties and filtered sets are not saved: the
+         * points are rebuilt from the input samples on load.
+         * @param path snapshot file
+         * @param key identifier of the content (typically a hash of the
+         * input points and of the construction parameters)
+         * @return true if the snapshot was written
+         */
+        bool saveSnapshot(const char *path, uint64_t key) const;
+
+        /** @brief restore an empty octree from a snapshot file
+         * @param path snapshot file
+         * @param key expected content identifier
+         * @param points coordinates of the input samples (x, y, z for each
+         * sample), the ones the snapshot was built from
+         * @param nsamples number of samples the point indices refer to
+         * @return true if the file exists, matches the key, describes a
+         * consistent tree holding each sample index once and was loaded
+         */
+        bool loadSnapshot(const char *path, uint64_t key,
+                          const float *points, unsigned int nsamples);
+
     protected :
 
         /** @brief Maximum depth of the octree*/
@@ -216,9 +387,181 @@ class TOctree
         std::vector<unsigned int> m_nb_non_empty_cells;
 
         /** @brief properties of the samples leaved untouched by the filter
-         * these properties are indexed by the indices of the points
+         * one column per property, indexed by the indices of the points
+         * (only one of the two collections is used, depending on the
+         * declared precision)
+         */
+        std::vector<std::vector<float> > m_fproperties;
+
+        /** @brief double precision property columns*/
+        std::vector<std::vector<double> > m_dproperties;
+
+        /** @brief true if the properties are stored as floats (false
+         * until declareProperties asks for floats, so that the per sample
+         * API keeps its double precision)*/
+        bool m_single_precision;
+
+        /** @brief memory of the nodes and of the leaf point sets*/
+        TOctreeAllocator<T> m_allocator;
+
+    private :
+        /** @brief leaf coordinate of a point along an axis, clamped to the
+         * octree so that a point on its upper bound falls in the last leaf
+         * @param value coordinate of the point
+         * @param origin coordinate of the octree origin
+         * @return leaf coordinate in [0, binsize - 1]
+         */
+        unsigned int getLeafCoordinate(double value, double origin) const;
+
+        /** @brief snapshot file header*/
+        struct SnapshotHeader
+        {
+            char magic[8];
+            uint64_t key;
+            uint32_t depth;
+            uint32_t nnodes;
+            uint32_t npoints;
+            uint32_t point_size;
+            double origin[3];
+            double size;
+        };
+
+        /** @brief snapshot node record
+         * depth and child index share a field: (depth << 8) | child
+         */
+        struct SnapshotNode
+        {
+            uint32_t xloc;
+            uint32_t yloc;
+            uint32_t zloc;
+            uint32_t depth_child;
+            uint32_t first;
+            uint32_t count;
+        };
+
+        /** @brief collect the snapshot records of a node and its children
+         * @param node node to save
+         * @param[out] nodes node records
+         * @param[out] indices sample indices of the points
+         */
+        void getSnapshotRecords(TOctreeNode<T> *node,
+                                std::vector<SnapshotNode> &nodes,
+                                std::vector<int32_t> &indices) const;
+
+        /** @brief get the subtrees to query in parallel: the cells
+         * of a given depth that are not outside the region, or the
+         * shallower cells fully inside
+         * @param node node to start from
+         * @param region region
+         * @param depth depth of the cells to split the work on
+         * @param[out] tasks cells to process
+         * @param[out] inside true for the cells known to be fully inside
+         */
+        template<class Region>
+        void getRegionTasks(TOctreeNode<T> *node, const Region &region,
+                            unsigned int depth,
+                            std::vector< TOctreeNode<T>* > &tasks,
+                            std::vector<char> &inside);
+
+        /** @brief get the points of a set inside a region, below a node
+         * @param node node to process
+         * @param region region
+         * @param inside true if the node is known to be fully inside
+         * @param[out] points points inside the region
+         * @param index index of the set to query
+         */
+        template<class Region>
+        void getPointsInRegion(TOctreeNode<T> *node, const Region &region,
+                               bool inside, std::vector<T*> &points,
+                               unsigned int index);
+
+        /** @brief distances along a ray where it enters and leaves the
+         * bounding box of a node, inflated by the cone radius at the far
+         * side of the box
+         * @param node node
+         * @param o ray origin
+         * @param d unit ray direction
+         * @param tan_radius tangent of the cone half-angle
+         * @param[out] tenter entry distance
+         * @param[out] texit exit distance
+         * @return true if the inflated box is hit in front of the origin
+         */
+        bool raySlabs(const TOctreeNode<T> *node, const double o[3],
+                      const double d[3], double tan_radius,
+                      double &tenter, double &texit) const;
+
+        /** @brief pick the first point along a ray, below a node
+         * @param node node to process
+         * @param o ray origin
+         * @param d unit ray direction
+         * @param tan_radius tangent of the cone half-angle
+         * @param index index of the set
+         * @param[in,out] best_t distance of the best point so far
+         * @param[in,out] best best point so far
+         */
+        void pickOnRay(TOctreeNode<T> *node, const double o[3],
+                       const double d[3], double tan_radius,
+                       unsigned int index, double &best_t, T* &best);
+
+        /** @brief predicate matching the samples of a sorted index range
+         */
+        struct IndexRange
+        {
+            const int *first;
+            const int *last;
+            IndexRange(const int *f, const int *l) : first(f), last(l) {}
+            bool operator()(const T &pt) const
+            {
+                return std::binary_search(first, last, pt.index());
+            }
+        };
+
+        /** @brief remove the points of a box matching a predicate, below
+         * a node
+         * @param node node to process
+         * @param lower lower corner of the box
+         * @param upper upper corner of the box
+         * @param pred predicate
+         * @param index index of the set
+         * @param[out] leaves leaves that lost points
+         * @return number of removed points
+         */
+        template<class Predicate>
+        unsigned int removePoints(TOctreeNode<T> *node, const Point &lower,
+                                  const Point &upper, Predicate &pred,
+                                  unsigned int index,
+                                  std::vector< TOctreeNode<T>* > &leaves);
+
+        /** @brief detach and destroy a node left empty, then its ancestors
+         * left empty (the root is kept)
+         * @param node node to prune
+         */
+        void pruneNode(TOctreeNode<T> *node);
+
+        /** @brief get the leaf of given locational codes
+         * @param codx x locational code
+         * @param cody y locational code
+         * @param codz z locational code
+         * @param create create the leaf and the missing nodes above it
+         * @return leaf (NULL if it does not exist and create is false)
+         */
+        TOctreeNode<T>* getLeaf(unsigned int codx, unsigned int cody,
+                                unsigned int codz, bool create);
+
+        /** @brief build a node in the octree memory
+         * @param origin origin of the node
+         * @param size side size of the node
+         * @param depth depth of the node
+         * @return created node
+         */
+        TOctreeNode<T>* createNode(Point &origin, double size,
+                                   unsigned int depth);
+
+        /** @brief destroy a node and its children (their memory is given
+         * back when the allocator is released)
+         * @param node node to destroy
          */
-        std::vector<std::vector<double> > m_properties;
+        void destroyNode(TOctreeNode<T> *node);
 };
 
 template<class T>
@@ -229,8 +572,8 @@ TOctree<T>::TOctree()
     m_binsize = 0;
     m_npoints = 0;
     m_origin = Point();
-    m_root = new TOctreeNode<T>();
-    m_root->setDepth(0);
+    m_single_precision = false;
+    m_root = createNode(m_origin, 0.0, 0);
 }
 
 
@@ -242,6 +585,7 @@ TOctree<T>::TOctree(unsigned int depth)
     m_binsize = pow2(depth);
     m_npoints = 0;
     m_root = NULL;
+    m_single_precision = false;
     m_nb_non_empty_cells.assign(depth,0);
 }
 
@@ -255,6 +599,7 @@ TOctree<T>::TOctree(Point& origin, double size, unsigned int depth)
     m_origin = origin;
     m_npoints = 0;
     m_root = NULL;
+    m_single_precision = false;
     m_nb_non_empty_cells.assign(depth,0);
 }
 
@@ -269,20 +614,42 @@ TOctree<T>::~TOctree()
 
     if(m_root != NULL)
     {
-        delete m_root;
+        destroyNode(m_root);
         m_root = NULL;
     }
+    //all the nodes and point chunks go at once
+    m_allocator.release();
     m_nb_non_empty_cells.clear();
 }
 
 
+template<class T>
+TOctreeNode<T>* TOctree<T>::createNode(Point& origin, double size,
+                                       unsigned int depth)
+{
+    void *memory = m_allocator.allocate(sizeof(TOctreeNode<T>));
+    return new (memory) TOctreeNode<T>(origin, size, depth, &m_allocator);
+}
+
+
+template<class T>
+void TOctree<T>::destroyNode(TOctreeNode<T>* node)
+{
+    if(node->getDepth() > 0)
+        for(unsigned int i = 0; i < 8; ++i)
+            if(node->getChild(i) != NULL)
+                destroyNode(node->getChild(i));
+    node->~TOctreeNode<T>();
+}
+
+
 template<class T>
 void TOctree<T>::initialize(Point& origin, double size)
 {
     m_size = size;
     m_origin = origin;
 
-    m_root = new TOctreeNode<T>(m_origin, m_size, m_depth);
+    m_root = createNode(m_origin, m_size, m_depth);
     m_root->setXLoc(0);
     m_root->setYLoc(0);
     m_root->setZLoc(0);
@@ -363,15 +730,146 @@ unsigned int TOctree<T>::addInitialPoints(Iterator begin, Iterator end)
     return m_npoints;
 }
 
+template<class T>
+template<class Iterator>
+unsigned int TOctree<T>::bulkAddInitialPoints(Iterator begin, Iterator end)
+{
+    const int n = (int)(end - begin);
+    if(n == 0)
+        return m_npoints;
+
+    bool empty = (m_npoints == 0);
+    for(unsigned int i = 0; i < 8; ++i)
+        if(m_root->getChild(i) != NULL)
+            empty = false;
+    if(!empty || m_depth == 0 || m_depth > 21)
+        return addInitialPoints(begin, end);
+
+    //locational codes of the points
+    std::vector<uint64_t> codes(n);
+    std::vector<unsigned int> order(n);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+    for(int i = 0; i < n; ++i)
+    {
+        const T &pt = begin[i];
+        unsigned int codx = getLeafCoordinate(pt.x(), m_origin.x());
+        unsigned int cody = getLeafCoordinate(pt.y(), m_origin.y());
+        unsigned int codz = getLeafCoordinate(pt.z(), m_origin.z());
+        codes[i] = mortonEncode(codx, cody, codz);
+        order[i] = (unsigned int)i;
+    }
+
+    parallelRadixSort(codes, order, 3 * m_depth);
+
+    //leaves: one per run of equal codes
+    const double leaf_size = m_size / (double)m_binsize;
+    std::vector<unsigned int> starts;
+    getRunStarts(codes, 0, starts);
+
+    int nnodes = (int)starts.size() - 1;
+    std::vector< TOctreeNode<T>* > nodes(nnodes);
+    std::vector<uint64_t> node_codes(nnodes);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 64)
+#endif
+    for(int r = 0; r < nnodes; ++r)
+    {
+        uint64_t code = codes[starts[r]];
+        unsigned int xloc, yloc, zloc;
+        mortonDecode(code, xloc, yloc, zloc);
+        Point origin(m_origin.x() + xloc * leaf_size,
+                     m_origin.y() + yloc * leaf_size,
+                     m_origin.z() + zloc * leaf_size);
+        TOctreeNode<T> *leaf = createNode(origin, leaf_size, 0);
+        leaf->setXLoc(xloc);
+        leaf->setYLoc(yloc);
+        leaf->setZLoc(zloc);
+        for(unsigned int i = starts[r]; i < starts[r + 1]; ++i)
+        {
+            T &pt = begin[order[i]];
+            leaf->addInitialPoint(pt);
+        }
+        nodes[r] = leaf;
+        node_codes[r] = code;
+    }
+    m_nb_non_empty_cells[0] += nnodes;
+
+    //inner nodes, level by level: the children of a node are the runs of
+    //codes sharing the same prefix at the node depth
+    std::vector< TOctreeNode<T>* > parents;
+    for(unsigned int depth = 1; depth < m_depth; ++depth)
+    {
+        getRunStarts(node_codes, 3 * depth, starts);
+        int nparents = (int)starts.size() - 1;
+        parents.resize(nparents);
+        double size = leaf_size * (double)pow2(depth);
+        unsigned int mask = ~((1u << depth) - 1);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 64)
+#endif
+        for(int r = 0; r < nparents; ++r)
+        {
+            unsigned int xloc, yloc, zloc;
+            mortonDecode(node_codes[starts[r]], xloc, yloc, zloc);
+            xloc &= mask;
+            yloc &= mask;
+            zloc &= mask;
+            Point origin(m_origin.x() + xloc * leaf_size,
+                         m_origin.y() + yloc * leaf_size,
+                         m_origin.z() + zloc * leaf_size);
+            TOctreeNode<T> *node = createNode(origin, size, depth);
+            node->setXLoc(xloc);
+            node->setYLoc(yloc);
+            node->setZLoc(zloc);
+            for(unsigned int i = starts[r]; i < starts[r + 1]; ++i)
+            {
+                unsigned int childIndex =
+                    (unsigned int)((node_codes[i] >> (3 * (depth - 1))) & 7);
+                node->setChild(childIndex, nodes[i]);
+            }
+            parents[r] = node;
+        }
+        m_nb_non_empty_cells[depth] += nparents;
+
+        //keep the first code of each run to represent the parent
+        for(int r = 0; r < nparents; ++r)
+            node_codes[r] = node_codes[starts[r]];
+        node_codes.resize(nparents);
+        nodes.swap(parents);
+    }
+
+    //attach the remaining nodes to the root
+    for(size_t i = 0; i < nodes.size(); ++i)
+    {
+        unsigned int childIndex =
+            (unsigned int)((node_codes[i] >> (3 * (m_depth - 1))) & 7);
+        m_root->setChild(childIndex, nodes[i]);
+    }
+
+    m_npoints += n;
+    return m_npoints;
+}
+
+template<class T>
+unsigned int TOctree<T>::getLeafCoordinate(double value, double origin) const
+{
+    double cell = (value - origin) / m_size * m_binsize;
+    if(!(cell > 0))
+        return 0;
+    if(cell >= (double)m_binsize)
+        return m_binsize - 1;
+    return (unsigned int)cell;
+}
+
+
 template<class T>
 void TOctree<T>::addInitialPoint(T& pt)
 {
-    unsigned int codx=(unsigned int)((pt.x() - m_origin.x()) / m_size *
-                                        m_binsize);
-    unsigned int cody=(unsigned int)((pt.y() - m_origin.y()) / m_size *
-                                        m_binsize);
-    unsigned int codz=(unsigned int)((pt.z() - m_origin.z())/ m_size *
-                                        m_binsize);
+    unsigned int codx = getLeafCoordinate(pt.x(), m_origin.x());
+    unsigned int cody = getLeafCoordinate(pt.y(), m_origin.y());
+    unsigned int codz = getLeafCoordinate(pt.z(), m_origin.z());
     TOctreeNode<T> *node=getRoot();
     unsigned int l=node->getDepth()-1;
 
@@ -414,12 +912,589 @@ void TOctree<T>::addInitialPoint(T& pt)
 template<class T>
 void TOctree<T>::addPoint(T& pt, unsigned int index)
 {
-    unsigned int codx=(unsigned int)((pt.x() - m_origin.x()) / m_size *
-                                        m_binsize);
-    unsigned int cody=(unsigned int)((pt.y() - m_origin.y()) / m_size *
-                                        m_binsize);
-    unsigned int codz=(unsigned int)((pt.z() - m_origin.z())/ m_size *
-                                        m_binsize);
+    unsigned int codx = getLeafCoordinate(pt.x(), m_origin.x());
+    unsigned int cody = getLeafCoordinate(pt.y(), m_origin.y());
+    unsigned int codz = getLeafCoordinate(pt.z(), m_origin.z());
+
+    //add the point to the leaf.
+    getLeaf(codx, cody, codz, true)->addPoint(pt,index);
+}
+
+
+template<class T>
+template<class Iterator>
+void TOctree<T>::addPoints(Iterator begin, Iterator end, unsigned int index)
+{
+    const int n = (int)(end - begin);
+    if(n == 0)
+        return;
+    if(m_depth == 0 || m_depth > 21)
+    {
+        for(Iterator it = begin; it != end; ++it)
+            addPoint(*it, index);
+        return;
+    }
+
+    //leaf codes of the points
+    std::vector<uint64_t> codes(n);
+    std::vector<unsigned int> order(n);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+    for(int i = 0; i < n; ++i)
+    {
+        const T &pt = begin[i];
+        unsigned int codx = getLeafCoordinate(pt.x(), m_origin.x());
+        unsigned int cody = getLeafCoordinate(pt.y(), m_origin.y());
+        unsigned int codz = getLeafCoordinate(pt.z(), m_origin.z());
+        codes[i] = mortonEncode(codx, cody, codz);
+        order[i] = (unsigned int)i;
+    }
+
+    parallelRadixSort(codes, order, 3 * m_depth);
+
+    std::vector<unsigned int> starts;
+    getRunStarts(codes, 0, starts);
+    const int nleaves = (int)starts.size() - 1;
+
+    //look the leaves up, then create the missing ones sequentially
+    std::vector< TOctreeNode<T>* > leaves(nleaves);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 256)
+#endif
+    for(int r = 0; r < nleaves; ++r)
+    {
+        unsigned int xloc, yloc, zloc;
+        mortonDecode(codes[starts[r]], xloc, yloc, zloc);
+        leaves[r] = getLeaf(xloc, yloc, zloc, false);
+    }
+    for(int r = 0; r < nleaves; ++r)
+    {
+        if(leaves[r] == NULL)
+        {
+            unsigned int xloc, yloc, zloc;
+            mortonDecode(codes[starts[r]], xloc, yloc, zloc);
+            leaves[r] = getLeaf(xloc, yloc, zloc, true);
+        }
+    }
+
+    //each leaf is filled by a single thread
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 64)
+#endif
+    for(int r = 0; r < nleaves; ++r)
+    {
+        TOctreeNode<T> *leaf = leaves[r];
+        for(unsigned int i = starts[r]; i < starts[r + 1]; ++i)
+            leaf->addPoint(begin[order[i]], index);
+    }
+}
+
+
+template<class T>
+void TOctree<T>::getSnapshotRecords(TOctreeNode<T>* node,
+                                   std::vector<SnapshotNode>& nodes,
+                                   std::vector<int32_t>& indices) const
+{
+    SnapshotNode record;
+    record.xloc = node->getXLoc();
+    record.yloc = node->getYLoc();
+    record.zloc = node->getZLoc();
+    record.depth_child = (node->getDepth() << 8)
+        | (node->getParent() == NULL ? 8 : node->getNChild());
+    record.first = (uint32_t)indices.size();
+    record.count = 0;
+    if(node->getDepth() == 0)
+    {
+        typename TOctreeNode<T>::const_point_iterator pi;
+        for(pi = node->points_begin(0); pi != node->points_end(0); ++pi)
+            indices.push_back((int32_t)pi->index());
+        record.count = (uint32_t)indices.size() - record.first;
+    }
+    nodes.push_back(record);
+
+    if(node->getDepth() > 0)
+        for(unsigned int i = 0; i < 8; ++i)
+            if(node->getChild(i) != NULL)
+                getSnapshotRecords(node->getChild(i), nodes, indices);
+}
+
+
+template<class T>
+bool TOctree<T>::saveSnapshot(const char *path, uint64_t key) const
+{
+    if(m_root == NULL)
+        return false;
+
+    std::vector<SnapshotNode> nodes;
+    std::vector<int32_t> indices;
+    indices.reserve(m_npoints);
+    getSnapshotRecords(m_root, nodes, indices);
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "OCTSNAP2", 8);
+    header.key = key;
+    header.depth = m_depth;
+    header.nnodes = (uint32_t)nodes.size();
+    header.npoints = (uint32_t)indices.size();
+    header.point_size = sizeof(int32_t);
+    header.origin[0] = m_origin.x();
+    header.origin[1] = m_origin.y();
+    header.origin[2] = m_origin.z();
+    header.size = m_size;
+
+    std::ofstream out(path, std::ios::out | std::ios::binary);
+    if(!out)
+        return false;
+    out.write((const char*)&header, sizeof(header));
+    if(!nodes.empty())
+        out.write((const char*)&nodes[0], nodes.size() * sizeof(SnapshotNode));
+    if(!indices.empty())
+        out.write((const char*)&indices[0], indices.size() * sizeof(int32_t));
+    return out.good();
+}
+
+
+template<class T>
+bool TOctree<T>::loadSnapshot(const char *path, uint64_t key,
+                              const float *points, unsigned int nsamples)
+{
+    if(m_npoints > 0 || (points == NULL && nsamples > 0))
+        return false;
+
+    std::ifstream in(path, std::ios::in | std::ios::binary);
+    if(!in)
+        return false;
+    SnapshotHeader header;
+    in.read((char*)&header, sizeof(header));
+    if(!in || memcmp(header.magic, "OCTSNAP2", 8) != 0 || header.key != key
+       || header.point_size != sizeof(int32_t) || header.nnodes == 0
+       || header.depth > 31 || header.npoints != nsamples)
+        return false;
+
+    std::vector<SnapshotNode> nodes(header.nnodes);
+    std::vector<int32_t> indices(header.npoints);
+    in.read((char*)&nodes[0], nodes.size() * sizeof(SnapshotNode));
+    if(!indices.empty())
+        in.read((char*)&indices[0], indices.size() * sizeof(int32_t));
+    if(!in)
+        return false;
+
+    //check the records before building anything: in pre-order, the
+    //parent of a node is the last node met one level up, a child slot is
+    //used once per parent and the child cell is the one of its slot, only
+    //the leaves hold points and every sample is in exactly one leaf
+    std::vector<bool> open(header.depth + 1, false);
+    std::vector<unsigned char> used(header.depth + 1, 0);
+    std::vector<uint32_t> xloc(header.depth + 1, 0);
+    std::vector<uint32_t> yloc(header.depth + 1, 0);
+    std::vector<uint32_t> zloc(header.depth + 1, 0);
+    std::vector<bool> seen(nsamples, false);
+    open[header.depth] = true;
+    for(size_t i = 0; i < nodes.size(); ++i)
+    {
+        const SnapshotNode &record = nodes[i];
+        unsigned int depth = record.depth_child >> 8;
+        unsigned int child = record.depth_child & 0xff;
+        if((size_t)record.first + record.count > indices.size()
+           || (depth > 0 && record.count > 0))
+            return false;
+        for(uint32_t j = record.first; j < record.first + record.count; ++j)
+        {
+            int32_t index = indices[j];
+            if(index < 0 || (unsigned int)index >= nsamples || seen[index])
+                return false;
+            seen[index] = true;
+        }
+        if(i == 0)
+        {
+            if(depth != header.depth || record.xloc != 0 || record.yloc != 0
+               || record.zloc != 0)
+                return false;
+            used[depth] = 0;
+            continue;
+        }
+        if(depth >= header.depth || child > 7 || !open[depth + 1]
+           || (used[depth + 1] & (1 << child)) != 0
+           || record.xloc != xloc[depth + 1] + (((child >> 2) & 1) << depth)
+           || record.yloc != yloc[depth + 1] + (((child >> 1) & 1) << depth)
+           || record.zloc != zloc[depth + 1] + ((child & 1) << depth))
+            return false;
+        used[depth + 1] |= (unsigned char)(1 << child);
+        open[depth] = true;
+        used[depth] = 0;
+        xloc[depth] = record.xloc;
+        yloc[depth] = record.yloc;
+        zloc[depth] = record.zloc;
+        for(unsigned int d = 0; d < depth; ++d)
+            open[d] = false;
+    }
+    if((size_t)std::count(seen.begin(), seen.end(), true) != nsamples)
+        return false;
+
+    setDepth(header.depth);
+    Point origin(header.origin[0], header.origin[1], header.origin[2]);
+    initialize(origin, header.size);
+
+    const double leaf_size = m_size / (double)m_binsize;
+    std::vector< TOctreeNode<T>* > last(m_depth + 1, (TOctreeNode<T>*)NULL);
+    last[m_depth] = m_root;
+    for(size_t i = 0; i < nodes.size(); ++i)
+    {
+        const SnapshotNode &record = nodes[i];
+        unsigned int depth = record.depth_child >> 8;
+        TOctreeNode<T> *node = m_root;
+        if(i > 0)
+        {
+            Point node_origin(m_origin.x() + record.xloc * leaf_size,
+                              m_origin.y() + record.yloc * leaf_size,
+                              m_origin.z() + record.zloc * leaf_size);
+            node = createNode(node_origin, leaf_size * (double)pow2(depth),
+                              depth);
+            node->setXLoc(record.xloc);
+            node->setYLoc(record.yloc);
+            node->setZLoc(record.zloc);
+            last[depth + 1]->setChild(record.depth_child & 0xff, node);
+            last[depth] = node;
+            m_nb_non_empty_cells[depth] += 1;
+        }
+
+        for(uint32_t j = record.first; j < record.first + record.count; ++j)
+        {
+            const float *p = points + 3 * (size_t)indices[j];
+            T pt(p[0], p[1], p[2]);
+            pt.setIndex(indices[j]);
+            node->addInitialPoint(pt);
+        }
+        m_npoints += record.count;
+    }
+    return true;
+}
+
+
+template<class T>
+template<class Region>
+void TOctree<T>::getPointsInRegion(const Region &region,
+                                   std::vector<T*> &points,
+                                   unsigned int index)
+{
+    points.clear();
+    if(m_root == NULL)
+        return;
+
+    //up to 8^4 subtrees to balance the work between the threads
+    std::vector< TOctreeNode<T>* > tasks;
+    std::vector<char> inside;
+    unsigned int depth = m_root->getDepth() > 4 ? m_root->getDepth() - 4 : 0;
+    getRegionTasks(m_root, region, depth, tasks, inside);
+
+    const int ntasks = (int)tasks.size();
+    std::vector< std::vector<T*> > results(ntasks);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1)
+#endif
+    for(int i = 0; i < ntasks; ++i)
+        getPointsInRegion(tasks[i], region, inside[i] != 0, results[i],
+                          index);
+
+    size_t total = 0;
+    for(int i = 0; i < ntasks; ++i)
+        total += results[i].size();
+    points.reserve(total);
+    for(int i = 0; i < ntasks; ++i)
+        points.insert(points.end(), results[i].begin(), results[i].end());
+}
+
+
+template<class T>
+template<class Region>
+void TOctree<T>::getRegionTasks(TOctreeNode<T> *node, const Region &region,
+                                unsigned int depth,
+                                std::vector< TOctreeNode<T>* > &tasks,
+                                std::vector<char> &inside)
+{
+    if(node->getDepth() <= depth)
+    {
+        tasks.push_back(node);
+        inside.push_back(0);
+        return;
+    }
+    typename Region::Classification c =
+        region.classify(node->getOrigin(), node->getSize());
+    if(c == Region::OUTSIDE)
+        return;
+    if(c == Region::INSIDE)
+    {
+        tasks.push_back(node);
+        inside.push_back(1);
+        return;
+    }
+    for(unsigned int i = 0; i < 8; ++i)
+        if(node->getChild(i) != NULL)
+            getRegionTasks(node->getChild(i), region, depth, tasks, inside);
+}
+
+
+template<class T>
+template<class Region>
+void TOctree<T>::getPointsInRegion(TOctreeNode<T> *node, const Region &region,
+                                   bool inside, std::vector<T*> &points,
+                                   unsigned int index)
+{
+    if(!inside)
+    {
+        typename Region::Classification c =
+            region.classify(node->getOrigin(), node->getSize());
+        if(c == Region::OUTSIDE)
+            return;
+        inside = (c == Region::INSIDE);
+    }
+
+    if(node->getDepth() == 0)
+    {
+        typename TOctreeNode<T>::point_iterator pi;
+        for(pi = node->points_begin(index); pi != node->points_end(index); ++pi)
+            if(inside || region.contains(pi->x(), pi->y(), pi->z()))
+                points.push_back(&(*pi));
+        return;
+    }
+    for(unsigned int i = 0; i < 8; ++i)
+        if(node->getChild(i) != NULL)
+            getPointsInRegion(node->getChild(i), region, inside, points,
+                              index);
+}
+
+
+template<class T>
+T* TOctree<T>::pickOnRay(const Point &origin, const Point &direction,
+                         double tan_radius, unsigned int index)
+{
+    double norm = sqrt(direction.x() * direction.x()
+                       + direction.y() * direction.y()
+                       + direction.z() * direction.z());
+    if(m_root == NULL || norm == 0)
+        return NULL;
+    double o[3] = {origin.x(), origin.y(), origin.z()};
+    double d[3] = {direction.x() / norm, direction.y() / norm,
+                   direction.z() / norm};
+    double best_t = std::numeric_limits<double>::max();
+    T *best = NULL;
+    pickOnRay(m_root, o, d, tan_radius, index, best_t, best);
+    return best;
+}
+
+
+template<class T>
+bool TOctree<T>::raySlabs(const TOctreeNode<T> *node, const double o[3],
+                          const double d[3], double tan_radius,
+                          double &tenter, double &texit) const
+{
+    double size = node->getSize();
+    Point origin = node->getOrigin();
+    double lower[3] = {origin.x(), origin.y(), origin.z()};
+
+    //the cone is at most this wide over the box
+    double far2 = 0;
+    for(int k = 0; k < 3; ++k)
+    {
+        double e = std::max(fabs(lower[k] - o[k]),
+                            fabs(lower[k] + size - o[k]));
+        far2 += e * e;
+    }
+    double margin = tan_radius * sqrt(far2);
+
+    tenter = 0;
+    texit = std::numeric_limits<double>::max();
+    for(int k = 0; k < 3; ++k)
+    {
+        double lo = lower[k] - margin;
+        double hi = lower[k] + size + margin;
+        if(d[k] == 0)
+        {
+            if(o[k] < lo || o[k] > hi)
+                return false;
+            continue;
+        }
+        double t0 = (lo - o[k]) / d[k];
+        double t1 = (hi - o[k]) / d[k];
+        if(t0 > t1)
+            std::swap(t0, t1);
+        tenter = std::max(tenter, t0);
+        texit = std::min(texit, t1);
+        if(tenter > texit)
+            return false;
+    }
+    return true;
+}
+
+
+template<class T>
+void TOctree<T>::pickOnRay(TOctreeNode<T> *node, const double o[3],
+                           const double d[3], double tan_radius,
+                           unsigned int index, double &best_t, T* &best)
+{
+    if(node->getDepth() == 0)
+    {
+        typename TOctreeNode<T>::point_iterator pi;
+        for(pi = node->points_begin(index); pi != node->points_end(index); ++pi)
+        {
+            double v[3] = {pi->x() - o[0], pi->y() - o[1], pi->z() - o[2]};
+            double t = v[0] * d[0] + v[1] * d[1] + v[2] * d[2];
+            if(t <= 0 || t >= best_t)
+                continue;
+            double perp2 = v[0] * v[0] + v[1] * v[1] + v[2] * v[2] - t * t;
+            if(perp2 <= tan_radius * tan_radius * t * t)
+            {
+                best_t = t;
+                best = &(*pi);
+            }
+        }
+        return;
+    }
+
+    //children sorted by entry distance, front to back
+    TOctreeNode<T> *children[8];
+    double entries[8];
+    int nchildren = 0;
+    for(unsigned int i = 0; i < 8; ++i)
+    {
+        TOctreeNode<T> *child = node->getChild(i);
+        double tenter, texit;
+        if(child == NULL
+           || !raySlabs(child, o, d, tan_radius, tenter, texit))
+            continue;
+        int j = nchildren++;
+        while(j > 0 && entries[j - 1] > tenter)
+        {
+            entries[j] = entries[j - 1];
+            children[j] = children[j - 1];
+            --j;
+        }
+        entries[j] = tenter;
+        children[j] = child;
+    }
+    for(int i = 0; i < nchildren; ++i)
+    {
+        if(entries[i] >= best_t)
+            break;
+        pickOnRay(children[i], o, d, tan_radius, index, best_t, best);
+    }
+}
+
+
+template<class T>
+template<class Iterator>
+unsigned int TOctree<T>::removePoints(Iterator begin, Iterator end,
+                                      unsigned int index)
+{
+    //group the sample indices by leaf
+    std::vector< std::pair<TOctreeNode<T>*, int> > entries;
+    for(Iterator it = begin; it != end; ++it)
+    {
+        const T &pt = *it;
+        if(!m_root->isInside(pt.x(), pt.y(), pt.z()))
+            continue;
+        unsigned int codx = getLeafCoordinate(pt.x(), m_origin.x());
+        unsigned int cody = getLeafCoordinate(pt.y(), m_origin.y());
+        unsigned int codz = getLeafCoordinate(pt.z(), m_origin.z());
+        TOctreeNode<T> *leaf = getLeaf(codx, cody, codz, false);
+        if(leaf != NULL)
+            entries.push_back(std::make_pair(leaf, pt.index()));
+    }
+    std::sort(entries.begin(), entries.end());
+
+    std::vector<int> indices(entries.size());
+    for(size_t i = 0; i < entries.size(); ++i)
+        indices[i] = entries[i].second;
+
+    unsigned int removed = 0;
+    size_t first = 0;
+    while(first < entries.size())
+    {
+        TOctreeNode<T> *leaf = entries[first].first;
+        size_t last = first;
+        while(last < entries.size() && entries[last].first == leaf)
+            ++last;
+        removed += leaf->removePoints(index, IndexRange(&indices[first],
+                                                        &indices[0] + last));
+        pruneNode(leaf);
+        first = last;
+    }
+    if(index == 0)
+        m_npoints -= removed;
+    return removed;
+}
+
+
+template<class T>
+template<class Predicate>
+unsigned int TOctree<T>::removePoints(const Point &lower, const Point &upper,
+                                      Predicate pred, unsigned int index)
+{
+    std::vector< TOctreeNode<T>* > leaves;
+    unsigned int removed = removePoints(m_root, lower, upper, pred, index,
+                                        leaves);
+    for(size_t i = 0; i < leaves.size(); ++i)
+        pruneNode(leaves[i]);
+    if(index == 0)
+        m_npoints -= removed;
+    return removed;
+}
+
+
+template<class T>
+template<class Predicate>
+unsigned int TOctree<T>::removePoints(TOctreeNode<T> *node,
+                                      const Point &lower, const Point &upper,
+                                      Predicate &pred, unsigned int index,
+                                      std::vector< TOctreeNode<T>* > &leaves)
+{
+    const Point origin = node->getOrigin();
+    const double size = node->getSize();
+    if(origin.x() > upper.x() || origin.x() + size < lower.x()
+       || origin.y() > upper.y() || origin.y() + size < lower.y()
+       || origin.z() > upper.z() || origin.z() + size < lower.z())
+        return 0;
+
+    if(node->getDepth() == 0)
+    {
+        unsigned int removed = node->removePoints(index, pred);
+        if(removed > 0)
+            leaves.push_back(node);
+        return removed;
+    }
+
+    unsigned int removed = 0;
+    for(unsigned int i = 0; i < 8; ++i)
+        if(node->getChild(i) != NULL)
+            removed += removePoints(node->getChild(i), lower, upper, pred,
+                                    index, leaves);
+    return removed;
+}
+
+
+template<class T>
+void TOctree<T>::pruneNode(TOctreeNode<T> *node)
+{
+    while(node != m_root && node->isEmpty())
+    {
+        TOctreeNode<T> *parent = node->getParent();
+        if(parent == NULL)
+            return;
+        parent->removeChild(node->getNChild());
+        m_nb_non_empty_cells[node->getDepth()] -= 1;
+        //the memory stays in the arena until the octree is destroyed
+        node->~TOctreeNode<T>();
+        node = parent;
+    }
+}
+
+
+template<class T>
+TOctreeNode<T>* TOctree<T>::getLeaf(unsigned int codx, unsigned int cody,
+                                    unsigned int codz, bool create)
+{
     TOctreeNode<T> *node=getRoot();
     unsigned int l=node->getDepth()-1;
 
@@ -432,14 +1507,10 @@ void TOctree<T>::addPoint(T& pt, unsigned int index)
         unsigned int z = ( ( codz & childBranchBit) >> l );
         unsigned int childIndex = (x<<2) + (y<<1) + z;
 
-#ifdef _OPENMP
-        //critical section to avoid conflict when adding points to new cells
-        //during parallel filter iterations
-        #pragma omp critical
-        {
-#endif
         if(node->getChild(childIndex) == NULL)
         {
+            if(!create)
+                return NULL;
             double childSize = node->getSize()/2.0;
             unsigned int childDepth = node->getDepth() - 1;
             Point origin = node->getOrigin();
@@ -455,15 +1526,10 @@ void TOctree<T>::addPoint(T& pt, unsigned int index)
             child->setZLoc( node->getZLoc() + ( z<<(childDepth) ) );
             m_nb_non_empty_cells[childDepth] += 1;
         }
-#ifdef _OPENMP
-        }
-#endif
         node = node->getChild(childIndex);
         l--;
     }
-
-    //add the point to the leaf.
-    node->addPoint(pt,index);
+    return node;
 }
 
 
@@ -526,34 +1592,120 @@ void TOctree<T>::clearSet(unsigned int index)
     node->clearSet(index);
 }
 
+template<class T>
+void TOctree<T>::declareProperties(size_t nsamples, size_t nprop,
+                                   bool single_precision)
+{
+    m_single_precision = single_precision;
+    m_fproperties.clear();
+    m_dproperties.clear();
+    if(m_single_precision)
+        m_fproperties.assign(nprop, std::vector<float>(nsamples, 0.f));
+    else
+        m_dproperties.assign(nprop, std::vector<double>(nsamples, 0.0));
+}
+
 template<class T>
 void TOctree<T>::addProperty(size_t nprop)
 {
-    m_properties.push_back(std::vector<double>());
-    m_properties.back().resize(nprop);
+    if(getNproperties() == 0)
+        declareProperties(0, nprop, m_single_precision);
+
+    for(size_t i = 0; i < m_fproperties.size(); ++i)
+        m_fproperties[i].push_back(0.f);
+    for(size_t i = 0; i < m_dproperties.size(); ++i)
+        m_dproperties[i].push_back(0.0);
 }
 
 
 template<class T>
 void TOctree<T>::setProperty(size_t sample_index, size_t prop_index, double value)
 {
-    m_properties[sample_index][prop_index] = value;
+    if(m_single_precision)
+        m_fproperties[prop_index][sample_index] = (float)value;
+    else
+        m_dproperties[prop_index][sample_index] = value;
 }
 
 
 template<class T>
 double TOctree<T>::getProperty(size_t sample_index, size_t prop_index) const
 {
-    return m_properties[sample_index][prop_index];
+    if(m_single_precision)
+        return m_fproperties[prop_index][sample_index];
+    return m_dproperties[prop_index][sample_index];
 }
 
 
 template<class T>
-size_t TOctree<T>::getNproperties()
+template<class V>
+void TOctree<T>::setPropertyColumn(size_t prop_index, const V *values,
+                                   size_t stride)
+{
+    if(m_single_precision)
+    {
+        std::vector<float> &column = m_fproperties[prop_index];
+        for(size_t i = 0; i < column.size(); ++i)
+            column[i] = (float)values[i * stride];
+    }
+    else
+    {
+        std::vector<double> &column = m_dproperties[prop_index];
+        for(size_t i = 0; i < column.size(); ++i)
+            column[i] = (double)values[i * stride];
+    }
+}
+
+
+template<class T>
+template<class V>
+void TOctree<T>::getPropertyColumn(size_t prop_index, V *values,
+                                   size_t stride) const
+{
+    if(m_single_precision)
+    {
+        const std::vector<float> &column = m_fproperties[prop_index];
+        for(size_t i = 0; i < column.size(); ++i)
+            values[i * stride] = (V)column[i];
+    }
+    else
+    {
+        const std::vector<double> &column = m_dproperties[prop_index];
+        for(size_t i = 0; i < column.size(); ++i)
+            values[i * stride] = (V)column[i];
+    }
+}
+
+
+template<class T>
+template<class V>
+void TOctree<T>::gatherPropertyColumn(size_t prop_index,
+                                      const unsigned int *indices, size_t n,
+                                      V *values, size_t stride) const
 {
-    return m_properties[0].size();
+    if(n == 0)
+        return;
+
+    if(m_single_precision)
+    {
+        const float *column = &m_fproperties[prop_index][0];
+        for(size_t i = 0; i < n; ++i)
+            values[i * stride] = (V)column[indices[i]];
+    }
+    else
+    {
+        const double *column = &m_dproperties[prop_index][0];
+        for(size_t i = 0; i < n; ++i)
+            values[i * stride] = (V)column[indices[i]];
+    }
 }
 
 
+template<class T>
+size_t TOctree<T>::getNproperties()
+{
+    return m_single_precision ? m_fproperties.size() : m_dproperties.size();
+}
+
 
 #endif
@@ -0,0 +1,634 @@
+/**
+ * @file OctreeAllocator.h
+ * @brief arena allocation of the octree nodes and of the leaf point sets
+ * @copyright This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef OCTREE_ALLOCATOR_H
+#define OCTREE_ALLOCATOR_H
+
+#include <cstdlib>
+#include <cstddef>
+#include <cassert>
+#include <iterator>
+#include <new>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/**
+ * @class Arena
+ * @brief bump allocator: memory is carved out of large blocks which are
+ * only given back all at once
+ */
+class Arena
+{
+    private :
+
+        /** @brief alignment of the returned addresses*/
+        static const size_t ALIGNMENT = 16;
+
+        /** @brief blocks allocated so far*/
+        std::vector<char*> m_blocks;
+
+        /** @brief first free byte of the current block*/
+        char *m_current;
+
+        /** @brief number of free bytes in the current block*/
+        size_t m_left;
+
+        /** @brief size of the blocks*/
+        size_t m_block_size;
+
+    public :
+        /** @brief constructor
+         * @param block_size size of the blocks
+         */
+        explicit Arena(size_t block_size = 1 << 20)
+            : m_current(NULL), m_left(0), m_block_size(block_size)
+        {
+        }
+
+        /** @brief copying an arena gives an empty arena
+         * (the blocks are never shared)
+         * @param other arena to take the block size from
+         */
+        Arena(const Arena &other)
+            : m_current(NULL), m_left(0), m_block_size(other.m_block_size)
+        {
+        }
+
+        /** @brief destructor, releases all the blocks
+         */
+        ~Arena()
+        {
+            release();
+        }
+
+        /** @brief allocate memory
+         * @param bytes number of bytes
+         * @return aligned memory, valid until the arena is released
+         */
+        void* allocate(size_t bytes)
+        {
+            bytes = (bytes + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+            if(bytes > m_left)
+            {
+                size_t size = bytes > m_block_size ? bytes : m_block_size;
+                char *block = static_cast<char*>(::operator new(size));
+                m_blocks.push_back(block);
+                m_current = block;
+                m_left = size;
+            }
+            void *memory = m_current;
+            m_current += bytes;
+            m_left -= bytes;
+            return memory;
+        }
+
+        /** @brief give all the blocks back
+         */
+        void release()
+        {
+            for(size_t i = 0; i < m_blocks.size(); ++i)
+                ::operator delete(m_blocks[i]);
+            m_blocks.clear();
+            m_current = NULL;
+            m_left = 0;
+        }
+
+    private :
+        Arena& operator=(const Arena &other);
+};
+
+
+/**
+ * @class TPointChunk
+ * @brief fixed capacity chunk of points, chained to the next chunk of the
+ * same point set. The points are stored right after the header.
+ */
+template<class T>
+class TPointChunk
+{
+    public :
+        /** @brief next chunk of the set (NULL for the last one)*/
+        TPointChunk<T> *next;
+
+        /** @brief number of points in the chunk*/
+        unsigned int size;
+
+        /** @brief number of points the chunk can hold*/
+        unsigned int capacity;
+
+        /** @brief size of the header, padded so that the points are aligned
+         * @return header size in bytes
+         */
+        static size_t headerSize()
+        {
+            return (sizeof(TPointChunk<T>) + 15) & ~(size_t)15;
+        }
+
+        /** @brief points of the chunk
+         * @return pointer to the first point
+         */
+        T* data()
+        {
+            return reinterpret_cast<T*>(reinterpret_cast<char*>(this)
+                                        + headerSize());
+        }
+};
+
+
+/**
+ * @class TOctreeAllocator
+ * @brief memory of an octree: the nodes and the point chunks are allocated
+ * from one arena per thread, released together with the octree.
+ *
+ * Chunks of cleared point sets are kept in per-thread free lists and
+ * reused by the next insertions, so that the filter iterations do not
+ * allocate once the first pass is done.
+ */
+template<class T>
+class TOctreeAllocator
+{
+    public :
+        /** @brief smallest chunk capacity*/
+        static const unsigned int MIN_CHUNK = 4;
+
+        /** @brief number of chunk capacities (MIN_CHUNK times a power
+         * of 2)*/
+        static const unsigned int NCLASSES = 7;
+
+    private :
+        /** @brief one arena per thread*/
+        std::vector<Arena> m_arenas;
+
+        /** @brief free chunks per thread and per capacity*/
+        std::vector<TPointChunk<T>*> m_free;
+
+        /** @brief arena for the threads beyond the expected number, used
+         * in a critical section*/
+        Arena m_shared;
+
+        /** @brief free chunks of the shared arena*/
+        TPointChunk<T> *m_shared_free[NCLASSES];
+
+    public :
+        /** @brief constructor
+         */
+        TOctreeAllocator();
+
+        /** @brief allocate raw memory (typically for a node)
+         * @param bytes number of bytes
+         * @return memory, valid until the allocator is released
+         */
+        void* allocate(size_t bytes);
+
+        /** @brief get an empty chunk
+         * @param capacity number of points, MIN_CHUNK times a power of 2
+         * @return chunk
+         */
+        TPointChunk<T>* allocateChunk(unsigned int capacity);
+
+        /** @brief give a chunk back for reuse (its points must have been
+         * destroyed)
+         * @param chunk chunk to give back
+         */
+        void releaseChunk(TPointChunk<T> *chunk);
+
+        /** @brief give all the memory back
+         */
+        void release();
+
+    private :
+        /** @brief index of the calling thread
+         * @return thread index, -1 if the shared arena must be used
+         */
+        int getThreadSlot() const;
+
+        /** @brief index of the free list for a capacity
+         * @param capacity chunk capacity
+         * @return capacity class
+         */
+        static unsigned int getClass(unsigned int capacity);
+};
+
+
+/**
+ * @class TPointIterator
+ * @brief forward iterator over a chunked point set
+ * V is T for a mutable iterator and const T for a constant one
+ */
+template<class T, class V>
+class TPointIterator
+{
+    public :
+        typedef std::forward_iterator_tag iterator_category;
+        typedef T value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef V* pointer;
+        typedef V& reference;
+
+    private :
+        /** @brief current chunk (NULL at the end)*/
+        TPointChunk<T> *m_chunk;
+
+        /** @brief position in the current chunk*/
+        unsigned int m_pos;
+
+    public :
+        TPointIterator() : m_chunk(NULL), m_pos(0)
+        {
+        }
+
+        TPointIterator(TPointChunk<T> *chunk, unsigned int pos)
+            : m_chunk(chunk), m_pos(pos)
+        {
+        }
+
+        /** @brief conversion from a mutable iterator*/
+        template<class W>
+        TPointIterator(const TPointIterator<T, W> &other)
+            : m_chunk(other.getChunk()), m_pos(other.getPosition())
+        {
+        }
+
+        V& operator*() const
+        {
+            return m_chunk->data()[m_pos];
+        }
+
+        V* operator->() const
+        {
+            return m_chunk->data() + m_pos;
+        }
+
+        TPointIterator& operator++()
+        {
+            if(++m_pos == m_chunk->size)
+            {
+                m_chunk = m_chunk->next;
+                m_pos = 0;
+            }
+            return *this;
+        }
+
+        TPointIterator operator++(int)
+        {
+            TPointIterator it = *this;
+            ++(*this);
+            return it;
+        }
+
+        bool operator==(const TPointIterator &other) const
+        {
+            return m_chunk == other.m_chunk && m_pos == other.m_pos;
+        }
+
+        bool operator!=(const TPointIterator &other) const
+        {
+            return m_chunk != other.m_chunk || m_pos != other.m_pos;
+        }
+
+        TPointChunk<T>* getChunk() const
+        {
+            return m_chunk;
+        }
+
+        unsigned int getPosition() const
+        {
+            return m_pos;
+        }
+};
+
+
+/**
+ * @class TPointList
+ * @brief point set of a leaf: a chain of chunks of growing capacity
+ * allocated from the octree allocator
+ */
+template<class T>
+class TPointList
+{
+    public :
+        typedef TPointIterator<T, T> iterator;
+        typedef TPointIterator<T, const T> const_iterator;
+
+    private :
+        /** @brief first chunk*/
+        TPointChunk<T> *m_head;
+
+        /** @brief last chunk (the only one that may not be full)*/
+        TPointChunk<T> *m_tail;
+
+        /** @brief number of points*/
+        unsigned int m_size;
+
+    public :
+        TPointList() : m_head(NULL), m_tail(NULL), m_size(0)
+        {
+        }
+
+        /** @brief number of points
+         * @return size
+         */
+        unsigned int size() const
+        {
+            return m_size;
+        }
+
+        /** @brief check if the set is empty
+         * @return true if there are no points
+         */
+        bool empty() const
+        {
+            return m_size == 0;
+        }
+
+        iterator begin()
+        {
+            return iterator(m_head, 0);
+        }
+
+        iterator end()
+        {
+            return iterator();
+        }
+
+        const_iterator begin() const
+        {
+            return const_iterator(m_head, 0);
+        }
+
+        const_iterator end() const
+        {
+            return const_iterator();
+        }
+
+        /** @brief add a point at the end of the set
+         * @param pt point to add
+         * @param allocator allocator of the octree
+         */
+        void push_back(const T &pt, TOctreeAllocator<T> &allocator);
+
+        /** @brief destroy the points and give the chunks back
+         * @param allocator allocator of the octree
+         */
+        void clear(TOctreeAllocator<T> &allocator);
+
+        /** @brief remove the points matching a predicate: the remaining
+         * points are compacted in order at the front of the chain and the
+         * chunks left empty are given back
+         * @param pred predicate, true for the points to remove
+         * @param allocator allocator of the octree
+         * @return number of removed points
+         */
+        template<class Predicate>
+        unsigned int removeIf(Predicate pred, TOctreeAllocator<T> &allocator);
+};
+
+
+template<class T>
+TOctreeAllocator<T>::TOctreeAllocator()
+{
+#ifdef _OPENMP
+    m_arenas.resize(omp_get_max_threads());
+#else
+    m_arenas.resize(1);
+#endif
+    m_free.assign(m_arenas.size() * NCLASSES, (TPointChunk<T>*)NULL);
+    for(unsigned int i = 0; i < NCLASSES; ++i)
+        m_shared_free[i] = NULL;
+}
+
+template<class T>
+int TOctreeAllocator<T>::getThreadSlot() const
+{
+#ifdef _OPENMP
+    int thread = omp_get_thread_num();
+    return thread < (int)m_arenas.size() ? thread : -1;
+#else
+    return 0;
+#endif
+}
+
+template<class T>
+unsigned int TOctreeAllocator<T>::getClass(unsigned int capacity)
+{
+    unsigned int c = 0;
+    while((MIN_CHUNK << c) < capacity)
+        ++c;
+    return c;
+}
+
+template<class T>
+void* TOctreeAllocator<T>::allocate(size_t bytes)
+{
+    int slot = getThreadSlot();
+    if(slot >= 0)
+        return m_arenas[slot].allocate(bytes);
+
+    void *memory;
+#ifdef _OPENMP
+#pragma omp critical(octree_allocator)
+#endif
+    memory = m_shared.allocate(bytes);
+    return memory;
+}
+
+template<class T>
+TPointChunk<T>* TOctreeAllocator<T>::allocateChunk(unsigned int capacity)
+{
+    unsigned int c = getClass(capacity);
+    capacity = MIN_CHUNK << c;
+    const size_t bytes = TPointChunk<T>::headerSize() + capacity * sizeof(T);
+
+    TPointChunk<T> *chunk = NULL;
+    int slot = getThreadSlot();
+    if(slot >= 0)
+    {
+        TPointChunk<T> *&head = m_free[slot * NCLASSES + c];
+        if(head != NULL)
+        {
+            chunk = head;
+            head = chunk->next;
+        }
+        else
+            chunk = static_cast<TPointChunk<T>*>(
+                        m_arenas[slot].allocate(bytes));
+    }
+    else
+    {
+#ifdef _OPENMP
+#pragma omp critical(octree_allocator)
+#endif
+        {
+            if(m_shared_free[c] != NULL)
+            {
+                chunk = m_shared_free[c];
+                m_shared_free[c] = chunk->next;
+            }
+            else
+                chunk = static_cast<TPointChunk<T>*>(m_shared.allocate(bytes));
+        }
+    }
+
+    chunk->next = NULL;
+    chunk->size = 0;
+    chunk->capacity = capacity;
+    return chunk;
+}
+
+template<class T>
+void TOctreeAllocator<T>::releaseChunk(TPointChunk<T> *chunk)
+{
+    unsigned int c = getClass(chunk->capacity);
+    int slot = getThreadSlot();
+    if(slot >= 0)
+    {
+        chunk->next = m_free[slot * NCLASSES + c];
+        m_free[slot * NCLASSES + c] = chunk;
+    }
+    else
+    {
+#ifdef _OPENMP
+#pragma omp critical(octree_allocator)
+#endif
+        {
+            chunk->next = m_shared_free[c];
+            m_shared_free[c] = chunk;
+        }
+    }
+}
+
+template<class T>
+void TOctreeAllocator<T>::release()
+{
+    for(size_t i = 0; i < m_arenas.size(); ++i)
+        m_arenas[i].release();
+    m_shared.release();
+    m_free.assign(m_free.size(), (TPointChunk<T>*)NULL);
+    for(unsigned int i = 0; i < NCLASSES; ++i)
+        m_shared_free[i] = NULL;
+}
+
+
+template<class T>
+void TPointList<T>::push_back(const T &pt, TOctreeAllocator<T> &allocator)
+{
+    if(m_tail == NULL || m_tail->size == m_tail->capacity)
+    {
+        //chunks double in size up to the largest capacity
+        unsigned int capacity = TOctreeAllocator<T>::MIN_CHUNK;
+        if(m_tail != NULL)
+        {
+            capacity = 2 * m_tail->capacity;
+            unsigned int max_capacity = TOctreeAllocator<T>::MIN_CHUNK
+                << (TOctreeAllocator<T>::NCLASSES - 1);
+            if(capacity > max_capacity)
+                capacity = max_capacity;
+        }
+        TPointChunk<T> *chunk = allocator.allocateChunk(capacity);
+        if(m_tail == NULL)
+            m_head = chunk;
+        else
+            m_tail->next = chunk;
+        m_tail = chunk;
+    }
+    new (m_tail->data() + m_tail->size) T(pt);
+    m_tail->size++;
+    m_size++;
+}
+
+template<class T>
+void TPointList<T>::clear(TOctreeAllocator<T> &allocator)
+{
+    TPointChunk<T> *chunk = m_head;
+    while(chunk != NULL)
+    {
+        TPointChunk<T> *next = chunk->next;
+        T *points = chunk->data();
+        for(unsigned int i = 0; i < chunk->size; ++i)
+            points[i].~T();
+        allocator.releaseChunk(chunk);
+        chunk = next;
+    }
+    m_head = m_tail = NULL;
+    m_size = 0;
+}
+
+template<class T>
+template<class Predicate>
+unsigned int TPointList<T>::removeIf(Predicate pred,
+                                     TOctreeAllocator<T> &allocator)
+{
+    //all the chunks but the last one are full: the kept points are moved
+    //down to the next free slot of that layout
+    TPointChunk<T> *wchunk = m_head;
+    unsigned int wpos = 0;
+    unsigned int kept = 0;
+    for(TPointChunk<T> *rchunk = m_head; rchunk != NULL; rchunk = rchunk->next)
+    {
+        T *points = rchunk->data();
+        for(unsigned int i = 0; i < rchunk->size; ++i)
+        {
+            if(pred(points[i]))
+                continue;
+            if(wchunk != rchunk || wpos != i)
+                wchunk->data()[wpos] = points[i];
+            ++kept;
+            if(++wpos == wchunk->capacity)
+            {
+                wchunk = wchunk->next;
+                wpos = 0;
+            }
+        }
+    }
+
+    const unsigned int removed = m_size - kept;
+    if(removed == 0)
+        return 0;
+
+    //shrink the chunks, destroy the leftover points, release the chunks
+    //left empty
+    unsigned int left = kept;
+    TPointChunk<T> *prev = NULL;
+    TPointChunk<T> *chunk = m_head;
+    while(chunk != NULL)
+    {
+        TPointChunk<T> *next = chunk->next;
+        unsigned int size = left < chunk->capacity ? left : chunk->capacity;
+        T *points = chunk->data();
+        for(unsigned int i = size; i < chunk->size; ++i)
+            points[i].~T();
+        chunk->size = size;
+        left -= size;
+        if(size == 0)
+        {
+            if(prev == NULL)
+                m_head = next;
+            else
+                prev->next = next;
+            allocator.releaseChunk(chunk);
+        }
+        else
+            prev = chunk;
+        chunk = next;
+    }
+    m_tail = prev;
+    m_size = kept;
+    return removed;
+}
+
+#endif
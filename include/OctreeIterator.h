@@ -21,12 +21,114 @@
 #include<cstdlib>
 #include <list>
 #include <map>
+#include <vector>
+#include <algorithm>
+#include <utility>
 #include "Point.h"
 #include "Octree.h"
 #include "OctreeNode.h"
 #include <cmath>
 #include<cassert>
 
+/**
+ * @class TNeighborBuffer
+ * @brief Contiguous storage for the result of a neighborhood query
+ *
+ * Neighbors and square distances are stored in two parallel vectors
+ * that keep their capacity when cleared, so that a buffer reused for
+ * many queries (typically one per thread) stops allocating.
+ */
+template<class T>
+class TNeighborBuffer
+{
+    public :
+        /** @brief neighbors found by the last query*/
+        std::vector<T*> neighbors;
+
+        /** @brief square distances of the neighbors to the query point*/
+        std::vector<double> sqdistances;
+
+        /** @brief scratch max-heap of (square distance, neighbor) used by
+         * k-nearest neighbor queries*/
+        std::vector< std::pair<double, T*> > heap;
+
+    public :
+        /** @brief empty the buffer, keeping its capacity*/
+        void clear()
+        {
+            neighbors.clear();
+            sqdistances.clear();
+        }
+
+        /** @brief add a neighbor
+         * @param neighbor neighbor to add
+         * @param sqdist square distance of the neighbor to the query
+         */
+        void push_back(T *neighbor, double sqdist)
+        {
+            neighbors.push_back(neighbor);
+            sqdistances.push_back(sqdist);
+        }
+
+        /** @brief get number of neighbors
+         * @return number of neighbors
+         */
+        size_t size() const
+        {
+            return neighbors.size();
+        }
+};
+
+/**
+ * @class TNeighborGraph
+ * @brief Neighborhoods of a batch of query points in compressed sparse
+ * row form
+ *
+ * The neighbors of query i (as sample indices) and their square
+ * distances are stored at positions offsets[i] to offsets[i+1] (excluded)
+ * of the two arrays: 8 bytes per edge.
+ */
+template<class T>
+class TNeighborGraph
+{
+    public :
+        /** @brief start of the neighbors of each query (one more entry
+         * than the number of queries)*/
+        std::vector<size_t> offsets;
+
+        /** @brief sample indices of the neighbors of all the queries*/
+        std::vector<unsigned int> indices;
+
+        /** @brief square distances of the neighbors to their query*/
+        std::vector<float> sqdistances;
+
+    public :
+        /** @brief empty the graph*/
+        void clear()
+        {
+            offsets.clear();
+            indices.clear();
+            sqdistances.clear();
+        }
+
+        /** @brief get number of queries
+         * @return number of queries
+         */
+        size_t size() const
+        {
+            return offsets.empty() ? 0 : offsets.size() - 1;
+        }
+
+        /** @brief get number of neighbors of a query
+         * @param i query index
+         * @return number of neighbors
+         */
+        size_t degree(size_t i) const
+        {
+            return offsets[i + 1] - offsets[i];
+        }
+};
+
 /**
  * @class TOctreeIterator
  * @brief Defines methods to access range neighbors of points
@@ -62,6 +164,31 @@ class TOctreeIterator
      /** @brief TOctree the iterator refers to*/
      TOctree<T> *m_octree;
 
+     /** @brief depth of the nodes indexed by the cell table*/
+     unsigned int m_tableDepth;
+
+     /** @brief true if the cell table is built*/
+     bool m_hasTable;
+
+     /** @brief number of cells per axis at the table depth*/
+     unsigned int m_gridSide;
+
+     /** @brief dense cell table (used when the grid of cells at the table
+      * depth is small enough), indexed by (x * side + y) * side + z
+      */
+     std::vector< TOctreeNode<T>* > m_grid;
+
+     /** @brief open addressing hash table of the cells, keys are the
+      * Morton codes of the cell coordinates plus one (0 marks empty slots)
+      */
+     std::vector<uint64_t> m_hashKeys;
+
+     /** @brief nodes associated to m_hashKeys*/
+     std::vector< TOctreeNode<T>* > m_hashNodes;
+
+     /** @brief hash table size minus one (the size is a power of 2)*/
+     uint64_t m_hashMask;
+
     public ://constructor+destructor
 
         /** @brief constructor*/
@@ -116,6 +243,13 @@ class TOctreeIterator
       */
       void setSetIndex(unsigned int index);
 
+      /** @brief index the nodes at active depth by their locational codes
+       * so that neighbor cells are found in constant time. Called by
+       * setR and setDepth; must be called again after nodes have been
+       * added at active depth for the new nodes to be searched
+       */
+      void buildCellTable();
+
     public : //getting neighbors
 
         /** @brief get star-neighbors of a given point
@@ -160,6 +294,27 @@ class TOctreeIterator
                                  Neighbor_star_list &neighbors,
                                  Distance_list &distances) const;
 
+        /** @brief get star-neighbors of a given point into a reusable buffer
+         * (the buffer is cleared first, and does not allocate once its
+         * capacity is large enough)
+         *@param query query point
+         *@param[out] buffer neighbors and square distances
+         *@return number of neighbors
+         */
+        unsigned int getNeighbors(const Point &query,
+                                  TNeighborBuffer<T> &buffer) const;
+
+        /** @brief get star neighbors of a given point into a reusable buffer
+         * when the node containing that point is known
+         *@param query query point
+         *@param query_node node containing the query point
+         *@param[out] buffer neighbors and square distances
+         *@return number of neighbors
+         */
+        unsigned int getNeighbors(const Point &query,
+                                  TOctreeNode<T> *query_node,
+                                  TNeighborBuffer<T> &buffer) const;
+
         /** @brief get neighbors of a given point sorted by their distances 
          *@param query query point
          *@param[out] neighbors map of neighbors to be filled by the method
@@ -203,6 +358,55 @@ class TOctreeIterator
         bool containsOnly(const Point &query, TOctreeNode<T> *query_node,
                           const Exception_set &exceptions) const;  
 
+        /** @brief get the k nearest neighbors of a point, whatever the
+         * active radius. Cells at active depth are visited in rings of
+         * increasing size around the query cell, and the search stops as
+         * soon as the k-th distance found is below the distance to the
+         * cells that remain to be visited.
+         *@param query query point
+         *@param k number of neighbors
+         *@param[out] buffer neighbors and square distances sorted by
+         * increasing distance (less than k if the set is smaller)
+         *@return number of neighbors
+         */
+        unsigned int getKNearestNeighbors(const Point &query, unsigned int k,
+                                          TNeighborBuffer<T> &buffer) const;
+
+        /** @brief get the k nearest neighbors of a batch of points, the
+         * queries being processed in parallel
+         *@param begin begin random access iterator over the query points
+         *@param end end random access iterator over the query points
+         *@param k number of neighbors
+         *@param[out] neighbors k entries per query, the neighbors of
+         * query i starting at i * k
+         *@param[out] sqdistances square distances of the neighbors
+         *@param[out] counts number of neighbors found for each query
+         */
+        template<class Iterator>
+        void getKNearestNeighbors(Iterator begin, Iterator end,
+                                  unsigned int k,
+                                  std::vector<T*> &neighbors,
+                                  std::vector<double> &sqdistances,
+                                  std::vector<unsigned int> &counts) const;
+
+        /** @brief get the star-neighbors of a batch of points.
+         * Queries are sorted along the Morton curve and grouped by cell
+         * at active depth: the candidate points around each cell are
+         * gathered once for all the queries of the cell, and the groups
+         * are processed in parallel. The groups are explored twice: the
+         * first pass counts the neighbors of each query, the second writes
+         * them in place in the graph, so that no intermediate copy of the
+         * edges is kept.
+         *@param begin begin random access iterator over the query points
+         *@param end end random access iterator over the query points
+         *@param radius neighborhood radius (the active radius is changed
+         * accordingly)
+         *@param[out] graph neighborhoods of the queries, in query order
+         */
+        template<class Iterator>
+        void getNeighborGraph(Iterator begin, Iterator end, double radius,
+                              TNeighborGraph<T> &graph);
+
     private :
 
         /**
@@ -236,6 +440,74 @@ class TOctreeIterator
         void explore(TOctreeNode<T> *node, const Point &query_point,
              Neighbor_star_list &neighbors, Distance_list &distances) const;
 
+        /**
+         * @brief explore a node to find neighbors of a point.
+         * @param node (node to explore)
+         * @param query_point (center of the neighborhood)
+         * @param buffer neighbors and square distances
+         */
+        void explore(TOctreeNode<T> *node, const Point &query_point,
+                     TNeighborBuffer<T> &buffer) const;
+
+        /**
+         * @brief explore a node to update the k nearest neighbors of a
+         * point, skipping the children farther than the current k-th
+         * neighbor
+         * @param node (node to explore)
+         * @param query_point (center of the neighborhood)
+         * @param k number of neighbors
+         * @param heap max-heap of the k nearest points found so far
+         */
+        void exploreKNearest(TOctreeNode<T> *node, const Point &query_point,
+                             unsigned int k,
+                      std::vector< std::pair<double, T*> > &heap) const;
+
+        /**
+         * @brief append the points of a node lying in a box to a block of
+         * candidates
+         * @param node (node to explore)
+         * @param bounds box (xmin, ymin, zmin, xmax, ymax, zmax)
+         * @param[out] points points of the node
+         * @param[out] coords coordinates of the points (3 per point)
+         */
+        void gatherPoints(TOctreeNode<T> *node, const double *bounds,
+                          std::vector<T*> &points,
+                          std::vector<double> &coords) const;
+
+        /**
+         * @brief gather the candidate neighbors of the queries of a cell at
+         * active depth: the points of the 27 cells around it that are
+         * closer to the cell than the radius
+         * @param code Morton code of the cell
+         * @param s active depth (clamped to the octree depth)
+         * @param side number of cells per side at active depth
+         * @param cell_size side of the cells
+         * @param[out] points candidate points
+         * @param[out] coords coordinates of the points (3 per point)
+         */
+        void gatherCandidates(uint64_t code, unsigned int s, int side,
+                              double cell_size, std::vector<T*> &points,
+                              std::vector<double> &coords) const;
+
+        /** @brief get the square distance from a point to a node
+         * @param node node
+         * @param query_point point
+         * @return square distance (0 if the point is inside the node)
+         */
+        double sqDistanceToNode(TOctreeNode<T> *node,
+                                const Point &query_point) const;
+
+        /** @brief get the cells that may contain neighbors of a point:
+         * the query node and its adjacent cells at the same depth
+         * @param query query point
+         * @param query_node node containing the query point
+         * @param[out] cells array of at least 27 nodes
+         * @return number of cells
+         */
+        unsigned int getNeighborCells(const Point &query,
+                                      TOctreeNode<T> *query_node,
+                                      TOctreeNode<T> **cells) const;
+
         /** @brief explore a node to find neighbors of a point and
          * sort them according to their distance
          * @param node (node to explore)
@@ -315,6 +587,25 @@ class TOctreeIterator
          * @return the node containing the point at active depth
          */
         TOctreeNode<T>* locatePointNode(const Point &point) const; 
+
+        /** @brief get the node of given locational codes at a given depth,
+         * through the cell table if it indexes this depth, by traversing
+         * the octree from the root otherwise
+         * @param xLocCode x locational code
+         * @param yLocCode y locational code
+         * @param zLocCode z locational code
+         * @param depth depth of the node
+         * @return node, NULL if there is no node at this depth
+         */
+        TOctreeNode<T>* getCell(unsigned int xLocCode, unsigned int yLocCode,
+                                unsigned int zLocCode,
+                                unsigned int depth) const;
+
+        /** @brief hash a cell key
+         * @param key Morton code of the cell plus one
+         * @return slot in the hash table
+         */
+        uint64_t hashCell(uint64_t key) const;
 };
 
 template<class T>
@@ -322,6 +613,10 @@ TOctreeIterator<T>::TOctreeIterator()
 {
     m_octree = NULL;
     m_setIndex = 0;
+    m_hasTable = false;
+    m_tableDepth = 0;
+    m_gridSide = 0;
+    m_hashMask = 0;
 }
 
 
@@ -333,6 +628,11 @@ TOctreeIterator<T>::TOctreeIterator(TOctree<T>* octree)
     m_radius = m_octree->getSize() / ((double)pow2(m_activeDepth));
     m_sqradius = m_radius * m_radius;
     m_setIndex = 0;
+    m_hasTable = false;
+    m_tableDepth = 0;
+    m_gridSide = 0;
+    m_hashMask = 0;
+    buildCellTable();
 }
 
 
@@ -354,6 +654,7 @@ bool TOctreeIterator<T>::setDepth(unsigned int depth)
         m_activeDepth = depth;
         m_radius = m_octree->getSize() / ((double)pow2(depth));
         m_sqradius = m_radius * m_radius;
+        buildCellTable();
         return true;
     }
     return false;
@@ -381,6 +682,7 @@ bool TOctreeIterator<T>::setR(double radius)
         m_sqradius = m_radius * m_radius;
         m_activeDepth = (unsigned int)(m_octree->getDepth()
         - floor( log2( m_octree->getSize() / (2.0*m_radius) )));
+        buildCellTable();
         return true;
     }
     return false;
@@ -431,115 +733,14 @@ template<class T>
 unsigned int TOctreeIterator<T>::getNeighbors(const Point& query,
                                     TOctreeNode<T>* query_node,
                                     Neighbor_star_list& neighbors) const
-{	
-    Point octree_origin = m_octree->getOrigin();
-    Point node_origin = query_node->getOrigin();
-    double node_size = query_node->getSize();
-    double octree_size = m_octree->getSize();
+{
+    TOctreeNode<T> *cells[27];
+    unsigned int ncells = getNeighborCells(query, query_node, cells);
+
+    //look inside neighboring nodes
+    for(unsigned int i = 0; i < ncells; ++i)
+        explore(cells[i], query, neighbors);
 
-    if(query_node->getDepth() ==  m_activeDepth)
-    {
-        //find neighboring nodes
-        std::list<unsigned int> xloc, yloc, zloc;
-        xloc.push_back(query_node->getXLoc());
-        yloc.push_back(query_node->getYLoc());
-        zloc.push_back(query_node->getZLoc());
-
-        if((query.x() - m_radius  < node_origin.x())
-            &&(query.x() - m_radius > octree_origin.x()))
-            xloc.push_back(getXLeftCode(query_node));
-        if((query.x() + m_radius > node_origin.x() + node_size)
-            && (query.x() + m_radius <octree_origin.x() + octree_size))
-            xloc.push_back(getXRightCode(query_node));
-
-
-        if((query.y() - m_radius < node_origin.y())
-            &&(query.y() - m_radius >octree_origin.y()))
-            yloc.push_back(getYLeftCode(query_node));
-        if((query.y() + m_radius > node_origin.y() + node_size)
-            && (query.y() + m_radius < octree_origin.y() + octree_size))
-            yloc.push_back(getYRightCode(query_node));
-
-
-        if((query.z() - m_radius  < node_origin.z())
-            &&(query.z() - m_radius > octree_origin.z()))
-            zloc.push_back(getZLeftCode(query_node));
-        if((query.z() + m_radius > node_origin.z() +node_size)
-            && (query.z() + m_radius <octree_origin.z() + octree_size))
-            zloc.push_back(getZRightCode(query_node));
-
-        //look inside neighboring node
-        std::list<unsigned int>::iterator xi,yi,zi;
-        xi = xloc.begin();
-        while(xi != xloc.end())
-        {
-            yi = yloc.begin();
-            while(yi != yloc.end())
-            {
-                zi = zloc.begin();
-                while(zi != zloc.end())
-                {
-                    TOctreeNode<T> *node=m_octree->getRoot();
-                    traverseToLevel(&node, *xi, *yi, *zi, m_activeDepth);
-                    if((node!=NULL)&&(node->getDepth() == m_activeDepth))
-                        explore(node, query, neighbors);
-                    ++zi;
-                }
-                ++yi;
-            }
-            ++xi;
-        }
-    }
-    else
-    {
-        unsigned int s = query_node->getDepth();
-        std::list<unsigned int> xloc, yloc, zloc;
-        xloc.push_back(query_node->getXLoc());
-        yloc.push_back(query_node->getYLoc());
-        zloc.push_back(query_node->getZLoc());
-        if((query.x() - m_radius  < node_origin.x() )
-            && (query.x() - m_radius > octree_origin.x() ))
-            xloc.push_back(getXLeftCode(query_node));
-        if((query.x() + m_radius > node_origin.x() + node_size)
-            && (query.x() + m_radius < octree_origin.x() +octree_size))
-            xloc.push_back(getXRightCode(query_node));
-
-        if((query.y() - m_radius  < node_origin.y() )
-            && (query.y() - m_radius >octree_origin.y() ))
-            yloc.push_back(getYLeftCode(query_node));
-        if((query.y() + m_radius > node_origin.y() + node_size)
-            && (query.y() + m_radius < octree_origin.y()+octree_size))
-            yloc.push_back(getYRightCode(query_node));
-
-        if((query.z() - m_radius  < node_origin.z() )
-            && (query.z() - m_radius > octree_origin.z()))
-            zloc.push_back(getZLeftCode(query_node));
-        if((query.z() + m_radius > node_origin.z() + node_size)
-            && (query.z() + m_radius <octree_origin.z() + octree_size))
-            zloc.push_back(getZRightCode(query_node));
-
-        //look inside neighboring nodes
-        std::list<unsigned int>::iterator xi,yi,zi;
-        xi = xloc.begin();
-        while(xi != xloc.end())
-        {
-            yi = yloc.begin();
-            while(yi != yloc.end())
-            {
-                zi = zloc.begin();
-                while(zi != zloc.end())
-                {
-                    TOctreeNode<T> *node=m_octree->getRoot();
-                    traverseToLevel(&node,*xi,*yi,*zi,s);
-                    if( (node != NULL )&&( node->getDepth() == s))
-                        explore(node,query,neighbors);
-                    ++zi;
-                }
-                ++yi;
-            }
-            ++xi;
-        }
-    }
     return (int)neighbors.size();
 }
 
@@ -548,114 +749,94 @@ template<class T>
 unsigned int TOctreeIterator<T>::getNeighbors(const Point& query, 
 TOctreeNode<T>* query_node, Neighbor_star_list& neighbors, Distance_list 
 &distances) const
-{	
+{
+    TOctreeNode<T> *cells[27];
+    unsigned int ncells = getNeighborCells(query, query_node, cells);
+
+    //look inside neighboring nodes
+    for(unsigned int i = 0; i < ncells; ++i)
+        explore(cells[i], query, neighbors, distances);
+
+    return (int)neighbors.size();
+}
+
+
+template<class T>
+unsigned int TOctreeIterator<T>::getNeighbors(const Point& query,
+                                    TNeighborBuffer<T>& buffer) const
+{
+    TOctreeNode<T> *node = locatePointNode(query);
+    return getNeighbors(query, node, buffer);
+}
+
+
+template<class T>
+unsigned int TOctreeIterator<T>::getNeighbors(const Point& query,
+                                    TOctreeNode<T>* query_node,
+                                    TNeighborBuffer<T>& buffer) const
+{
+    buffer.clear();
+
+    TOctreeNode<T> *cells[27];
+    unsigned int ncells = getNeighborCells(query, query_node, cells);
+
+    //look inside neighboring nodes
+    for(unsigned int i = 0; i < ncells; ++i)
+        explore(cells[i], query, buffer);
+
+    return (unsigned int)buffer.size();
+}
+
+
+template<class T>
+unsigned int TOctreeIterator<T>::getNeighborCells(const Point& query,
+                                    TOctreeNode<T>* query_node,
+                                    TOctreeNode<T>** cells) const
+{
     Point octree_origin = m_octree->getOrigin();
     Point node_origin = query_node->getOrigin();
     double node_size = query_node->getSize();
     double octree_size = m_octree->getSize();
-
-    if(query_node->getDepth() ==  m_activeDepth)
-    {
-        //find neighboring nodes
-        std::list<unsigned int> xloc, yloc, zloc;
-        xloc.push_back(query_node->getXLoc());
-        yloc.push_back(query_node->getYLoc());
-        zloc.push_back(query_node->getZLoc());
-
-        if((query.x() - m_radius  < node_origin.x())
-            &&(query.x() - m_radius > octree_origin.x()))
-            xloc.push_back(getXLeftCode(query_node));
-        if((query.x() + m_radius > node_origin.x() + node_size)
-            && (query.x() + m_radius <octree_origin.x() + octree_size))
-            xloc.push_back(getXRightCode(query_node));
-
-        if((query.y() - m_radius < node_origin.y())
-            &&(query.y() - m_radius >octree_origin.y()))
-            yloc.push_back(getYLeftCode(query_node));
-        if((query.y() + m_radius > node_origin.y() + node_size)
-            && (query.y() + m_radius < octree_origin.y() + octree_size))
-            yloc.push_back(getYRightCode(query_node));
-
-        if((query.z() - m_radius  < node_origin.z())
-            &&(query.z() - m_radius >octree_origin.z()))
-            zloc.push_back(getZLeftCode(query_node));
-        if((query.z() + m_radius > node_origin.z() +node_size)
-            && (query.z() + m_radius <octree_origin.z() + octree_size))
-            zloc.push_back(getZRightCode(query_node));
-
-        //look inside neighboring node
-        std::list<unsigned int>::iterator xi,yi,zi;
-        xi = xloc.begin();
-        while(xi != xloc.end())
-        {
-            yi = yloc.begin();
-            while(yi != yloc.end())
-            {
-                zi = zloc.begin();
-                while(zi != zloc.end())
-                {
-                    TOctreeNode<T> *node=m_octree->getRoot();
-                    traverseToLevel(&node, *xi, *yi, *zi, m_activeDepth);
-                    if((node!=NULL)&&(node->getDepth() == m_activeDepth))
-                        explore(node, query, neighbors, distances);
-                    ++zi;
-                }
-                ++yi;
-            }
-            ++xi;
-        }
-    }
-    else
-    {
-        unsigned int s=query_node->getDepth();
-        std::list<unsigned int> xloc, yloc, zloc;
-        xloc.push_back(query_node->getXLoc());
-        yloc.push_back(query_node->getYLoc());
-        zloc.push_back(query_node->getZLoc());
-        if((query.x() - m_radius  < node_origin.x())
-            &&(query.x() - m_radius > octree_origin.x()))
-            xloc.push_back(getXLeftCode(query_node));
-        if((query.x() + m_radius > node_origin.x() + node_size)
-            && (query.x() + m_radius < octree_origin.x() + octree_size))
-            xloc.push_back(getXRightCode(query_node));
-
-        if((query.y() - m_radius  < node_origin.y())
-            && (query.y() - m_radius >octree_origin.y() ))
-            yloc.push_back(getYLeftCode(query_node));
-        if((query.y() + m_radius > node_origin.y() + node_size)
-            && (query.y() + m_radius < octree_origin.y() + octree_size))
-            yloc.push_back(getYRightCode(query_node));
-
-        if((query.z() - m_radius  < node_origin.z() )
-            && (query.z() - m_radius >octree_origin.z()))
-            zloc.push_back(getZLeftCode(query_node));
-        if((query.z() + m_radius > node_origin.z() +node_size)
-            && (query.z() + m_radius <octree_origin.z() + octree_size))
-            zloc.push_back(getZRightCode(query_node));
-
-        //look inside neighboring nodes
-        std::list<unsigned int>::iterator xi,yi,zi;
-        xi = xloc.begin();
-        while(xi != xloc.end())
-        {
-            yi = yloc.begin();
-            while(yi != yloc.end())
+    unsigned int s = query_node->getDepth();
+
+    //find neighboring nodes
+    unsigned int xloc[3], yloc[3], zloc[3];
+    unsigned int nx = 0, ny = 0, nz = 0;
+    xloc[nx++] = query_node->getXLoc();
+    yloc[ny++] = query_node->getYLoc();
+    zloc[nz++] = query_node->getZLoc();
+
+    if((query.x() - m_radius  < node_origin.x())
+        &&(query.x() - m_radius > octree_origin.x()))
+        xloc[nx++] = getXLeftCode(query_node);
+    if((query.x() + m_radius > node_origin.x() + node_size)
+        && (query.x() + m_radius <octree_origin.x() + octree_size))
+        xloc[nx++] = getXRightCode(query_node);
+
+    if((query.y() - m_radius < node_origin.y())
+        &&(query.y() - m_radius >octree_origin.y()))
+        yloc[ny++] = getYLeftCode(query_node);
+    if((query.y() + m_radius > node_origin.y() + node_size)
+        && (query.y() + m_radius < octree_origin.y() + octree_size))
+        yloc[ny++] = getYRightCode(query_node);
+
+    if((query.z() - m_radius  < node_origin.z())
+        &&(query.z() - m_radius >octree_origin.z()))
+        zloc[nz++] = getZLeftCode(query_node);
+    if((query.z() + m_radius > node_origin.z() +node_size)
+        && (query.z() + m_radius <octree_origin.z() + octree_size))
+        zloc[nz++] = getZRightCode(query_node);
+
+    unsigned int ncells = 0;
+    for(unsigned int i = 0; i < nx; ++i)
+        for(unsigned int j = 0; j < ny; ++j)
+            for(unsigned int k = 0; k < nz; ++k)
             {
-                zi = zloc.begin();
-                while(zi != zloc.end())
-                {
-                    TOctreeNode<T> *node=m_octree->getRoot();
-                    traverseToLevel(&node,*xi,*yi,*zi,s);
-                    if( (node != NULL )&&( node->getDepth() == s))
-                        explore(node,query,neighbors, distances);
-                    ++zi;
-                }
-                ++yi;
+                TOctreeNode<T> *node = getCell(xloc[i], yloc[j], zloc[k], s);
+                if(node != NULL)
+                    cells[ncells++] = node;
             }
-            ++xi;
-        }
-    }
-    return (int)neighbors.size();
+    return ncells;
 }
 
 
@@ -699,7 +880,7 @@ void TOctreeIterator<T>::explore(TOctreeNode<T>* node,
     }
     else if(node->getNpts(m_setIndex) != 0)
     {
-        typename std::deque<T>::iterator iter;
+        typename TOctreeNode<T>::point_iterator iter;
         for(iter = node->points_begin(m_setIndex);
             iter != node->points_end(m_setIndex); ++iter)
             {
@@ -725,7 +906,7 @@ void TOctreeIterator<T>::explore(TOctreeNode<T>* node,
     }
     else if(node->getNpts(m_setIndex) != 0)
     {
-        typename std::deque<T>::iterator iter;
+        typename TOctreeNode<T>::point_iterator iter;
         for(iter = node->points_begin(m_setIndex);
             iter != node->points_end(m_setIndex);
             ++iter)
@@ -740,6 +921,31 @@ void TOctreeIterator<T>::explore(TOctreeNode<T>* node,
     }
 }
 
+template<class T>
+void TOctreeIterator<T>::explore(TOctreeNode<T>* node,
+                                 const Point& query_point,
+                                 TNeighborBuffer<T> &buffer) const
+{
+    if(node->getDepth() != 0)
+    {
+        for(unsigned int i=0;i<8;i++)
+            if(node->getChild(i) != NULL)
+                explore(node->getChild(i), query_point, buffer);
+    }
+    else if(node->getNpts(m_setIndex) != 0)
+    {
+        typename TOctreeNode<T>::point_iterator iter;
+        for(iter = node->points_begin(m_setIndex);
+            iter != node->points_end(m_setIndex);
+            ++iter)
+        {
+            double dist = dist2( query_point, *iter);
+            if(dist < m_sqradius)
+                buffer.push_back(&(*iter), dist);
+        }
+    }
+}
+
 template<class T>
 unsigned int TOctreeIterator<T>::getSortedNeighbors(const Point &query,
                                            Neighbor_star_map &neighbors) const
@@ -753,116 +959,18 @@ template<class T>
 unsigned int TOctreeIterator<T>::getSortedNeighbors(const Point& query,
                                             TOctreeNode<T>* query_node,
                                             Neighbor_star_map &neighbors) const
-{	
-    Point octree_origin = m_octree->getOrigin();
-    Point node_origin = query_node->getOrigin();
-    double node_size = query_node->getSize();
-    double octree_size = m_octree->getSize();
+{
+    TOctreeNode<T> *cells[27];
+    unsigned int ncells = getNeighborCells(query, query_node, cells);
+
+    //look inside neighboring nodes
+    for(unsigned int i = 0; i < ncells; ++i)
+        exploreSort(cells[i], query, neighbors);
 
-    if(query_node->getDepth() ==  m_activeDepth)
-    {
-        //find neighboring nodes
-        std::list<unsigned int> xloc, yloc, zloc;
-        xloc.push_back(query_node->getXLoc());
-        yloc.push_back(query_node->getYLoc());
-        zloc.push_back(query_node->getZLoc());
-
-        if((query.x() - m_radius  < node_origin.x())
-            &&( query.x() - m_radius > octree_origin.x()))
-            xloc.push_back(getXLeftCode(query_node));
-        if((query.x() + m_radius > node_origin.x() + node_size)
-            && (query.x() + m_radius <octree_origin.x() + octree_size))
-            xloc.push_back(getXRightCode(query_node));
-
-        if((query.y() - m_radius < node_origin.y())
-            &&(query.y() - m_radius >octree_origin.y()))
-            yloc.push_back(getYLeftCode(query_node));
-        if((query.y() + m_radius > node_origin.y() + node_size)
-            && (query.y() + m_radius < octree_origin.y() + octree_size))
-            yloc.push_back(getYRightCode(query_node));
-
-        if((query.z() - m_radius  < node_origin.z())
-            &&(query.z() - m_radius >octree_origin.z()))
-            zloc.push_back(getZLeftCode(query_node));
-        if((query.z() + m_radius > node_origin.z() +node_size)
-            && (query.z() + m_radius <octree_origin.z() + octree_size))
-            zloc.push_back(getZRightCode(query_node));
-
-        //look inside neighboring node
-        std::list<unsigned int>::iterator xi,yi,zi;
-        xi = xloc.begin();
-        while(xi != xloc.end())
-        {
-            yi = yloc.begin();
-            while(yi != yloc.end())
-            {
-                zi = zloc.begin();
-                while(zi != zloc.end())
-                {
-                    TOctreeNode<T> *node=m_octree->getRoot();
-                    traverseToLevel(&node, *xi, *yi, *zi, m_activeDepth);
-                    if((node!=NULL)&&(node->getDepth() == m_activeDepth))
-                        exploreSort(node, query, neighbors);
-                    ++zi;
-                }
-                ++yi;
-            }
-            ++xi;
-        }
-    }
-    else
-    {
-        unsigned int s=query_node->getDepth();
-        std::list<unsigned int> xloc, yloc, zloc;
-        xloc.push_back(query_node->getXLoc());
-        yloc.push_back(query_node->getYLoc());
-        zloc.push_back(query_node->getZLoc());
-        if((query.x() - m_radius  < node_origin.x())
-            &&(query.x() - m_radius > octree_origin.x()))
-            xloc.push_back(getXLeftCode(query_node));
-        if((query.x() + m_radius > node_origin.x() + node_size)
-            && (query.x() + m_radius < octree_origin.x() + octree_size))
-            xloc.push_back(getXRightCode(query_node));
-
-        if((query.y() - m_radius  < node_origin.y())
-            &&(query.y() - m_radius >octree_origin.y() ))
-            yloc.push_back(getYLeftCode(query_node));
-        if((query.y() + m_radius > node_origin.y() + node_size)
-            && (query.y() + m_radius < octree_origin.y() + octree_size))
-            yloc.push_back(getYRightCode(query_node));
-
-        if((query.z() - m_radius  < node_origin.z() )
-            &&(query.z() - m_radius >octree_origin.z()))
-            zloc.push_back(getZLeftCode(query_node));
-        if((query.z() + m_radius > node_origin.z() +node_size)
-            && (query.z() + m_radius <octree_origin.z() + octree_size))
-            zloc.push_back(getZRightCode(query_node));
-
-        //look inside neighboring nodes
-        std::list<unsigned int>::iterator xi,yi,zi;
-        xi = xloc.begin();
-        while(xi != xloc.end())
-        {
-            yi = yloc.begin();
-            while(yi != yloc.end())
-            {
-                zi = zloc.begin();
-                while(zi != zloc.end())
-                {
-                    TOctreeNode<T> *node=m_octree->getRoot();
-                    traverseToLevel(&node,*xi,*yi,*zi,s);
-                    if( (node != NULL )&&( node->getDepth() == s))
-                        exploreSort(node, query, neighbors);
-                    ++zi;
-                }
-                ++yi;
-            }
-            ++xi;
-        }
-    }
     return (int)neighbors.size();
 }
 
+
 template<class T>
 void TOctreeIterator<T>::exploreSort(TOctreeNode<T>* node,
                                      const Point& query_point,
@@ -876,7 +984,7 @@ void TOctreeIterator<T>::exploreSort(TOctreeNode<T>* node,
     }
     else if(node->getNpts(m_setIndex) != 0)
     {
-        typename std::deque<T>::iterator iter;
+        typename TOctreeNode<T>::point_iterator iter;
 
         for(iter = node->points_begin(m_setIndex);
             iter != node->points_end(m_setIndex); ++iter)
@@ -945,144 +1053,510 @@ TOctreeNode<T>* TOctreeIterator<T>::locatePointNode(const Point& point) const
     unsigned int codx,cody,codz;
     computeCode(point, codx, cody, codz);
 
-    TOctreeNode<T> *node = m_octree->getRoot();
+    TOctreeNode<T> *node = getCell(codx, cody, codz, m_activeDepth);
+    if(node != NULL)
+        return node;
+
+    node = m_octree->getRoot();
     traverseToLevel(&node, codx, cody, codz, m_activeDepth);
 
     return node;
 }
 
 template<class T>
-bool TOctreeIterator<T>::containsOnly(const Point& query,
-                                      const Exception_set& exceptions) const
+unsigned int TOctreeIterator<T>::getKNearestNeighbors(const Point& query,
+                                             unsigned int k,
+                                             TNeighborBuffer<T>& buffer) const
 {
-    TOctreeNode<T> *node = locatePointNode(query);
-    return containsOnly(query, node, exceptions);
+    buffer.clear();
+    std::vector< std::pair<double, T*> > &heap = buffer.heap;
+    heap.clear();
+    if(k == 0)
+        return 0;
+
+    const unsigned int s = std::min(m_activeDepth, m_octree->getDepth());
+    const int side = 1 << (m_octree->getDepth() - s);
+    const double cell_size = m_octree->getSize() / (double)side;
+    const Point &octree_origin = m_octree->getOrigin();
+
+    //cell containing the query (clamped to the octree)
+    double q[3] = {query.x() - octree_origin.x(),
+                   query.y() - octree_origin.y(),
+                   query.z() - octree_origin.z()};
+    int c[3];
+    int rmax = 0;
+    for(int a = 0; a < 3; ++a)
+    {
+        c[a] = (int)floor(q[a] / cell_size);
+        c[a] = std::max(0, std::min(side - 1, c[a]));
+        rmax = std::max(rmax, std::max(c[a], side - 1 - c[a]));
+    }
+
+    for(int r = 0; r <= rmax; ++r)
+    {
+        //visit the cells at Chebyshev distance r of the query cell
+        for(int i = c[0] - r; i <= c[0] + r; ++i)
+        {
+            if(i < 0 || i >= side)
+                continue;
+            for(int j = c[1] - r; j <= c[1] + r; ++j)
+            {
+                if(j < 0 || j >= side)
+                    continue;
+                bool full = (abs(i - c[0]) == r) || (abs(j - c[1]) == r);
+                int step = full ? 1 : std::max(1, 2 * r);
+                for(int l = c[2] - r; l <= c[2] + r; l += step)
+                {
+                    if(l < 0 || l >= side)
+                        continue;
+                    TOctreeNode<T> *node = getCell((unsigned int)i << s,
+                                                   (unsigned int)j << s,
+                                                   (unsigned int)l << s, s);
+                    if(node != NULL)
+                        exploreKNearest(node, query, k, heap);
+                }
+            }
+        }
+
+        //distance from the query to the cells beyond ring r
+        if(heap.size() == k)
+        {
+            double bound = -1.0;
+            for(int a = 0; a < 3; ++a)
+            {
+                if(c[a] - r > 0)
+                {
+                    double d = q[a] - (c[a] - r) * cell_size;
+                    bound = (bound < 0) ? d : std::min(bound, d);
+                }
+                if(c[a] + r < side - 1)
+                {
+                    double d = (c[a] + r + 1) * cell_size - q[a];
+                    bound = (bound < 0) ? d : std::min(bound, d);
+                }
+            }
+            if(bound < 0 || bound * bound >= heap.front().first)
+                break;
+        }
+    }
+
+    std::sort_heap(heap.begin(), heap.end());
+    for(size_t i = 0; i < heap.size(); ++i)
+        buffer.push_back(heap[i].second, heap[i].first);
+    return (unsigned int)buffer.size();
 }
 
+
 template<class T>
-bool TOctreeIterator<T>::containsOnly(const Point& query,
-                                      TOctreeNode< T >* query_node,
-                                      const Exception_set& exceptions) const
+template<class Iterator>
+void TOctreeIterator<T>::getKNearestNeighbors(Iterator begin, Iterator end,
+                                     unsigned int k,
+                                     std::vector<T*> &neighbors,
+                                     std::vector<double> &sqdistances,
+                                     std::vector<unsigned int> &counts) const
 {
-    Point octree_origin = m_octree->getOrigin();
-    Point node_origin = query_node->getOrigin();
-    double node_size = query_node->getSize();
-    double octree_size = m_octree->getSize();
+    const int n = (int)(end - begin);
+    neighbors.assign((size_t)n * k, (T*)NULL);
+    sqdistances.assign((size_t)n * k, 0.0);
+    counts.assign(n, 0);
+
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+    {
+        TNeighborBuffer<T> buffer;
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 256)
+#endif
+        for(int i = 0; i < n; ++i)
+        {
+            unsigned int found = getKNearestNeighbors(begin[i], k, buffer);
+            for(unsigned int j = 0; j < found; ++j)
+            {
+                neighbors[(size_t)i * k + j] = buffer.neighbors[j];
+                sqdistances[(size_t)i * k + j] = buffer.sqdistances[j];
+            }
+            counts[i] = found;
+        }
+    }
+}
+
+
+template<class T>
+template<class Iterator>
+void TOctreeIterator<T>::getNeighborGraph(Iterator begin, Iterator end,
+                                          double radius,
+                                          TNeighborGraph<T> &graph)
+{
+    //the active depth must follow the radius: the one the constructor
+    //sets (the leaf size at the root level) would make the whole octree a
+    //single cell, and every query would scan every point
+    if(!setR(radius))
+    {
+        //radius larger than the octree: a single cell is right
+        m_radius = radius;
+        m_sqradius = radius * radius;
+        m_activeDepth = m_octree->getDepth();
+        buildCellTable();
+    }
+
+    const int n = (int)(end - begin);
+    graph.clear();
+    graph.offsets.assign(n + 1, 0);
+    if(n == 0)
+        return;
+
+    const unsigned int s = std::min(m_activeDepth, m_octree->getDepth());
+    const int side = 1 << (m_octree->getDepth() - s);
+    const double cell_size = m_octree->getSize() / (double)side;
+    assert(cell_size < 4.0 * radius);
+    const Point &octree_origin = m_octree->getOrigin();
 
-    if(query_node->getDepth() ==  m_activeDepth)
+    //sort the queries along the Morton curve of their cells
+    std::vector<uint64_t> codes(n);
+    std::vector<unsigned int> order(n);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+    for(int i = 0; i < n; ++i)
     {
-        //find neighboring nodes
-        std::list<unsigned int> xloc, yloc, zloc;
-        xloc.push_back(query_node->getXLoc());
-        yloc.push_back(query_node->getYLoc());
-        zloc.push_back(query_node->getZLoc());
-
-        if((query.x() - m_radius  < node_origin.x())
-            &&(query.x() - m_radius > octree_origin.x()))
-            xloc.push_back(getXLeftCode(query_node));
-        if((query.x() + m_radius > node_origin.x() + node_size)
-            && (query.x() + m_radius <octree_origin.x() + octree_size))
-            xloc.push_back(getXRightCode(query_node));
-
-        if((query.y() - m_radius < node_origin.y())
-            &&(query.y() - m_radius >octree_origin.y()))
-            yloc.push_back(getYLeftCode(query_node));
-        if((query.y() + m_radius > node_origin.y() + node_size)
-            && (query.y() + m_radius < octree_origin.y() + octree_size))
-            yloc.push_back(getYRightCode(query_node));
-
-        if((query.z() - m_radius  < node_origin.z())
-            &&(query.z() - m_radius >octree_origin.z()))
-            zloc.push_back(getZLeftCode(query_node));
-        if((query.z() + m_radius > node_origin.z() +node_size)
-            && (query.z() + m_radius <octree_origin.z() + octree_size))
-            zloc.push_back(getZRightCode(query_node));
-
-        //look inside neighboring node
-        std::list<unsigned int>::iterator xi,yi,zi;
-        xi = xloc.begin();
-        while (xi != xloc.end())
+        const Point &query = begin[i];
+        int cx = (int)floor((query.x() - octree_origin.x()) / cell_size);
+        int cy = (int)floor((query.y() - octree_origin.y()) / cell_size);
+        int cz = (int)floor((query.z() - octree_origin.z()) / cell_size);
+        cx = std::max(0, std::min(side - 1, cx));
+        cy = std::max(0, std::min(side - 1, cy));
+        cz = std::max(0, std::min(side - 1, cz));
+        codes[i] = mortonEncode(cx, cy, cz);
+        order[i] = (unsigned int)i;
+    }
+    parallelRadixSort(codes, order, 3 * (m_octree->getDepth() - s));
+
+    std::vector<unsigned int> starts;
+    getRunStarts(codes, 0, starts);
+    const int ngroups = (int)starts.size() - 1;
+
+    //first pass: number of neighbors of each query
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+    {
+        std::vector<T*> block;
+        std::vector<double> block_coords;
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 16)
+#endif
+        for(int g = 0; g < ngroups; ++g)
         {
-            yi = yloc.begin();
-            while (yi != yloc.end())
+            gatherCandidates(codes[starts[g]], s, side, cell_size, block,
+                             block_coords);
+            const size_t nblock = block.size();
+            for(unsigned int qi = starts[g]; qi < starts[g + 1]; ++qi)
             {
-                zi = zloc.begin();
-                while (zi != zloc.end())
+                const unsigned int q = order[qi];
+                const Point &query = begin[q];
+                const double x = query.x(), y = query.y(), z = query.z();
+                size_t count = 0;
+                for(size_t b = 0; b < nblock; ++b)
                 {
-                    TOctreeNode<T> *node=m_octree->getRoot();
-                    traverseToLevel(&node, *xi, *yi, *zi, m_activeDepth);
-                    bool ok = true;
-                    if((node!=NULL)&&( node->getDepth() == m_activeDepth))
-                    {
-                        explore(node, query, exceptions, ok);
-                        if(!ok)
-                            return false;
-                    }
-                    ++zi;
+                    double dx = block_coords[3 * b] - x;
+                    double dy = block_coords[3 * b + 1] - y;
+                    double dz = block_coords[3 * b + 2] - z;
+                    if(dx * dx + dy * dy + dz * dz < m_sqradius)
+                        ++count;
                 }
-                ++yi;
+                graph.offsets[q + 1] = count;
             }
-            ++xi;
         }
     }
-    else
+
+    for(int i = 0; i < n; ++i)
+        graph.offsets[i + 1] += graph.offsets[i];
+    graph.indices.resize(graph.offsets[n]);
+    graph.sqdistances.resize(graph.offsets[n]);
+
+    //second pass: the neighbors, written at their final place
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
     {
-        unsigned int s=query_node->getDepth();
-        std::list<unsigned int> xloc, yloc, zloc;
-        xloc.push_back(query_node->getXLoc());
-        yloc.push_back(query_node->getYLoc());
-        zloc.push_back(query_node->getZLoc());
-        if((query.x() - m_radius  < node_origin.x())
-            && (query.x() - m_radius > octree_origin.x()))
-            xloc.push_back(getXLeftCode(query_node));
-        if((query.x() + m_radius > node_origin.x() + node_size)
-            && (query.x() + m_radius < octree_origin.x() + octree_size))
-            xloc.push_back(getXRightCode(query_node));
-
-        if((query.y() - m_radius  < node_origin.y())
-            && (query.y() - m_radius >octree_origin.y() ))
-            yloc.push_back(getYLeftCode(query_node));
-        if((query.y() + m_radius > node_origin.y() + node_size)
-            && (query.y() + m_radius < octree_origin.y() + octree_size))
-            yloc.push_back(getYRightCode(query_node));
-
-        if((query.z() - m_radius  < node_origin.z() )
-            && (query.z() - m_radius >octree_origin.z()))
-            zloc.push_back(getZLeftCode(query_node));
-        if((query.z() + m_radius > node_origin.z() +node_size)
-            && (query.z() + m_radius <octree_origin.z() + octree_size))
-            zloc.push_back(getZRightCode(query_node));
-
-
-        //look inside neighboring nodes
-        std::list<unsigned int>::iterator xi,yi,zi;
-        xi = xloc.begin();
-        while(xi != xloc.end())
+        std::vector<T*> block;
+        std::vector<double> block_coords;
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 16)
+#endif
+        for(int g = 0; g < ngroups; ++g)
         {
-            yi = yloc.begin();
-            while(yi != yloc.end())
+            gatherCandidates(codes[starts[g]], s, side, cell_size, block,
+                             block_coords);
+            const size_t nblock = block.size();
+            for(unsigned int qi = starts[g]; qi < starts[g + 1]; ++qi)
             {
-                zi = zloc.begin();
-                while(zi != zloc.end())
+                const unsigned int q = order[qi];
+                const Point &query = begin[q];
+                const double x = query.x(), y = query.y(), z = query.z();
+                size_t k = graph.offsets[q];
+                for(size_t b = 0; b < nblock; ++b)
                 {
-                    TOctreeNode<T> *node=m_octree->getRoot();
-                    traverseToLevel(&node,*xi,*yi,*zi,s);
-                    bool ok = true;
-                    if( (node != NULL )&&( node->getDepth() == s))
-                        explore(node, query, exceptions, ok);
-                    if(!ok)
-                        return false;
-                    ++zi;
+                    double dx = block_coords[3 * b] - x;
+                    double dy = block_coords[3 * b + 1] - y;
+                    double dz = block_coords[3 * b + 2] - z;
+                    double dist = dx * dx + dy * dy + dz * dz;
+                    if(dist < m_sqradius)
+                    {
+                        graph.indices[k] = (unsigned int)block[b]->index();
+                        graph.sqdistances[k++] = (float)dist;
+                    }
                 }
-                ++yi;
             }
-            ++xi;
         }
     }
-    return true;
 }
 
 
+template<class T>
+void TOctreeIterator<T>::gatherCandidates(uint64_t code, unsigned int s,
+                                          int side, double cell_size,
+                                          std::vector<T*> &points,
+                                          std::vector<double> &coords) const
+{
+    const Point &octree_origin = m_octree->getOrigin();
+    unsigned int cx, cy, cz;
+    mortonDecode(code, cx, cy, cz);
+    double bounds[6] = {
+        octree_origin.x() + cx * cell_size - m_radius,
+        octree_origin.y() + cy * cell_size - m_radius,
+        octree_origin.z() + cz * cell_size - m_radius,
+        octree_origin.x() + (cx + 1) * cell_size + m_radius,
+        octree_origin.y() + (cy + 1) * cell_size + m_radius,
+        octree_origin.z() + (cz + 1) * cell_size + m_radius};
+    points.clear();
+    coords.clear();
+    for(int i = (int)cx - 1; i <= (int)cx + 1; ++i)
+        for(int j = (int)cy - 1; j <= (int)cy + 1; ++j)
+            for(int l = (int)cz - 1; l <= (int)cz + 1; ++l)
+            {
+                if(i < 0 || j < 0 || l < 0
+                   || i >= side || j >= side || l >= side)
+                    continue;
+                TOctreeNode<T> *node = getCell((unsigned int)i << s,
+                                               (unsigned int)j << s,
+                                               (unsigned int)l << s,
+                                               s);
+                if(node != NULL)
+                    gatherPoints(node, bounds, points, coords);
+            }
+}
+
+
+template<class T>
+void TOctreeIterator<T>::gatherPoints(TOctreeNode<T>* node,
+                                      const double *bounds,
+                                      std::vector<T*> &points,
+                                      std::vector<double> &coords) const
+{
+    if(node->getDepth() != 0)
+    {
+        for(unsigned int i=0;i<8;i++)
+            if(node->getChild(i) != NULL)
+                gatherPoints(node->getChild(i), bounds, points, coords);
+    }
+    else if(node->getNpts(m_setIndex) != 0)
+    {
+        typename TOctreeNode<T>::point_iterator iter;
+        for(iter = node->points_begin(m_setIndex);
+            iter != node->points_end(m_setIndex);
+            ++iter)
+        {
+            if(iter->x() < bounds[0] || iter->x() > bounds[3]
+               || iter->y() < bounds[1] || iter->y() > bounds[4]
+               || iter->z() < bounds[2] || iter->z() > bounds[5])
+                continue;
+            points.push_back(&(*iter));
+            coords.push_back(iter->x());
+            coords.push_back(iter->y());
+            coords.push_back(iter->z());
+        }
+    }
+}
+
+template<class T>
+void TOctreeIterator<T>::exploreKNearest(TOctreeNode<T>* node,
+                                const Point& query_point, unsigned int k,
+                                std::vector< std::pair<double, T*> > &heap) const
+{
+    if(heap.size() == k && sqDistanceToNode(node, query_point)
+                           >= heap.front().first)
+        return;
+
+    if(node->getDepth() != 0)
+    {
+        for(unsigned int i=0;i<8;i++)
+            if(node->getChild(i) != NULL)
+                exploreKNearest(node->getChild(i), query_point, k, heap);
+    }
+    else if(node->getNpts(m_setIndex) != 0)
+    {
+        typename TOctreeNode<T>::point_iterator iter;
+        for(iter = node->points_begin(m_setIndex);
+            iter != node->points_end(m_setIndex);
+            ++iter)
+        {
+            double dist = dist2( query_point, *iter);
+            if(heap.size() < k)
+            {
+                heap.push_back(std::pair<double, T*>(dist, &(*iter)));
+                std::push_heap(heap.begin(), heap.end());
+            }
+            else if(dist < heap.front().first)
+            {
+                std::pop_heap(heap.begin(), heap.end());
+                heap.back() = std::pair<double, T*>(dist, &(*iter));
+                std::push_heap(heap.begin(), heap.end());
+            }
+        }
+    }
+}
+
+
+template<class T>
+double TOctreeIterator<T>::sqDistanceToNode(TOctreeNode<T>* node,
+                                            const Point& query_point) const
+{
+    const Point origin = node->getOrigin();
+    const double size = node->getSize();
+    double dx = std::max(0.0, std::max(origin.x() - query_point.x(),
+                                       query_point.x() - origin.x() - size));
+    double dy = std::max(0.0, std::max(origin.y() - query_point.y(),
+                                       query_point.y() - origin.y() - size));
+    double dz = std::max(0.0, std::max(origin.z() - query_point.z(),
+                                       query_point.z() - origin.z() - size));
+    return dx * dx + dy * dy + dz * dz;
+}
+
+template<class T>
+void TOctreeIterator<T>::buildCellTable()
+{
+    m_hasTable = false;
+    m_grid.clear();
+    m_hashKeys.clear();
+    m_hashNodes.clear();
+    if(m_octree == NULL || m_octree->getRoot() == NULL
+       || m_octree->getDepth() - m_activeDepth > 21)
+        return;
+
+    std::vector< TOctreeNode<T>* > nodes;
+    m_octree->getNodes(m_activeDepth, m_octree->getRoot(), nodes);
+
+    m_tableDepth = m_activeDepth;
+    m_gridSide = 1u << (m_octree->getDepth() - m_activeDepth);
+    const uint64_t ncells = (uint64_t)m_gridSide * m_gridSide * m_gridSide;
+
+    //a dense grid is used if it is not too sparse, a hash table otherwise
+    if(ncells <= std::max<uint64_t>(16 * nodes.size(), 1 << 18)
+       && ncells <= (1 << 26))
+    {
+        m_grid.assign((size_t)ncells, (TOctreeNode<T>*)NULL);
+        for(size_t i = 0; i < nodes.size(); ++i)
+        {
+            unsigned int x = nodes[i]->getXLoc() >> m_tableDepth;
+            unsigned int y = nodes[i]->getYLoc() >> m_tableDepth;
+            unsigned int z = nodes[i]->getZLoc() >> m_tableDepth;
+            m_grid[((size_t)x * m_gridSide + y) * m_gridSide + z] = nodes[i];
+        }
+    }
+    else
+    {
+        uint64_t size = 1;
+        while(size < 2 * nodes.size())
+            size <<= 1;
+        m_hashMask = size - 1;
+        m_hashKeys.assign((size_t)size, 0);
+        m_hashNodes.assign((size_t)size, (TOctreeNode<T>*)NULL);
+        for(size_t i = 0; i < nodes.size(); ++i)
+        {
+            uint64_t key = mortonEncode(nodes[i]->getXLoc() >> m_tableDepth,
+                                        nodes[i]->getYLoc() >> m_tableDepth,
+                                        nodes[i]->getZLoc() >> m_tableDepth)
+                           + 1;
+            uint64_t slot = hashCell(key);
+            while(m_hashKeys[(size_t)slot] != 0)
+                slot = (slot + 1) & m_hashMask;
+            m_hashKeys[(size_t)slot] = key;
+            m_hashNodes[(size_t)slot] = nodes[i];
+        }
+    }
+    m_hasTable = true;
+}
+
+template<class T>
+uint64_t TOctreeIterator<T>::hashCell(uint64_t key) const
+{
+    return (key * 0x9E3779B97F4A7C15ULL >> 20) & m_hashMask;
+}
+
+template<class T>
+TOctreeNode<T>* TOctreeIterator<T>::getCell(unsigned int xLocCode,
+                                            unsigned int yLocCode,
+                                            unsigned int zLocCode,
+                                            unsigned int depth) const
+{
+    if(!m_hasTable || depth != m_tableDepth)
+    {
+        TOctreeNode<T> *node = m_octree->getRoot();
+        traverseToLevel(&node, xLocCode, yLocCode, zLocCode, depth);
+        if(node->getDepth() != depth)
+            return NULL;
+        return node;
+    }
+
+    unsigned int x = xLocCode >> depth;
+    unsigned int y = yLocCode >> depth;
+    unsigned int z = zLocCode >> depth;
+    if(x >= m_gridSide || y >= m_gridSide || z >= m_gridSide)
+        return NULL;
+
+    if(!m_grid.empty())
+        return m_grid[((size_t)x * m_gridSide + y) * m_gridSide + z];
+
+    uint64_t key = mortonEncode(x, y, z) + 1;
+    uint64_t slot = hashCell(key);
+    while(m_hashKeys[(size_t)slot] != 0)
+    {
+        if(m_hashKeys[(size_t)slot] == key)
+            return m_hashNodes[(size_t)slot];
+        slot = (slot + 1) & m_hashMask;
+    }
+    return NULL;
+}
+
+template<class T>
+bool TOctreeIterator<T>::containsOnly(const Point& query,
+                                      const Exception_set& exceptions) const
+{
+    TOctreeNode<T> *node = locatePointNode(query);
+    return containsOnly(query, node, exceptions);
+}
+
+template<class T>
+bool TOctreeIterator<T>::containsOnly(const Point& query,
+                                      TOctreeNode< T >* query_node,
+                                      const Exception_set& exceptions) const
+{
+    TOctreeNode<T> *cells[27];
+    unsigned int ncells = getNeighborCells(query, query_node, cells);
+
+    //look inside neighboring nodes
+    for(unsigned int i = 0; i < ncells; ++i)
+    {
+        bool ok = true;
+        explore(cells[i], query, exceptions, ok);
+        if(!ok)
+            return false;
+    }
+    return true;
+}
+
 
 template<class T>
 void TOctreeIterator<T>::explore(TOctreeNode<T> *node,
@@ -1105,7 +1579,7 @@ void TOctreeIterator<T>::explore(TOctreeNode<T> *node,
     }
     else if(node->getNpts(m_setIndex) != 0)
     {
-        typename std::deque<T>::iterator iter;
+        typename TOctreeNode<T>::point_iterator iter;
         for(iter = node->points_begin(m_setIndex);
             iter != node->points_end(m_setIndex); ++iter)
             {
@@ -19,12 +19,13 @@
 #define OCTREENODE_H
 
 #include <cstdlib>
-#include <deque>
 #include <iostream>
 #include <fstream>
 #include <cassert>
+#include <new>
 
 #include "Point.h"
+#include "OctreeAllocator.h"
 
 /**
  * @class TOctreeNode
@@ -36,6 +37,10 @@
 template<class T>
 class TOctreeNode
 {
+    public :
+        typedef typename TPointList<T>::iterator point_iterator;
+        typedef typename TPointList<T>::const_iterator const_point_iterator;
+
     protected :
 
         /** @brief pointer to the parent of the node
@@ -102,24 +107,34 @@ class TOctreeNode
          * the second and third lists are the filtered sets
          * (2 lists are necessary for buffering)
          */
-        std::deque<T> m_points[3];
+        TPointList<T> m_points[3];
+
+        /** @brief allocator of the octree the node belongs to (provides
+         * the children and the point chunks)
+         */
+        TOctreeAllocator<T> *m_allocator;
 
     public :
         /**
          *  @brief Default constructor initializes all variables
+         *  @param allocator allocator of the octree
          */
-        TOctreeNode();
+        explicit TOctreeNode(TOctreeAllocator<T> *allocator = NULL);
 
         /**
          * @brief constructor initializes size, depth and origin
          * @param size;
          * @param origin
          * @param depth
+         * @param allocator allocator of the octree
          */
-        TOctreeNode(Point & origin, double size, unsigned int depth);
+        TOctreeNode(Point & origin, double size, unsigned int depth,
+                    TOctreeAllocator<T> *allocator = NULL);
 
         /**
-         * @brief  Destructor
+         * @brief  Destructor: destroys the points of the node.
+         * The node memory and the children belong to the octree allocator,
+         * they are released with it.
          */
         ~TOctreeNode();
 
@@ -258,27 +273,25 @@ class TOctreeNode
          * @param index index of the point list
          * @return pointer to the beginning of the list
          */
-        typename std::deque<T>::iterator points_begin(unsigned int index);
+        point_iterator points_begin(unsigned int index);
 
         /** @brief get a pointer to the end of the list of points
          * @param index index of the point list
          * @return pointer to the end of 'points'
          */
-        typename std::deque<T>::iterator points_end(unsigned int index);
+        point_iterator points_end(unsigned int index);
 
         /** @brief get a const pointer to the list of points
          * @param index index of the point list
          * @return const pointer to the beginning of the list
          */
-        typename std::deque<T>::const_iterator points_begin(
-                                              unsigned int index) const;
+        const_point_iterator points_begin(unsigned int index) const;
 
         /** @brief get a const pointer to the end of the list of points
          * @param index index of the point list
          * @return const pointer to the end of 'points'
          */
-        typename std::deque<T>::const_iterator points_end(
-                                               unsigned int index) const;
+        const_point_iterator points_end(unsigned int index) const;
 
         /** @brief add a point to the list of points included in the cell
          * PREREQUISITE: the node is a leaf in the octree
@@ -300,6 +313,34 @@ class TOctreeNode
          */
         TOctreeNode<T>* initializeChild(unsigned int index, Point origin);
 
+        /** @brief remove the points of a set matching a predicate
+         * (the order of the remaining points is kept)
+         * @param index index of the point list
+         * @param pred predicate, true for the points to remove
+         * @return number of removed points
+         */
+        template<class Predicate>
+        unsigned int removePoints(unsigned int index, Predicate pred);
+
+        /** @brief check if the node holds nothing: no point in any set and
+         * no child
+         * @return true if the node is empty
+         */
+        bool isEmpty() const;
+
+        /** @brief detach the i^th child of the node (the child is not
+         * destroyed)
+         * @param index child index
+         */
+        void removeChild(unsigned int index);
+
+        /** @brief attach an already built node as the i^th child of the node
+         * (used when the octree is built bottom-up)
+         * @param index child index
+         * @param child node to attach
+         */
+        void setChild(unsigned int index, TOctreeNode<T> *child);
+
         /** @brief clear point sets in all the children of the node
          * (and itself) 
          * @param index index of the set to clear
@@ -309,7 +350,7 @@ class TOctreeNode
 
 
 template<class T>
-TOctreeNode<T>::TOctreeNode()
+TOctreeNode<T>::TOctreeNode(TOctreeAllocator<T>* allocator)
 {
     for(int i = 0 ; i <8 ; i++)
         m_child[i] = NULL;
@@ -319,10 +360,12 @@ TOctreeNode<T>::TOctreeNode()
     m_npts = 0;
     m_origin = Point();
     m_size = 0.0;
+    m_allocator = allocator;
 }
 
 template<class T>
-TOctreeNode<T>::TOctreeNode(Point& origin, double size, unsigned int depth)
+TOctreeNode<T>::TOctreeNode(Point& origin, double size, unsigned int depth,
+                            TOctreeAllocator<T>* allocator)
 {
     for(int i = 0 ; i <8 ; i++)
         m_child[i] = NULL;
@@ -332,19 +375,21 @@ TOctreeNode<T>::TOctreeNode(Point& origin, double size, unsigned int depth)
     m_npts = 0;
     m_origin = origin;
     m_size = size;
+    m_allocator = allocator;
 }
 
 template<class T>
 TOctreeNode<T>::~TOctreeNode()
 {
-    for(int i = 0; i < 3 ; ++i)
-        m_points[i].clear();
+    if(m_allocator != NULL)
+        for(int i = 0; i < 3 ; ++i)
+            m_points[i].clear(*m_allocator);
     
     m_xloc = m_yloc = m_zloc =0;
     m_depth = 0;
     m_npts = 0;
     for(int i = 0; i<8 ; i++)
-        delete m_child[i];
+        m_child[i] = NULL;
     m_parent = NULL;
     m_origin = Point();
     m_size = 0.0;
@@ -502,27 +547,28 @@ Point TOctreeNode<T>::getOrigin() const
 }
 
 template<class T>
-typename std::deque<T>::iterator TOctreeNode<T>::points_begin(unsigned int 
-index)
+typename TOctreeNode<T>::point_iterator TOctreeNode<T>::points_begin(
+unsigned int index)
 {
     return m_points[index].begin();
 }
 
 template<class T>
-typename std::deque<T>::iterator TOctreeNode<T>::points_end(unsigned int index)
+typename TOctreeNode<T>::point_iterator TOctreeNode<T>::points_end(
+unsigned int index)
 {
     return m_points[index].end();
 }
 
 template<class T>
-typename std::deque<T>::const_iterator TOctreeNode<T>::points_begin(
+typename TOctreeNode<T>::const_point_iterator TOctreeNode<T>::points_begin(
     unsigned int index) const
 {
     return m_points[index].begin();
 }
 
 template<class T>
-typename std::deque<T>::const_iterator TOctreeNode<T>::points_end(
+typename TOctreeNode<T>::const_point_iterator TOctreeNode<T>::points_end(
 unsigned int index) const
 {
     return m_points[index].end();
@@ -531,14 +577,16 @@ unsigned int index) const
 template<class T>
 void TOctreeNode<T>::addInitialPoint(T &t)
 {
-    m_points[0].push_back(t);
+    assert(m_allocator != NULL);
+    m_points[0].push_back(t, *m_allocator);
     m_npts++;
 }
 
 template<class T>
 void TOctreeNode<T>::addPoint(T &t, unsigned int index)
 {
-    m_points[index].push_back(t);
+    assert(m_allocator != NULL);
+    m_points[index].push_back(t, *m_allocator);
 }
 
 template<class T>
@@ -547,20 +595,62 @@ TOctreeNode< T >* TOctreeNode<T>::initializeChild(unsigned int index,
 {
     double size = m_size/2.0;
     unsigned int depth= m_depth -1;
-    m_child[index] = new TOctreeNode<T>(origin, size, depth);
+    void *memory = m_allocator->allocate(sizeof(TOctreeNode<T>));
+    m_child[index] = new (memory) TOctreeNode<T>(origin, size, depth,
+                                                 m_allocator);
     m_child[index]->setParent(this);
     m_child[index]->setNchild(index);
 
     return m_child[index];
 }
 
+template<class T>
+template<class Predicate>
+unsigned int TOctreeNode<T>::removePoints(unsigned int index, Predicate pred)
+{
+    if(m_allocator == NULL)
+        return 0;
+    unsigned int removed = m_points[index].removeIf(pred, *m_allocator);
+    if(index == 0)
+        m_npts -= removed;
+    return removed;
+}
+
+template<class T>
+bool TOctreeNode<T>::isEmpty() const
+{
+    for(int i = 0; i < 3; ++i)
+        if(!m_points[i].empty())
+            return false;
+    for(int i = 0; i < 8; ++i)
+        if(m_child[i] != NULL)
+            return false;
+    return true;
+}
+
+template<class T>
+void TOctreeNode<T>::removeChild(unsigned int index)
+{
+    if(m_child[index] != NULL)
+        m_child[index]->setParent(NULL);
+    m_child[index] = NULL;
+}
+
+template<class T>
+void TOctreeNode<T>::setChild(unsigned int index, TOctreeNode<T> *child)
+{
+    m_child[index] = child;
+    child->setParent(this);
+    child->setNchild(index);
+}
+
 
 template<class T>
 void TOctreeNode<T>::clearSet(unsigned int index)
 {
     if(getDepth() == 0)
     {
-        m_points[index].clear();
+        m_points[index].clear(*m_allocator);
     }
     else
     {
@@ -0,0 +1,64 @@
+#ifndef PING_PLAYER_H
+#define PING_PLAYER_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#include "PointCloud.h"
+#include "PointBuffer.h"
+
+using namespace std;
+
+// Playback of a sequence of pings, one file each. A ring of GPU buffers holds
+// the ping on screen and the next ones: a decoder thread loads and thresholds
+// the pings of the window ahead into their slot, and the main thread sends a
+// decoded ping to the buffer of its slot by orphaning the previous storage,
+// so that it never waits for the GPU to be done with the ping drawn there
+// before. A ping that is not decoded in time holds the playback instead of
+// being skipped.
+class PingPlayer {
+public:
+    enum SlotState { EMPTY, REQUESTED, DECODING, DECODED, READY };
+    struct Slot {
+        int ping;
+        int state;
+        shared_ptr<PointCloud> cloud;
+        PointBuffer buffer;
+        float threshold, low; // threshold of the colormap on the GPU
+    };
+    static const int RING = 8; // ping on screen and the next ones
+    vector<string> files;
+    float rate;       // native ping rate, in pings per second
+    float speed;
+    bool playing;
+    double position;  // in pings
+    int displayed;    // ping on screen, -1 until the first one is ready
+    unsigned int stalls;
+
+    PingPlayer();
+    ~PingPlayer();
+    void open(const vector<string>& files, int first, float threshold);
+    void close();
+    bool isOpen() const;
+    void seek(int ping);
+    void update(double elapsed, float threshold);
+    const Slot* getDisplayed() const;
+private:
+    Slot slots[RING];
+    float threshold;
+    thread decoder;
+    mutex lock;
+    condition_variable wakeup;
+    bool stopping;
+    void decode();
+    void stopDecoder();
+    bool isReady(int ping);
+    void upload(Slot& slot);
+    void updateColormap(Slot& slot);
+};
+
+#endif
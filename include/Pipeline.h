@@ -0,0 +1,52 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Processing of scans without a window or a GL context, for batch machines.
+// A pipeline is a list of stages run in order over every scan:
+//   threshold  load the scan and keep the points over the amplitude threshold
+//   noise      clear the sonar noise
+//   crop       keep the points in a box
+//   segment    clear the scattering points
+//   bilateral  bilateral filter
+//   export     write the points to the output directory
+// The command line takes files and directories (every file in them):
+//   SonarProc [options] <file or dir>...
+// with the options --stages <stage,stage,...>, --threshold <amplitude
+// threshold>, --crop <x0 y0 z0 x1 y1 z1>, --radius <neighbor radius, % of the
+// bounding box>, --isolate <isolate points threshold, % of the points>,
+// --bilateral <filter radius, 0 for the viewer default>, --format <bin|obj>,
+// --out <dir>, --jobs <scans at a time>, --threads <n per scan> and
+// --trace <file>. The parameters mean the same as the sliders of the viewer.
+struct PipelineOptions {
+    vector<string> stages;
+    float threshold;
+    float cropLower[3], cropUpper[3];
+    bool hasCrop;
+    float radius, isolate;
+    float bilateral;
+    string format;
+    string outDir;
+    int jobs;
+    int threads;
+    string trace;
+    PipelineOptions();
+};
+
+// duration of every stage run on a scan, in milliseconds
+struct ScanReport {
+    string path;
+    int inputPoints, outputPoints;
+    vector<double> stageTimes;
+    bool failed;
+};
+
+int runPipeline(int argc, char** argv);
+bool processScan(const string& path, const PipelineOptions& options, ScanReport& report);
+int processBatch(const vector<string>& files, const PipelineOptions& options);
+
+#endif
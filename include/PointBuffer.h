@@ -0,0 +1,40 @@
+#ifndef POINT_BUFFER_H
+#define POINT_BUFFER_H
+
+#include <vector>
+
+#include <glad/glad.h>
+
+#include "LodHierarchy.h"
+
+using namespace std;
+
+class Shader;
+
+// Persistent GPU copy of the render arrays of a point cloud: 8 bytes per
+// point, 16 bits positions quantized in the cube of their level of detail node
+// and a 16 bits amplitude, colored in the shader through a 1D colormap
+// texture. The storage only grows, and an update sends the spans the point
+// store marked dirty since the previous one, so that frames where nothing
+// changed upload nothing.
+class PointBuffer {
+public:
+    GLuint vao, vbo, colormap;
+    unsigned int capacity;
+    unsigned int version;
+    size_t uploadedBytes;
+
+    PointBuffer();
+    void create();
+    void destroy();
+    void update(const GLushort* vertices, unsigned int num, unsigned int version, vector<RenderSpan>& dirty);
+    void replace(const GLushort* vertices, unsigned int num);
+    void updateColormap(const GLfloat* rgb);
+    void bind() const;
+    void draw(Shader& shader, const LodHierarchy& lod, const vector<int>& nodes, const ConvexRegion& region) const;
+private:
+    void allocate(unsigned int num);
+    void upload(const GLushort* vertices, unsigned int first, unsigned int count);
+};
+
+#endif
@@ -7,28 +7,44 @@
 #include <iostream>
 #include <queue>
 
-#include <glad/glad.h>
 #include <glm/glm.hpp>
-#include <ANN/ANN.h>
 
 
+#include "GLTypes.h"
 #include "BilateralFilter.h"
 #include "types.h"
 #include "Octree.h"
 #include "Sample.h"
+#include "FloatSample.h"
 #include "utilities.h"
+#include "NeighborhoodCache.h"
+#include "ConvexRegion.h"
+#include "LodHierarchy.h"
+#include "ScreenSelection.h"
+#include "Profiler.h"
 #include <deque>
 #include <ctime>
 #include <unordered_map>
 #include <string>
 #include <iomanip>
+#include <functional>
+#ifdef _WIN32
+#include <direct.h>
+#endif
+#include <sys/stat.h>
 
 using namespace std;
 
-double loadAndSortPoints(GLfloat* points, GLfloat* color, float* amp, int num, Octree& octree, double min_radius);
-string getPointStr(float x, float y, float z);
+template<class S>
+double loadAndSortPoints(GLfloat* points, GLfloat* color, float* amp, int num, TOctree<S>& octree, double min_radius);
+template<class S>
+void loadProperties(GLfloat* color, float* amp, int num, TOctree<S>& octree);
+void renumberSamples(OctreeNode* node, const vector<int>& remap);
+void quantizeSpan(const LodHierarchy& lod, const RenderSpan& span, const GLfloat* points, unsigned int stride, const float* amp, unsigned int ampStride, float ampMax, GLushort* vertices);
 class PointCloud {
 public:
+    static const size_t MAX_NEIGHBOR_EDGES = 1 << 26; // 512 MB of neighborhoods
+    static const uint64_t MAX_SNAPSHOT_BYTES = 2ull << 30;
     GLfloat* rPoints;
     GLfloat* vPoints;
     GLfloat* pColor;
@@ -38,16 +54,58 @@ public:
     int prNum, pvNum;
     float boundingBoxSize;
     glm::vec3 centerPoint;
-    unordered_map<string, float> ampMap;
+    unsigned int version;
+    NeighborhoodCache neighborhoods;
+    string snapshotDir;
+    bool singlePrecision;
+    Octree* spatialIndex;
+    unsigned int spatialVersion;
+    LodHierarchy lod;
+    float ampMin, ampMax;
+    float ampCurve[256];
+    bool colormapDirty;
+    vector<float> sortedAmp;
+    unsigned int resetVersion;
+    LodHierarchy rawLod;
+    vector<GLushort> rawVertices;
+    vector<RenderSpan> rawDirty;
+    vector<GLushort> renderVertices;
+    vector<RenderSpan> renderDirty;
+    function<bool(float)> progress;
     PointCloud();
+    PointCloud(const PointCloud& other);
     void init(GLfloat* raw, int num, double threshold);
     void reset(double threshold);
     void clearSonarNoise();
     void useBilateralFilter(double radius = 0.1, double normal_radius = 0.1);
-    void saveContent(OctreeNode* node, Octree& octree, unsigned int index, bool isoriented);
+    template<class S>
+    void filterPoints(double radius, double normal_radius);
+    template<class S>
+    void saveContent(TOctreeNode<S>* node, unsigned int index, vector<unsigned int>& indices);
     void transform();
     void segment(float radius, int thresh = 100);
     void updateProperties();
+    template<class S>
+    const NeighborhoodCache* getNeighborhoods(float radius, TOctree<S>& octree);
+    template<class S>
+    double estimateNeighborEdges(TOctree<S>& octree, float radius) const;
+    uint64_t contentKey(double radius, size_t sampleSize) const;
+    string getSnapshotPath(uint64_t key) const;
+    void pruneSnapshots(const string& keep) const;
+    Octree& getSpatialIndex();
+    int crop(const ConvexRegion& region);
+    int removeSelected(const ScreenSelection& selection);
+    const LodHierarchy& getLod();
+    const LodHierarchy& getRawLod();
+    bool isPristine() const;
+    void updateRenderSpan(const RenderSpan& span);
+    void updateAmplitudeCurve(double threshold);
+    void getThresholdCurve(double threshold, float& low, float* curve) const;
+    void getColormap(const float* curve, GLfloat* rgb) const;
+    int pick(const glm::vec3& origin, const glm::vec3& direction, float tanRadius);
+    bool reportProgress(float done) const;
+    void prepareRender();
+    bool getRenderedPoint(unsigned int slot, glm::vec3& position, float& amp, int& region) const;
     ~PointCloud();
 };
 
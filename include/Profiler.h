@@ -0,0 +1,71 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+#define PROFILE_CONCAT(a, b) a##b
+#define PROFILE_NAME(line) PROFILE_CONCAT(profileScope, line)
+// times the rest of the enclosing block
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_NAME(__LINE__)(name)
+
+// Timings of the pipeline stages, from any thread. Every stage keeps a
+// rolling history of its durations for the profiler panel, and the last
+// events are kept as a timeline that exports to the Chrome trace event
+// format (chrome://tracing, Perfetto). Times are in microseconds since the
+// first use of the profiler.
+class Profiler {
+public:
+    struct Event {
+        const char* name;
+        unsigned int thread;
+        double start, duration;
+    };
+    struct Stat {
+        string name;
+        vector<float> history; // milliseconds, a ring starting at offset
+        int offset;
+        float p50, p95, p99;
+    };
+    static const int HISTORY = 256;
+    static const size_t MAX_EVENTS = 200000;
+    static const unsigned int GPU_THREAD = 1000;
+    bool enabled;
+
+    static Profiler& get();
+    static double now();
+    void record(const char* name, double start, double duration);
+    void record(const char* name, double start, double duration, unsigned int thread);
+    void getStats(vector<Stat>& stats) const;
+    bool exportTrace(const string& path) const;
+    void clear();
+private:
+    struct History {
+        vector<float> values;
+        int next;
+        History() : next(0) {}
+    };
+    mutable mutex lock;
+    deque<Event> events;
+    map<string, History> histories;
+    map<thread::id, unsigned int> threads;
+    Profiler();
+    void add(const Event& e);
+};
+
+class ProfileScope {
+public:
+    ProfileScope(const char* name);
+    ~ProfileScope();
+private:
+    const char* name;
+    double start;
+};
+
+#endif
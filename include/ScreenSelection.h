@@ -0,0 +1,31 @@
+#ifndef SCREEN_SELECTION_H
+#define SCREEN_SELECTION_H
+
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+
+// Selection of points by their projection on the screen, one bit per point.
+// The combined model view projection matrix is applied to the positions in
+// parallel chunks of 32 points, 4 points at a time with SSE2, and the shapes
+// are tested in normalized device coordinates. Rectangles and lassos replace,
+// add to or remove from the selection, and the selected points are removed
+// from the cloud by a single compaction.
+class ScreenSelection {
+public:
+    enum Mode { REPLACE, ADD, SUBTRACT };
+    unsigned int version;
+    int num;
+    vector<uint32_t> bits;
+
+    ScreenSelection();
+    bool isValid(unsigned int version, int num) const;
+    void clear(unsigned int version, int num);
+    void selectRectangle(const float* mvp, const float* points, float minx, float miny, float maxx, float maxy, Mode mode);
+    void selectPolygon(const float* mvp, const float* points, const float* polygon, int count, Mode mode);
+    bool isSelected(int i) const;
+    int count() const;
+};
+
+#endif
@@ -27,6 +27,7 @@
 #include "Point.h"
 
 class Sample;
+class FloatSample;
 
 
 typedef std::deque<Sample> Sample_deque;
@@ -40,16 +41,22 @@ typedef std::list<Sample*> Sample_star_list;
 
 #include "Octree.h"
 typedef TOctree<Sample> Octree;
+typedef TOctree<FloatSample> FloatOctree;
 
 #include "OctreeNode.h"
 typedef TOctreeNode<Sample> OctreeNode;
+typedef TOctreeNode<FloatSample> FloatOctreeNode;
 
 #include "OctreeIterator.h"
 typedef TOctreeIterator<Sample> OctreeIterator;
+typedef TOctreeIterator<FloatSample> FloatOctreeIterator;
+typedef TNeighborBuffer<Sample> NeighborBuffer;
+typedef TNeighborGraph<Sample> NeighborGraph;
 
 
 #include "BilateralFilter.h"
 typedef TBilateralFilter<Sample> BilateralFilter;
+typedef TBilateralFilter<FloatSample> FloatBilateralFilter;
 
 
 #endif
\ No newline at end of file
@@ -21,6 +21,14 @@
 #include<cstdlib>
 #include<set>
 #include<cmath>
+#include<vector>
+#include<algorithm>
+#include<stdint.h>
+#include<cstring>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "Point.h"
 #include "ColorGradient.h"
@@ -63,11 +71,14 @@ inline static int pow2(int n)
 }
 
 /** @brief compute the square distance between two points
+ * (any types with x(), y(), z() accessors, so that compact samples are
+ * not converted to Point)
  * @param p1 first point
  * @param p2 second point
  * @return square distance
  */
-inline static double dist2(const Point &p1, const Point &p2)
+template<class P1, class P2>
+inline static double dist2(const P1 &p1, const P2 &p2)
 {
     return ((p1.x() - p2.x()) * (p1.x() - p2.x())
     +(p1.y() - p2.y()) * (p1.y() - p2.y())
@@ -119,19 +130,232 @@ inline static void normalize(double &vx, double &vy, double &vz)
     vz = vz*t;
 }
 
-inline float* equalizeHist(float* amp, int num, float amp_min, float amp_max) {
-    int hist[256] = { 0 }, new_hist[256] = { 0 };
+/** @brief spread the lower 21 bits of a value so that two zero bits
+ * separate consecutive bits (helper for the Morton codes)
+ * @param v value to spread
+ * @return spread value
+ */
+inline static uint64_t spreadBits3(uint64_t v)
+{
+    v &= 0x1fffff;
+    v = (v | (v << 32)) & 0x1f00000000ffffULL;
+    v = (v | (v << 16)) & 0x1f0000ff0000ffULL;
+    v = (v | (v << 8))  & 0x100f00f00f00f00fULL;
+    v = (v | (v << 4))  & 0x10c30c30c30c30c3ULL;
+    v = (v | (v << 2))  & 0x1249249249249249ULL;
+    return v;
+}
+
+/** @brief inverse of spreadBits3
+ * @param v spread value
+ * @return compacted value
+ */
+inline static unsigned int compactBits3(uint64_t v)
+{
+    v &= 0x1249249249249249ULL;
+    v = (v | (v >> 2))  & 0x10c30c30c30c30c3ULL;
+    v = (v | (v >> 4))  & 0x100f00f00f00f00fULL;
+    v = (v | (v >> 8))  & 0x1f0000ff0000ffULL;
+    v = (v | (v >> 16)) & 0x1f00000000ffffULL;
+    v = (v | (v >> 32)) & 0x1fffff;
+    return (unsigned int)v;
+}
+
+/** @brief interleave three locational codes into a Morton code
+ * the x bit is the most significant of each triplet so that the three
+ * bits of level l are exactly the octree child index at that level
+ * @param codx x locational code (at most 21 bits)
+ * @param cody y locational code (at most 21 bits)
+ * @param codz z locational code (at most 21 bits)
+ * @return Morton code
+ */
+inline static uint64_t mortonEncode(unsigned int codx, unsigned int cody,
+                                    unsigned int codz)
+{
+    return (spreadBits3(codx) << 2) | (spreadBits3(cody) << 1)
+           | spreadBits3(codz);
+}
+
+/** @brief split a Morton code into the three locational codes
+ * @param code Morton code
+ * @param[out] codx x locational code
+ * @param[out] cody y locational code
+ * @param[out] codz z locational code
+ */
+inline static void mortonDecode(uint64_t code, unsigned int &codx,
+                                unsigned int &cody, unsigned int &codz)
+{
+    codx = compactBits3(code >> 2);
+    cody = compactBits3(code >> 1);
+    codz = compactBits3(code);
+}
+
+/** @brief stable parallel LSD radix sort of (key, value) pairs
+ * keys are processed 8 bits at a time, each thread counts and scatters
+ * its own contiguous chunk so that the sort remains stable
+ * @param keys keys to sort
+ * @param values values permuted along with the keys
+ * @param nbits number of significant bits of the keys
+ */
+inline void parallelRadixSort(std::vector<uint64_t> &keys,
+                              std::vector<unsigned int> &values,
+                              unsigned int nbits)
+{
+    const int n = (int)keys.size();
+    int nthreads = 1;
+#ifdef _OPENMP
+    nthreads = omp_get_max_threads();
+#endif
+    const int chunk = (n + nthreads - 1) / nthreads;
+
+    std::vector<uint64_t> tkeys(n);
+    std::vector<unsigned int> tvalues(n);
+    std::vector<int> count(256 * nthreads);
+
+    for(unsigned int shift = 0; shift < nbits; shift += 8)
+    {
+        std::fill(count.begin(), count.end(), 0);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static, 1)
+#endif
+        for(int t = 0; t < nthreads; ++t)
+        {
+            int *c = &count[256 * t];
+            int last = std::min(n, (t + 1) * chunk);
+            for(int i = t * chunk; i < last; ++i)
+                c[(keys[i] >> shift) & 0xff]++;
+        }
+
+        //exclusive prefix sum, bucket major then thread major
+        int sum = 0;
+        bool trivial = false;
+        for(int b = 0; b < 256; ++b)
+        {
+            int bucket_start = sum;
+            for(int t = 0; t < nthreads; ++t)
+            {
+                int c = count[256 * t + b];
+                count[256 * t + b] = sum;
+                sum += c;
+            }
+            if(sum - bucket_start == n)
+                trivial = true;
+        }
+
+        //every key shares this digit: nothing to move
+        if(trivial)
+            continue;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static, 1)
+#endif
+        for(int t = 0; t < nthreads; ++t)
+        {
+            int *c = &count[256 * t];
+            int last = std::min(n, (t + 1) * chunk);
+            for(int i = t * chunk; i < last; ++i)
+            {
+                int pos = c[(keys[i] >> shift) & 0xff]++;
+                tkeys[pos] = keys[i];
+                tvalues[pos] = values[i];
+            }
+        }
+        keys.swap(tkeys);
+        values.swap(tvalues);
+    }
+}
+
+/** @brief find the starting positions of the runs of equal codes
+ * in a sorted array, two codes being equal if they match after
+ * discarding their lower bits
+ * @param codes sorted codes
+ * @param shift number of low bits to discard
+ * @param[out] starts run starting positions (followed by codes.size())
+ */
+inline void getRunStarts(const std::vector<uint64_t> &codes,
+                         unsigned int shift, std::vector<unsigned int> &starts)
+{
+    const int n = (int)codes.size();
+    int nthreads = 1;
+#ifdef _OPENMP
+    nthreads = omp_get_max_threads();
+#endif
+    const int chunk = (n + nthreads - 1) / nthreads;
+    std::vector<int> count(nthreads + 1, 0);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static, 1)
+#endif
+    for(int t = 0; t < nthreads; ++t)
+    {
+        int last = std::min(n, (t + 1) * chunk);
+        for(int i = t * chunk; i < last; ++i)
+            if(i == 0 || (codes[i] >> shift) != (codes[i - 1] >> shift))
+                count[t + 1]++;
+    }
+    for(int t = 0; t < nthreads; ++t)
+        count[t + 1] += count[t];
+
+    starts.resize(count[nthreads] + 1);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static, 1)
+#endif
+    for(int t = 0; t < nthreads; ++t)
+    {
+        int pos = count[t];
+        int last = std::min(n, (t + 1) * chunk);
+        for(int i = t * chunk; i < last; ++i)
+            if(i == 0 || (codes[i] >> shift) != (codes[i - 1] >> shift))
+                starts[pos++] = (unsigned int)i;
+    }
+    starts.back() = (unsigned int)n;
+}
+
+/** @brief 64 bits FNV-1a hash of a memory block
+ * @param data block to hash
+ * @param bytes size of the block
+ * @param seed hash to continue from (to chain several blocks)
+ * @return hash value
+ */
+inline uint64_t hashBytes(const void *data, size_t bytes,
+                          uint64_t seed = 14695981039346656037ULL)
+{
+    const unsigned char *p = static_cast<const unsigned char*>(data);
+    uint64_t h = seed;
+    for(size_t i = 0; i < bytes; ++i)
+    {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// bin of an amplitude among 256 between amp_min and amp_max (all in the first
+// one when the range is empty)
+inline int amplitudeBin(float amp, float amp_min, float amp_max) {
+    return amp_max > amp_min ? int(255.0f * (amp - amp_min) / (amp_max - amp_min)) : 0;
+}
+
+// equalized level of each of the 256 amplitude bins between amp_min and amp_max
+inline void equalizationCurve(const float* amp, int num, float amp_min, float amp_max, float* curve) {
+    int hist[256] = { 0 };
     for (int i = 0; i < num; i++) {
-        hist[int(255.0f * (amp[i] - amp_min) / (amp_max - amp_min))]++;
+        hist[amplitudeBin(amp[i], amp_min, amp_max)]++;
     }
     int curr = 0;
     for (int i = 0; i < 256; i++) {
         curr += hist[i];
-        new_hist[i] = round(curr * 255.0f / num);
+        curve[i] = round(curr * 255.0f / num) / 255.0f;
     }
+}
+
+inline float* equalizeHist(float* amp, int num, float amp_min, float amp_max) {
+    float curve[256];
+    equalizationCurve(amp, num, amp_min, amp_max, curve);
     float* histAmp = new float[num];
     for (int i = 0; i < num; i++) {
-        histAmp[i] = new_hist[int(255.0f * (amp[i] - amp_min) / (amp_max - amp_min))] / 255.0f;
+        histAmp[i] = curve[amplitudeBin(amp[i], amp_min, amp_max)];
     }
     return histAmp;
 }
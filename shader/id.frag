@@ -0,0 +1,9 @@
+#version 330 core
+flat in uint pointId;
+out uint id;
+
+void main()
+{
+    // render slot + 1, 0 is the background
+    id = pointId + 1u;
+}
@@ -0,0 +1,33 @@
+#version 330 core
+layout (location = 0) in vec3 position;
+layout (location = 1) in float amplitude;
+
+uniform mat4 model;
+uniform mat4 view;
+uniform mat4 projection;
+uniform vec3 tileOrigin;
+uniform float tileSize;
+uniform sampler1D colormap;
+uniform float ampThreshold;
+uniform float ampLow;
+uniform float ampHigh;
+
+out vec3 ourColor;
+flat out uint pointId;
+
+void main()
+{
+    // render slot of the point, for the picking pass
+    pointId = uint(gl_VertexID);
+    // points under the amplitude threshold are moved out of the clip volume
+    if (amplitude < ampThreshold) {
+        gl_Position = vec4(2.0f, 2.0f, 2.0f, 1.0f);
+        ourColor = vec3(0.0f);
+        return;
+    }
+    // positions are quantized in the cube of their level of detail node
+    gl_Position = projection * view * model * vec4(tileOrigin + position * tileSize, 1.0f);
+    // texel of the amplitude bin between the lowest kept and the largest amplitude
+    float level = ampHigh > ampLow ? clamp((amplitude - ampLow) / (ampHigh - ampLow), 0.0f, 1.0f) : 0.0f;
+    ourColor = texture(colormap, level * 255.0f / 256.0f).rgb;
+}
@@ -11,6 +11,13 @@
 #include "Shader.h"
 #include "ArcballCamera.h"
 #include "pointCloud.h"
+#include "PointBuffer.h"
+#include "IdPicker.h"
+#include "JobSystem.h"
+#include "PingPlayer.h"
+#include "Profiler.h"
+#include "GpuTimer.h"
+#include "Headless.h"
 #include "FileIO.h"
 #include "utilities.h"
 
@@ -30,6 +37,15 @@ GLuint screenWidth = 1280, screenHeight = 720;
 const char* glsl_version = "#version 130";
 float pRadius = 6.0f, pThreshold = 2.5f, bRadius = 1.0f, ampThreshold = 0.1f, curAmp = 0.0f;
 glm::vec3 worldCoord(0.0f, 0.0f, 0.0f);
+int curRegion = -1;
+const float pickRadius = 4.0f; // in pixels
+glm::vec2 hoverPixel(-1.f); // cursor in window coordinates
+int pointBudget = 5000000;
+const float lodMinPixels = 16.0f; // projected radius under which a node adds no detail
+vector<int> lodNodes;
+unsigned int drawnPoints = 0;
+float previewThreshold = -1.0f, previewLow = 0.0f; // threshold of the raw colormap on the GPU
+bool thresholdActive = false;
 GLfloat rectangle[] = {
     0.0f, 0.0f, 0.0f, 1.0f, 1.0f, 0.0f, 
     0.0f, 0.0f, 0.0f, 1.0f, 1.0f, 0.0f,
@@ -43,10 +59,21 @@ glm::mat4 projection = glm::perspective(70.0f, 4.0f / 3.0f, 0.1f, 1000.0f);
 int mouseEvent = 0;
 glm::vec2 prevMouse(-2.f), curMouse(-2.f);
 
-PointCloud* pointCloud = NULL;
+shared_ptr<PointCloud> pointCloud;
+JobSystem jobs;
+PingPlayer player;
+bool recenterPlayback = false;
 string openFilePath, saveFilePath;
-bool toRebind = true;
+// cloud processing waiting for the jobs running, in order
+deque<pair<string, function<void(PointCloud&)> > > pendingCloudJobs;
+string jobNotice; // shown while the jobs run
+bool rectangleChanged = true;
 bool isEditMode = false;
+bool isLassoMode = false;
+vector<GLfloat> lasso; // lasso vertices, in the rectangle vertex format
+bool lassoChanged = false;
+ScreenSelection selection;
+int selectedCount = 0;
 
 // Function prototypes
 void setupImGuiContext(GLFWwindow* window);
@@ -56,13 +83,20 @@ void frameBufferSizeCallback(GLFWwindow* window, int width, int height);
 void scrollCallback(GLFWwindow* window, double x, double y);
 void mouseButtonCallback(GLFWwindow* window, int button, int action, int mods);
 void cursorCallback(GLFWwindow* window, double x, double y);
-void clip(GLfloat x1, GLfloat y1, GLfloat x2, GLfloat y2);
+void applySelection(int mods);
+void clip();
+void submitCloudJob(const string& name, function<void(PointCloud&)> process, bool reset = false);
+void startPendingCloudJob();
 glm::vec2 transformMouse(glm::vec2 in);
-glm::vec3 screenCoords2WorldCoords(GLFWwindow* window, double x, double y);
 
 // The MAIN function, from here we start our application and run our Game loop
-int main()
+int main(int argc, char** argv)
 {
+    // offscreen rendering of scans, without the viewer
+    if (argc > 1) {
+        return runHeadless(argc, argv);
+    }
+
     // Init GLFW
     glfwInit();
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
@@ -95,73 +129,230 @@ int main()
     // Setup Dear ImGui context
     setupImGuiContext(window);
 
+    // processing runs in the background, the stages use OpenMP inside
+    jobs.start(2);
+
     // Setup and compile our shaders
     Shader shader("shader/shader.vs", "shader/shader.frag");
+    Shader pointShader("shader/points.vs", "shader/shader.frag");
+    Shader pointIdShader("shader/points.vs", "shader/id.frag");
     
-    GLuint VBOs[2], VAOs[2];
-    glGenVertexArrays(2, VAOs);
-    glGenBuffers(2, VBOs);
+    // the points stay on the GPU, only what changes is sent again
+    PointBuffer pointBuffer;
+    pointBuffer.create();
+    // the raw cloud, uploaded once, thresholded in the shader
+    PointBuffer rawBuffer;
+    rawBuffer.create();
+    // render slots of the points around the cursor, read back a frame later
+    int framebufferWidth, framebufferHeight;
+    glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
+    IdPicker idPicker;
+    idPicker.create(framebufferWidth, framebufferHeight, (int)pickRadius);
+    // GPU time of the draw passes, for the profiler
+    GpuTimer pickingTimer, pointsTimer, uiTimer;
+    pickingTimer.create("GPU picking pass");
+    pointsTimer.create("GPU points pass");
+    uiTimer.create("GPU ui pass");
+
+    GLuint rectangleVBO, rectangleVAO;
+    glGenVertexArrays(1, &rectangleVAO);
+    glGenBuffers(1, &rectangleVBO);
+    // Rectangle setup (Edit mode)
+    glBindVertexArray(rectangleVAO);
+    glBindBuffer(GL_ARRAY_BUFFER, rectangleVBO);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(rectangle), rectangle, GL_DYNAMIC_DRAW);
+    // Position attribute
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), (GLvoid*)0);
+    glEnableVertexAttribArray(0);
+    // Color attribute
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), (GLvoid*)(3 * sizeof(GLfloat)));
+    glEnableVertexAttribArray(1);
+    glBindVertexArray(0);
+    // Lasso setup (Edit mode), same vertex format
+    GLuint lassoVBO, lassoVAO;
+    glGenVertexArrays(1, &lassoVAO);
+    glGenBuffers(1, &lassoVBO);
+    glBindVertexArray(lassoVAO);
+    glBindBuffer(GL_ARRAY_BUFFER, lassoVBO);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), (GLvoid*)0);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), (GLvoid*)(3 * sizeof(GLfloat)));
+    glEnableVertexAttribArray(1);
+    glBindVertexArray(0);
 
     // Imgui state
     static imgui_addons::ImGuiFileBrowser file_dialog;
     static bool showOpenFileDialog = false;
     static bool showSaveFileDialog = false;
+    static bool showPlayDialog = false;
+    double lastFrame = glfwGetTime();
     // Game loop
     while (!glfwWindowShouldClose(window))
     {
+        PROFILE_SCOPE("frame");
+        double currentFrame = glfwGetTime();
+        double frameTime = currentFrame - lastFrame;
+        lastFrame = currentFrame;
         // Check and call events
         glfwPollEvents();
+        // results of the finished jobs are swapped in between frames
+        jobs.poll();
+        startPendingCloudJob();
+        pickingTimer.poll();
+        pointsTimer.poll();
+        uiTimer.poll();
 
         // Clear the colorbuffer
         glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-        // Draw our first triangle
-        shader.bind();
-
-        // Create camera transformation
-        shader.setUniform("model", model);
-        shader.setUniform("view", arcballCamera.transform());
-        shader.setUniform("projection", projection);
-        if (pointCloud != NULL) {
-            if (toRebind) {
-                // Point cloud vertices setup
-                // Bind our Vertex Array Object first, then bind and set our buffers and pointers.
-                glBindVertexArray(VAOs[0]);
-                glBindBuffer(GL_ARRAY_BUFFER, VBOs[0]);
-                glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 6 * pointCloud->pvNum, 0, GL_STATIC_DRAW);
-                glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(GLfloat) * 3 * pointCloud->pvNum, pointCloud->vPoints);
-                glBufferSubData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 3 * pointCloud->pvNum, sizeof(GLfloat) * 3 * pointCloud->pvNum, pointCloud->pColor);
-                // Position attribute
-                glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(GLfloat), (GLvoid*)0);
-                glEnableVertexAttribArray(0);
-                // Color attribute
-                glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(GLfloat), (GLvoid*)(sizeof(GLfloat) * 3 * pointCloud->pvNum));
-                glEnableVertexAttribArray(1);
-                glBindVertexArray(0); // Unbind VAO
-                toRebind = true;
-                bRadius = pointCloud->boundingBoxSize * sqrt(20.0f / pointCloud->pvNum);
+        if (player.isOpen()) {
+            // playback: the raw points of the ping on screen, thresholded in
+            // the shader like the preview of an opened file
+            player.update(frameTime, ampThreshold);
+            const PingPlayer::Slot* ping = player.getDisplayed();
+            if (ping != NULL && ping->cloud->prNum > 0) {
+                const PointCloud& cloud = *ping->cloud;
+                if (recenterPlayback) {
+                    recenterPlayback = false;
+                    arcballCamera.setParams(cloud.centerPoint + glm::vec3(100.0f, 0.0f, 0.0f), cloud.centerPoint, glm::vec3(0., 1., 0.));
+                }
+                glm::mat4 modelView = arcballCamera.transform() * model;
+                glm::mat4 mvp = projection * modelView;
+                ConvexRegion frustum = ConvexRegion::frustum(glm::value_ptr(mvp), -1.0, -1.0, 1.0, 1.0);
+                glm::vec3 eye = glm::vec3(glm::inverse(modelView)[3]);
+                float pixelFactor = 0.5f * screenHeight * projection[1][1];
+                drawnPoints = cloud.rawLod.select(frustum, glm::value_ptr(eye), pixelFactor, lodMinPixels, pointBudget, lodNodes);
+                float lowStep = floor(ping->low / cloud.ampMax * 65535.0f + 0.5f);
+                PROFILE_SCOPE("points pass");
+                pointsTimer.begin();
+                glPointSize(4.0f);
+                ping->buffer.bind();
+                pointShader.bind();
+                pointShader.setUniform("model", model);
+                pointShader.setUniform("view", arcballCamera.transform());
+                pointShader.setUniform("projection", projection);
+                pointShader.setUniform("colormap", 0);
+                pointShader.setUniform("ampThreshold", (lowStep - 0.5f) / 65535.0f);
+                pointShader.setUniform("ampLow", ping->low / cloud.ampMax);
+                pointShader.setUniform("ampHigh", 1.0f);
+                ping->buffer.draw(pointShader, cloud.rawLod, lodNodes, frustum);
+                pointsTimer.end();
+            }
+        }
+        else if (pointCloud != NULL) {
+            // until the cloud is edited, the raw points are drawn and the
+            // amplitude threshold only changes uniforms and the colormap
+            bool preview = pointCloud->isPristine();
+            const LodHierarchy& lod = preview ? pointCloud->getRawLod() : pointCloud->getLod();
+            PointBuffer& buffer = preview ? rawBuffer : pointBuffer;
+            float ampLow, ampThresholdUniform;
+            if (preview) {
+                rawBuffer.update(pointCloud->rawVertices.data(), (unsigned int)pointCloud->rawVertices.size() / 4, 0, pointCloud->rawDirty);
+                if (previewThreshold != ampThreshold) {
+                    GLfloat rgb[256 * 3];
+                    float curve[256];
+                    pointCloud->getThresholdCurve(ampThreshold, previewLow, curve);
+                    pointCloud->getColormap(curve, rgb);
+                    rawBuffer.updateColormap(rgb);
+                    previewThreshold = ampThreshold;
+                }
+                ampLow = previewLow;
+                // half a step under the quantized lowest kept amplitude
+                float lowStep = floor(previewLow / pointCloud->ampMax * 65535.0f + 0.5f);
+                ampThresholdUniform = (lowStep - 0.5f) / 65535.0f;
+            }
+            else {
+                // Point cloud vertices, in level of detail order: the spans
+                // changed since the last frame only
+                pointBuffer.update(pointCloud->renderVertices.data(), (unsigned int)pointCloud->renderVertices.size() / 4, pointCloud->version, pointCloud->renderDirty);
+                if (pointCloud->colormapDirty) {
+                    GLfloat rgb[256 * 3];
+                    pointCloud->getColormap(pointCloud->ampCurve, rgb);
+                    pointBuffer.updateColormap(rgb);
+                    pointCloud->colormapDirty = false;
+                }
+                ampLow = pointCloud->ampMin;
+                ampThresholdUniform = 0.0f;
             }
+            // nodes in view, largest on screen first, up to the point budget
+            glm::mat4 modelView = arcballCamera.transform() * model;
+            glm::mat4 mvp = projection * modelView;
+            ConvexRegion frustum = ConvexRegion::frustum(glm::value_ptr(mvp), -1.0, -1.0, 1.0, 1.0);
+            glm::vec3 eye = glm::vec3(glm::inverse(modelView)[3]);
+            float pixelFactor = 0.5f * screenHeight * projection[1][1];
+            drawnPoints = lod.select(frustum, glm::value_ptr(eye), pixelFactor, lodMinPixels, pointBudget, lodNodes);
             glPointSize(4.0f);
-            glBindVertexArray(VAOs[0]);
-            glDrawArrays(GL_POINTS, 0, pointCloud->pvNum);
+            buffer.bind();
+            auto drawNodes = [&](Shader& s, const ConvexRegion& region) {
+                s.bind();
+                s.setUniform("model", model);
+                s.setUniform("view", arcballCamera.transform());
+                s.setUniform("projection", projection);
+                s.setUniform("colormap", 0);
+                s.setUniform("ampThreshold", ampThresholdUniform);
+                s.setUniform("ampLow", ampLow / pointCloud->ampMax);
+                s.setUniform("ampHigh", 1.0f);
+                buffer.draw(s, lod, lodNodes, region);
+            };
+            // picking pass: render slots in the window around the cursor,
+            // only the nodes seen through it are drawn
+            int windowWidth, windowHeight;
+            glfwGetWindowSize(window, &windowWidth, &windowHeight);
+            int px = (int)(hoverPixel.x * framebufferWidth / windowWidth);
+            int py = framebufferHeight - 1 - (int)(hoverPixel.y * framebufferHeight / windowHeight);
+            if (px >= 0 && px < framebufferWidth && py >= 0 && py < framebufferHeight) {
+                PROFILE_SCOPE("picking pass");
+                pickingTimer.begin();
+                float r = pickRadius + 2.0f; // points are drawn 4 pixels wide
+                ConvexRegion pickWindow = ConvexRegion::frustum(glm::value_ptr(mvp),
+                    2.0f * (px - r) / framebufferWidth - 1.0f, 2.0f * (py - r) / framebufferHeight - 1.0f,
+                    2.0f * (px + r + 1) / framebufferWidth - 1.0f, 2.0f * (py + r + 1) / framebufferHeight - 1.0f);
+                idPicker.begin(px, py);
+                drawNodes(pointIdShader, pickWindow);
+                idPicker.end(pointCloud->version);
+                glViewport(0, 0, framebufferWidth, framebufferHeight);
+                pickingTimer.end();
+            }
+            {
+                PROFILE_SCOPE("points pass");
+                pointsTimer.begin();
+                drawNodes(pointShader, frustum);
+                pointsTimer.end();
+            }
+            // hovered point, from a readback the GPU is done with
+            unsigned int slot, tag;
+            if (idPicker.poll(slot, tag) && tag == pointCloud->version) {
+                if (slot == 0 || !pointCloud->getRenderedPoint(slot - 1, worldCoord, curAmp, curRegion)) {
+                    curAmp = 0.0f;
+                    curRegion = -1;
+                }
+            }
         }
 
         if (isEditMode) {
+            shader.bind();
             shader.setUniform("model", model);
             shader.setUniform("view",model);
             shader.setUniform("projection", model);
-            // Rectangle setup (Edit mode)
-            glBindVertexArray(VAOs[1]);
-            glBindBuffer(GL_ARRAY_BUFFER, VBOs[1]);
-            glBufferData(GL_ARRAY_BUFFER, sizeof(rectangle), rectangle, GL_DYNAMIC_DRAW);
-            // Position attribute
-            glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), (GLvoid*)0);
-            glEnableVertexAttribArray(0);
-            // Color attribute
-            glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), (GLvoid*)(3 * sizeof(GLfloat)));
-            glEnableVertexAttribArray(1);
-            glDrawArrays(GL_LINE_LOOP, 0, 4);
+            if (rectangleChanged) {
+                glBindBuffer(GL_ARRAY_BUFFER, rectangleVBO);
+                glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(rectangle), rectangle);
+                rectangleChanged = false;
+            }
+            if (isLassoMode) {
+                if (lassoChanged) {
+                    glBindBuffer(GL_ARRAY_BUFFER, lassoVBO);
+                    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * lasso.size(), lasso.data(), GL_DYNAMIC_DRAW);
+                    lassoChanged = false;
+                }
+                glBindVertexArray(lassoVAO);
+                glDrawArrays(GL_LINE_LOOP, 0, (GLsizei)lasso.size() / 6);
+            }
+            else {
+                glBindVertexArray(rectangleVAO);
+                glDrawArrays(GL_LINE_LOOP, 0, 4);
+            }
         }
         glBindVertexArray(0);
 
@@ -178,6 +369,7 @@ int main()
                 {
                     if (ImGui::MenuItem("Open..", "Ctrl+O", &showOpenFileDialog)) {}
                     if (ImGui::MenuItem("Save", "Ctrl+S", &showSaveFileDialog)) { /* Do stuff */ }
+                    if (ImGui::MenuItem("Play sequence..", NULL, &showPlayDialog)) {}
                     if (ImGui::MenuItem("Close", "Ctrl+W")) { openFilePath = ""; }
                     if (ImGui::MenuItem("Exit", "Alt+F4")) { glfwSetWindowShouldClose(window, GL_TRUE); }
                     ImGui::EndMenu();
@@ -199,17 +391,37 @@ int main()
                 ImGui::OpenPopup("Open File");
             if (showSaveFileDialog)
                 ImGui::OpenPopup("Save File");
+            if (showPlayDialog)
+                ImGui::OpenPopup("Play Sequence");
             if (file_dialog.showFileDialog("Open File", imgui_addons::ImGuiFileBrowser::DialogMode::OPEN, ImVec2(600, 300)))
             {
                 openFilePath = file_dialog.selected_path;    // The absolute path to the selected file
-                int size = FileIO::getFileSize(openFilePath);
-                float* points = FileIO::openBinaryPointsFile(openFilePath, size);
-                if (pointCloud != NULL) {
-                    delete pointCloud;
-                }
-                pointCloud = new PointCloud();
-                pointCloud->init(points, size / 4 / sizeof(float), ampThreshold);
-                arcballCamera.setParams(pointCloud->centerPoint + glm::vec3(100.0f, 0.0f, 0.0f), pointCloud->centerPoint, glm::vec3(0., 1., 0.));
+                // loaded in the background, the current cloud is drawn until then
+                string path = openFilePath;
+                float threshold = ampThreshold;
+                shared_ptr<PointCloud> result = make_shared<PointCloud>();
+                // the processing asked for on the previous cloud is dropped with it
+                pendingCloudJobs.clear();
+                jobs.submit("Open " + path, [result, path, threshold](Job& job) {
+                    int size = FileIO::getFileSize(path);
+                    float* points = FileIO::openBinaryPointsFile(path, size);
+                    result->progress = [&job](float done) { return job.report(done); };
+                    result->init(points, size / 4 / sizeof(float), threshold);
+                    delete[] points;
+                    if (!job.cancelled) {
+                        result->prepareRender();
+                    }
+                    result->progress = nullptr;
+                    job.report(1.0f);
+                }, [result, &idPicker]() {
+                    pointCloud = result;
+                    if (pointCloud->pvNum > 0) {
+                        bRadius = pointCloud->boundingBoxSize * sqrt(20.0f / pointCloud->pvNum);
+                    }
+                    previewThreshold = -1.0f;
+                    idPicker.discard();
+                    arcballCamera.setParams(pointCloud->centerPoint + glm::vec3(100.0f, 0.0f, 0.0f), pointCloud->centerPoint, glm::vec3(0., 1., 0.));
+                });
                 showOpenFileDialog = false;
             }
             if (file_dialog.showFileDialog("Save File", imgui_addons::ImGuiFileBrowser::DialogMode::SAVE, ImVec2(700, 310)))
@@ -218,11 +430,81 @@ int main()
                 FileIO::savePointsAsObj(saveFilePath, pointCloud->vPoints, pointCloud->pRegions, pointCloud->pvNum);
                 showSaveFileDialog = false;
             }
+            if (file_dialog.showFileDialog("Play Sequence", imgui_addons::ImGuiFileBrowser::DialogMode::OPEN, ImVec2(600, 300)))
+            {
+                // every file of the directory is a ping, from the selected one
+                string path = file_dialog.selected_path;
+                size_t separator = path.find_last_of("/\\");
+                string dir = separator == string::npos ? "." : path.substr(0, separator);
+                string name = separator == string::npos ? path : path.substr(separator + 1);
+                vector<string> files;
+                FileIO::listFiles(dir, files);
+                int first = 0;
+                for (size_t i = 0; i < files.size(); i++) {
+                    if (files[i].substr(files[i].find_last_of("/\\") + 1) == name) {
+                        first = (int)i;
+                    }
+                }
+                if (!files.empty()) {
+                    player.open(files, first, ampThreshold);
+                    recenterPlayback = true;
+                }
+                showPlayDialog = false;
+            }
+            if (player.isOpen()) {
+                int last = (int)player.files.size() - 1;
+                ImGui::Text("Ping %d / %d\n", player.displayed + 1, last + 1);
+                if (ImGui::Button(player.playing ? "Pause" : "Play")) {
+                    if (!player.playing && (int)player.position >= last) {
+                        player.seek(0);
+                    }
+                    player.playing = !player.playing;
+                }
+                ImGui::SameLine();
+                if (ImGui::Button("Stop playback")) {
+                    player.close();
+                }
+                int ping = (int)player.position;
+                if (ImGui::SliderInt("ping", &ping, 0, max(last, 0))) {
+                    player.seek(ping);
+                }
+                ImGui::SliderFloat("playback speed", &player.speed, 0.1f, 8.0f, "%.1fx");
+                ImGui::InputFloat("(Hz)ping rate", &player.rate, 1.0f, 5.0f, "%.1f");
+                player.rate = max(player.rate, 0.1f);
+                ImGui::Text("Late pings: %u\n", player.stalls);
+                ImGui::Separator();
+            }
+            // one progress bar per job, the processing waits for them
+            vector<shared_ptr<Job> > running = jobs.getJobs();
+            for (size_t i = 0; i < running.size(); i++) {
+                ImGui::PushID((int)i);
+                ImGui::ProgressBar(running[i]->progress, ImVec2(-60.0f, 0.0f), running[i]->name.c_str());
+                ImGui::SameLine();
+                if (ImGui::Button("Cancel")) {
+                    running[i]->cancel();
+                }
+                ImGui::PopID();
+            }
+            for (size_t i = 0; i < pendingCloudJobs.size(); i++) {
+                ImGui::Text("%s (waiting)\n", pendingCloudJobs[i].first.c_str());
+            }
+            if (running.empty()) {
+                jobNotice.clear();
+            }
+            else if (!jobNotice.empty()) {
+                ImGui::Text("%s\n", jobNotice.c_str());
+            }
+            bool busy = !running.empty();
             if (pointCloud != NULL) {
                 ImGui::Text("Total points: %d\n", pointCloud->pvNum);
+                ImGui::Text("Drawn points: %u\n", drawnPoints);
+                ImGui::Text("Uploaded this frame: %u bytes\n", (unsigned int)pointBuffer.uploadedBytes);
+                ImGui::SliderInt("Point budget", &pointBudget, 100000, 50000000);
                 ImGui::Text("Isolate points threshold: %d\n", int(pThreshold / 100.0f * pointCloud->pvNum));
                 ImGui::Text("Neighbor radius: %.2f cm\n", pRadius / 100.0f * pointCloud->boundingBoxSize);
                 ImGui::Text("Coordinate of current point: (%.2f, %.2f, %.2f, %.0e)\n", worldCoord.x, worldCoord.y, worldCoord.z, curAmp);
+                ImGui::Text("Region of current point: %d\n", curRegion);
+                ImGui::Text("Selected points: %d\n", selection.isValid(pointCloud->version, pointCloud->pvNum) ? selectedCount : 0);
                 ImGui::Spacing();
                 if (ImGui::Button("Edit")) {
                     isEditMode = true;
@@ -230,24 +512,30 @@ int main()
                 if (ImGui::Button("View")) {
                     isEditMode = false;
                     rectangle[0] = rectangle[6] = rectangle[12] = rectangle[18] = rectangle[1] = rectangle[7] = rectangle[13] = rectangle[19] = 0;
+                    rectangleChanged = true;
                 }
-                if (ImGui::Button("Cut")) {
-                }
-                if (ImGui::Button("Clear sonar noise")) {
-                    pointCloud->clearSonarNoise();
-                    toRebind = true;
-                }
-                if (ImGui::Button("Clear scattering points")) {
-                    pointCloud->segment(pRadius / 100.0f * pointCloud->boundingBoxSize, pThreshold / 100.0f * pointCloud->pvNum);
-                    toRebind = true;
-                }
-                if (ImGui::Button("Use bilateral filter")) {
-                    pointCloud->useBilateralFilter(bRadius, bRadius);
-                    toRebind = true;
-                }
-                if (ImGui::Button("Reload")) {
-                    pointCloud->reset(ampThreshold);
-                    toRebind = true;
+                ImGui::SameLine();
+                ImGui::Checkbox("Lasso", &isLassoMode);
+                if (!busy) {
+                    if (ImGui::Button("Cut")) {
+                        clip();
+                    }
+                    if (ImGui::Button("Clear sonar noise")) {
+                        submitCloudJob("Clear sonar noise", [](PointCloud& cloud) { cloud.clearSonarNoise(); });
+                    }
+                    if (ImGui::Button("Clear scattering points")) {
+                        float radius = pRadius / 100.0f * pointCloud->boundingBoxSize;
+                        int thresh = int(pThreshold / 100.0f * pointCloud->pvNum);
+                        submitCloudJob("Clear scattering points", [radius, thresh](PointCloud& cloud) { cloud.segment(radius, thresh); });
+                    }
+                    if (ImGui::Button("Use bilateral filter")) {
+                        float radius = bRadius;
+                        submitCloudJob("Bilateral filter", [radius](PointCloud& cloud) { cloud.useBilateralFilter(radius, radius); });
+                    }
+                    if (ImGui::Button("Reload")) {
+                        float threshold = ampThreshold;
+                        submitCloudJob("Reload", [threshold](PointCloud& cloud) { cloud.reset(threshold); }, true);
+                    }
                 }
 
                 ImGui::SliderFloat("(%)isolate points threshold (ANN param)", &pThreshold, 0.0f, 10.0f);
@@ -255,23 +543,62 @@ int main()
                 ImGui::SliderFloat("(cm)bilateral filter radius", &bRadius, 0.0f, 5.0f);
             }
             ImGui::SliderFloat("amplitude threshold", &ampThreshold, 0.0f, 1.0f);
+            // the preview follows the slider on the GPU, the points are
+            // thresholded on the CPU once it is released
+            bool active = ImGui::IsItemActive();
+            if (thresholdActive && !active && pointCloud != NULL && pointCloud->isPristine()) {
+                float threshold = ampThreshold;
+                submitCloudJob("Threshold", [threshold](PointCloud& cloud) { cloud.reset(threshold); }, true);
+            }
+            thresholdActive = active;
 
             ImGui::End();
         }
         // second window
         {
-
+            ImGui::Begin("Profiler");
+            // rolling history of every stage, in milliseconds
+            static vector<Profiler::Stat> stats;
+            Profiler::get().getStats(stats);
+            for (size_t i = 0; i < stats.size(); i++) {
+                char overlay[64];
+                snprintf(overlay, sizeof(overlay), "p50 %.2f p95 %.2f p99 %.2f ms", stats[i].p50, stats[i].p95, stats[i].p99);
+                ImGui::PlotLines(stats[i].name.c_str(), stats[i].history.data(), (int)stats[i].history.size(), stats[i].offset, overlay, 0.0f, FLT_MAX, ImVec2(0, 40));
+            }
+            ImGui::Checkbox("Record", &Profiler::get().enabled);
+            ImGui::SameLine();
+            if (ImGui::Button("Clear")) {
+                Profiler::get().clear();
+            }
+            ImGui::SameLine();
+            // for chrome://tracing or Perfetto
+            if (ImGui::Button("Export trace")) {
+                Profiler::get().exportTrace("trace.json");
+            }
+            ImGui::End();
         }
 
         // Rendering
         ImGui::Render();
+        uiTimer.begin();
         ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+        uiTimer.end();
         // Swap the buffers
         glfwSwapBuffers(window);
     }
     // Properly de-allocate all resources once they've outlived their purpose
-    glDeleteVertexArrays(2, VAOs);
-    glDeleteBuffers(2, VBOs);
+    jobs.stop();
+    player.close();
+    pointBuffer.destroy();
+    rawBuffer.destroy();
+    idPicker.destroy();
+    pickingTimer.destroy();
+    pointsTimer.destroy();
+    uiTimer.destroy();
+    glDeleteVertexArrays(1, &rectangleVAO);
+    glDeleteBuffers(1, &rectangleVBO);
+    glDeleteVertexArrays(1, &lassoVAO);
+    glDeleteBuffers(1, &lassoVBO);
 
     // Cleanup
     ImGui_ImplOpenGL3_Shutdown();
@@ -314,22 +641,29 @@ void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mod)
             //glfwSetWindowShouldClose(window, GL_TRUE);
             return;
         case GLFW_KEY_C:
-            clip(rectangle[0], rectangle[1], rectangle[12], rectangle[13]);
-            toRebind = true;
+            clip();
+            return;
+        case GLFW_KEY_L:
+            isLassoMode = !isLassoMode;
             return;
         case GLFW_KEY_V:
             isEditMode = false;
             rectangle[0] = rectangle[6] = rectangle[12] = rectangle[18] = rectangle[1] = rectangle[7] = rectangle[13] = rectangle[19] = 0;
+            rectangleChanged = true;
             return;
         case GLFW_KEY_E:
             isEditMode = true;
             return;
-        case GLFW_KEY_R:
-            pointCloud->reset(ampThreshold);
-            toRebind = true;
+        case GLFW_KEY_R: {
+            float threshold = ampThreshold;
+            submitCloudJob("Reload", [threshold](PointCloud& cloud) { cloud.reset(threshold); }, true);
             return;
+        }
         case GLFW_KEY_S:
             return;
+        case GLFW_KEY_SPACE:
+            player.playing = player.isOpen() && !player.playing;
+            return;
         default:
             break;
         }
@@ -347,24 +681,34 @@ void scrollCallback(GLFWwindow* window, double x, double y) {
 void mouseButtonCallback(GLFWwindow* window, int button, int action, int mods) {
     if (action == GLFW_PRESS && button == GLFW_MOUSE_BUTTON_LEFT) {
         mouseEvent = 1;
-        if (isEditMode) {
+        if (isEditMode && isLassoMode) {
+            GLfloat vertex[] = { curMouse.x, curMouse.y, 0.0f, 1.0f, 1.0f, 0.0f };
+            lasso.assign(vertex, vertex + 6);
+            lassoChanged = true;
+        }
+        else if (isEditMode) {
             rectangle[0] = rectangle[6] = rectangle[12] = rectangle[18] = curMouse.x;
             rectangle[1] = rectangle[7] = rectangle[13] = rectangle[19] = curMouse.y;
+            rectangleChanged = true;
         }
     }
     else if (action == GLFW_PRESS && button == GLFW_MOUSE_BUTTON_RIGHT) {
         mouseEvent = 2;
     }
     else {
+        // the shape drawn is applied to the selection when it is released
+        if (action == GLFW_RELEASE && button == GLFW_MOUSE_BUTTON_LEFT && mouseEvent == 1 && isEditMode) {
+            applySelection(mods);
+        }
         mouseEvent = 0;
     }
 
 }
 
 void cursorCallback(GLFWwindow* window, double x, double y) {
+    // the hovered point is read from the picking pass of the next frames
+    hoverPixel = glm::vec2(x, y);
     if (pointCloud == NULL) { return; }
-    worldCoord = screenCoords2WorldCoords(window, x, y);
-    curAmp = pointCloud->ampMap[getPointStr(worldCoord.x, worldCoord.y, worldCoord.z)];
     curMouse = transformMouse(glm::vec2(x, y));
     if (!isEditMode) {
         if (mouseEvent == 1) {
@@ -374,6 +718,14 @@ void cursorCallback(GLFWwindow* window, double x, double y) {
             arcballCamera.pan((curMouse - prevMouse) * 0.1f);
         }
     }
+    else if (isLassoMode) {
+        // a vertex every few pixels
+        if (mouseEvent == 1 && !lasso.empty() && glm::length(curMouse - glm::vec2(lasso[lasso.size() - 6], lasso[lasso.size() - 5])) > 0.005f) {
+            GLfloat vertex[] = { curMouse.x, curMouse.y, 0.0f, 1.0f, 1.0f, 0.0f };
+            lasso.insert(lasso.end(), vertex, vertex + 6);
+            lassoChanged = true;
+        }
+    }
     else {
         if (mouseEvent == 1) {
             rectangle[12] = curMouse.x;
@@ -382,6 +734,7 @@ void cursorCallback(GLFWwindow* window, double x, double y) {
             rectangle[7] = rectangle[13];
             rectangle[18] = rectangle[12];
             rectangle[19] = rectangle[1];
+            rectangleChanged = true;
         }
         
     }
@@ -389,44 +742,95 @@ void cursorCallback(GLFWwindow* window, double x, double y) {
     
 }
 
-void clip(GLfloat x1, GLfloat y1, GLfloat x2, GLfloat y2) {
-    if (x1 == x2 || y1 == y2) { return; }
-
-    GLfloat minx = min(x1, x2);
-    GLfloat maxx = max(x1, x2);
-    GLfloat miny = min(y1, y2);
-    GLfloat maxy = max(y1, y2);
+void applySelection(int mods) {
+    if (pointCloud == NULL) { return; }
+    // shift adds to the selection, control removes from it
+    ScreenSelection::Mode mode = ScreenSelection::REPLACE;
+    if (mods & GLFW_MOD_SHIFT) {
+        mode = ScreenSelection::ADD;
+    }
+    else if (mods & GLFW_MOD_CONTROL) {
+        mode = ScreenSelection::SUBTRACT;
+    }
+    if (!selection.isValid(pointCloud->version, pointCloud->pvNum)) {
+        selection.clear(pointCloud->version, pointCloud->pvNum);
+    }
 
     glm::mat4 view = arcballCamera.transform();
-
-    for (int i = 0; i < pointCloud->pvNum; i++) {
-        glm::vec4 pos = projection * view * model* glm::vec4(pointCloud->vPoints[i*6], pointCloud->vPoints[i*6+1], pointCloud->vPoints[i*6+2], 1.0f);
-        pos.x = pos.x / pos.w;
-        pos.y = pos.y / pos.w;
-        if (pos.x >= minx && pos.x <= maxx && pos.y >= miny && pos.y <= maxy) {
-            pointCloud->pFlag[i] = false;
+    glm::mat4 mvp = projection * view * model;
+
+    // the points are projected with the matrix of the frame, the shape is in
+    // normalized device coordinates
+    if (isLassoMode) {
+        vector<float> polygon;
+        for (size_t i = 0; i < lasso.size(); i += 6) {
+            polygon.push_back(lasso[i]);
+            polygon.push_back(lasso[i + 1]);
         }
+        selection.selectPolygon(glm::value_ptr(mvp), pointCloud->vPoints, polygon.data(), (int)polygon.size() / 2, mode);
     }
-    pointCloud->transform();
+    else {
+        if (rectangle[0] == rectangle[12] || rectangle[1] == rectangle[13]) { return; }
+        selection.selectRectangle(glm::value_ptr(mvp), pointCloud->vPoints, rectangle[0], rectangle[1], rectangle[12], rectangle[13], mode);
+    }
+    selectedCount = selection.count();
+}
+
+void clip() {
+    if (pointCloud == NULL) { return; }
+    // the selection is made on the cloud drawn, the processing running
+    // replaces it: the cut cannot wait for it
+    if (jobs.isBusy() || !pendingCloudJobs.empty()) {
+        jobNotice = "Cut is not available until the processing is done";
+        return;
+    }
+    // every shape added to the selection, removed by one compaction
+    ScreenSelection removed = selection;
+    submitCloudJob("Cut", [removed](PointCloud& cloud) { cloud.removeSelected(removed); });
+}
+
+void submitCloudJob(const string& name, function<void(PointCloud&)> process, bool reset) {
+    if (pointCloud == NULL) { return; }
+    // a reset starts over from the raw points: what waits before it is moot
+    if (reset) {
+        pendingCloudJobs.clear();
+    }
+    pendingCloudJobs.push_back(make_pair(name, process));
+    startPendingCloudJob();
+}
+
+void startPendingCloudJob() {
+    // one processing at a time, each on the result of the previous one
+    if (pointCloud == NULL || pendingCloudJobs.empty() || jobs.isBusy()) { return; }
+    string name = pendingCloudJobs.front().first;
+    function<void(PointCloud&)> process = pendingCloudJobs.front().second;
+    pendingCloudJobs.pop_front();
+    // the job works on a copy made by the worker, the cloud drawn meanwhile
+    // is left untouched
+    shared_ptr<PointCloud> source = pointCloud;
+    shared_ptr<shared_ptr<PointCloud> > result = make_shared<shared_ptr<PointCloud> >();
+    jobs.submit(name, [source, result, process](Job& job) {
+        *result = make_shared<PointCloud>(*source);
+        PointCloud& cloud = **result;
+        cloud.progress = [&job](float done) { return job.report(done); };
+        process(cloud);
+        if (!job.cancelled) {
+            cloud.prepareRender();
+        }
+        cloud.progress = nullptr;
+        job.report(1.0f);
+    }, [source, result]() {
+        // the spans of the drawn cloud not uploaded yet are uploaded from
+        // the result
+        PointCloud& cloud = **result;
+        cloud.rawDirty.insert(cloud.rawDirty.end(), source->rawDirty.begin(), source->rawDirty.end());
+        cloud.renderDirty.insert(cloud.renderDirty.end(), source->renderDirty.begin(), source->renderDirty.end());
+        cloud.colormapDirty = cloud.colormapDirty || source->colormapDirty;
+        pointCloud = *result;
+    });
 }
 
 glm::vec2 transformMouse(glm::vec2 in)
 {
     return glm::vec2(in.x * 2.f / screenWidth - 1.f, 1.f - 2.f * in.y / screenHeight);
 }
-
-glm::vec3 screenCoords2WorldCoords(GLFWwindow* window, double x, double y) {
-    int screen_w, screen_h, pixel_w, pixel_h;
-    //double xpos, ypos;
-    glfwGetWindowSize(window, &screen_w, &screen_h); // better use the callback and cache the values 
-    glfwGetFramebufferSize(window, &pixel_w, &pixel_h); // better use the callback and cache the values
-    //glfwGetCursorPos(window, &xpos, &ypos);
-    //glm::vec2 screen_pos = glm::vec2(xpos, ypos);
-    glm::vec2 screen_pos = glm::vec2(x, y);
-    glm::vec2 pixel_pos = screen_pos * glm::vec2(pixel_w, pixel_h) / glm::vec2(screen_w, screen_h); // note: not necessarily integer
-    pixel_pos = pixel_pos + glm::vec2(0.5f, 0.5f); // shift to GL's center convention
-    glm::vec3 win = glm::vec3(pixel_pos.x, pixel_h - pixel_pos.y, 0.0f);
-    glReadPixels((GLint)win.x, (GLint)win.y, 1, 1, GL_DEPTH_COMPONENT, GL_FLOAT, &win.z);
-    glm::vec3 world = glm::unProject(win, arcballCamera.transform(), projection, glm::vec4(0.0f, 0.0f, (float)screen_w, (float)screen_h));
-    return world;
-}
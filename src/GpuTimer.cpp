@@ -0,0 +1,57 @@
+#include "GpuTimer.h"
+#include "Profiler.h"
+
+
+GpuTimer::GpuTimer() : name(""), current(0), active(false) {
+    for (int i = 0; i < QUERIES; i++) {
+        queries[i] = 0;
+        issued[i] = 0;
+        pending[i] = false;
+    }
+}
+void GpuTimer::create(const char* name) {
+    this->name = name;
+    glGenQueries(QUERIES, queries);
+}
+void GpuTimer::destroy() {
+    glDeleteQueries(QUERIES, queries);
+    for (int i = 0; i < QUERIES; i++) {
+        queries[i] = 0;
+        pending[i] = false;
+    }
+}
+void GpuTimer::begin() {
+    // all the queries still in flight: this frame is not timed
+    active = !pending[current];
+    if (active) {
+        issued[current] = Profiler::now();
+        glBeginQuery(GL_TIME_ELAPSED, queries[current]);
+    }
+}
+void GpuTimer::end() {
+    if (!active) {
+        return;
+    }
+    glEndQuery(GL_TIME_ELAPSED);
+    pending[current] = true;
+    current = (current + 1) % QUERIES;
+    active = false;
+}
+void GpuTimer::poll() {
+    for (int k = 0; k < QUERIES; k++) {
+        // oldest first, the results come in order
+        int i = (current + k) % QUERIES;
+        if (!pending[i]) {
+            continue;
+        }
+        GLint available = 0;
+        glGetQueryObjectiv(queries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) {
+            return;
+        }
+        GLuint64 elapsed = 0;
+        glGetQueryObjectui64v(queries[i], GL_QUERY_RESULT, &elapsed);
+        pending[i] = false;
+        Profiler::get().record(name, issued[i], elapsed / 1000.0, Profiler::GPU_THREAD);
+    }
+}
@@ -0,0 +1,353 @@
+#include "Headless.h"
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <spawn.h>
+#include <sys/wait.h>
+extern char** environ;
+#endif
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+#include "Shader.h"
+#include "ArcballCamera.h"
+#include "PointCloud.h"
+#include "PointBuffer.h"
+#include "FileIO.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+
+HeadlessOptions::HeadlessOptions() : outDir("previews"), width(1024), height(768), turntable(0), threshold(0.1f), jobs(0), threads(0) {
+}
+
+#ifdef _WIN32
+// an argument of a command line as the C runtime splits it again: in quotes,
+// the backslashes before a quote doubled and the quotes escaped
+static string quoteArgument(const string& arg) {
+    if (!arg.empty() && arg.find_first_of(" \t\n\v\"") == string::npos) {
+        return arg;
+    }
+    string quoted = "\"";
+    for (size_t i = 0; ; i++) {
+        size_t backslashes = 0;
+        while (i < arg.size() && arg[i] == '\\') {
+            i++;
+            backslashes++;
+        }
+        if (i == arg.size()) {
+            quoted.append(backslashes * 2, '\\');
+            break;
+        }
+        if (arg[i] == '"') {
+            quoted.append(backslashes * 2 + 1, '\\');
+        }
+        else {
+            quoted.append(backslashes, '\\');
+        }
+        quoted += arg[i];
+    }
+    return quoted + "\"";
+}
+#endif
+
+// runs a program with its arguments and waits for it, without a shell in
+// between: the file names are passed as they are. Returns its exit code, -1
+// when it could not be started or did not exit
+static int runProcess(const vector<string>& args) {
+#ifdef _WIN32
+    string commandLine;
+    for (size_t i = 0; i < args.size(); i++) {
+        commandLine += (i > 0 ? " " : "") + quoteArgument(args[i]);
+    }
+    STARTUPINFOA startup;
+    PROCESS_INFORMATION process;
+    ZeroMemory(&startup, sizeof(startup));
+    startup.cb = sizeof(startup);
+    // the program is the first argument, found as the shell would find it
+    if (!CreateProcessA(NULL, &commandLine[0], NULL, NULL, FALSE, 0, NULL, NULL, &startup, &process)) {
+        return -1;
+    }
+    WaitForSingleObject(process.hProcess, INFINITE);
+    DWORD code = 0;
+    GetExitCodeProcess(process.hProcess, &code);
+    CloseHandle(process.hThread);
+    CloseHandle(process.hProcess);
+    return (int)code;
+#else
+    vector<char*> argv;
+    for (size_t i = 0; i < args.size(); i++) {
+        argv.push_back(const_cast<char*>(args[i].c_str()));
+    }
+    argv.push_back(NULL);
+    pid_t pid;
+    if (posix_spawnp(&pid, argv[0], NULL, NULL, argv.data(), environ) != 0) {
+        return -1;
+    }
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+#endif
+}
+
+int runHeadless(int argc, char** argv) {
+    HeadlessOptions options;
+    string render, batch;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool more = i + 1 < argc;
+        if (arg == "--render" && more) {
+            render = argv[++i];
+        }
+        else if (arg == "--batch" && more) {
+            batch = argv[++i];
+        }
+        else if (arg == "--out" && more) {
+            options.outDir = argv[++i];
+        }
+        else if (arg == "--size" && i + 2 < argc) {
+            options.width = atoi(argv[++i]);
+            options.height = atoi(argv[++i]);
+        }
+        else if (arg == "--turntable" && more) {
+            options.turntable = atoi(argv[++i]);
+        }
+        else if (arg == "--threshold" && more) {
+            options.threshold = (float)atof(argv[++i]);
+        }
+        else if (arg == "--jobs" && more) {
+            options.jobs = atoi(argv[++i]);
+        }
+        else if (arg == "--threads" && more) {
+            options.threads = atoi(argv[++i]);
+        }
+        else {
+            cerr << "Unknown argument " << arg << endl;
+            return 2;
+        }
+    }
+    if (options.width <= 0 || options.height <= 0) {
+        cerr << "Invalid image size" << endl;
+        return 2;
+    }
+#ifdef _WIN32
+    _mkdir(options.outDir.c_str());
+#else
+    mkdir(options.outDir.c_str(), 0755);
+#endif
+    if (!batch.empty()) {
+        return renderBatch(argv[0], batch, options);
+    }
+    if (!render.empty()) {
+        return renderScan(render, options);
+    }
+    cerr << "Nothing to render: use --render <file> or --batch <dir>" << endl;
+    return 2;
+}
+
+int renderBatch(const string& executable, const string& dir, const HeadlessOptions& options) {
+    vector<string> files;
+    FileIO::listFiles(dir, files);
+    if (files.empty()) {
+        cerr << "No scan in " << dir << endl;
+        return 1;
+    }
+    // one process per scan, as many at a time as there are cores: each has
+    // its own context and memory, a crash only loses its scan
+    unsigned int cores = max(thread::hardware_concurrency(), 1u);
+    unsigned int jobs = options.jobs > 0 ? (unsigned int)options.jobs : cores;
+    jobs = min(jobs, (unsigned int)files.size());
+    unsigned int threads = options.threads > 0 ? (unsigned int)options.threads : max(cores / jobs, 1u);
+    auto text = [](double value) {
+        stringstream ss;
+        ss << value;
+        return ss.str();
+    };
+    vector<string> arguments = { "--out", options.outDir, "--size", text(options.width), text(options.height),
+        "--turntable", text(options.turntable), "--threshold", text(options.threshold), "--threads", text(threads) };
+
+    atomic<size_t> next(0);
+    atomic<int> failed(0);
+    vector<thread> workers;
+    for (unsigned int w = 0; w < jobs; w++) {
+        workers.push_back(thread([&]() {
+            for (size_t i = next++; i < files.size(); i = next++) {
+                vector<string> command;
+                command.push_back(executable);
+                command.push_back("--render");
+                command.push_back(files[i]);
+                command.insert(command.end(), arguments.begin(), arguments.end());
+                int status = runProcess(command);
+                if (status != 0) {
+                    failed++;
+                }
+                printf("[%u/%u] %s%s\n", (unsigned int)(i + 1), (unsigned int)files.size(), files[i].c_str(), status != 0 ? " failed" : "");
+            }
+        }));
+    }
+    for (size_t w = 0; w < workers.size(); w++) {
+        workers[w].join();
+    }
+    printf("%d of %u scans rendered to %s\n", (int)files.size() - failed, (unsigned int)files.size(), options.outDir.c_str());
+    return failed == 0 ? 0 : 1;
+}
+
+int renderScan(const string& path, const HeadlessOptions& options) {
+#ifdef _OPENMP
+    if (options.threads > 0) {
+        omp_set_num_threads(options.threads);
+    }
+#endif
+    int size = FileIO::getFileSize(path);
+    if (size < (int)(4 * sizeof(float))) {
+        cerr << "Cannot read " << path << endl;
+        return 1;
+    }
+
+    // a hidden window for the context, the images go to a framebuffer object
+    if (!glfwInit()) {
+        cerr << "Cannot initialize GLFW" << endl;
+        return 1;
+    }
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    GLFWwindow* window = glfwCreateWindow(16, 16, "3DSonalVis", nullptr, nullptr);
+    if (window == NULL) {
+        cerr << "Cannot create an OpenGL 3.3 context" << endl;
+        glfwTerminate();
+        return 1;
+    }
+    glfwMakeContextCurrent(window);
+    gladLoadGLLoader((GLADloadproc)glfwGetProcAddress);
+
+    int width = options.width, height = options.height;
+    GLuint fbo, color, depth;
+    glGenRenderbuffers(1, &color);
+    glBindRenderbuffer(GL_RENDERBUFFER, color);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glGenRenderbuffers(1, &depth);
+    glBindRenderbuffer(GL_RENDERBUFFER, depth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glGenFramebuffers(1, &fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, color);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth);
+    glViewport(0, 0, width, height);
+    glEnable(GL_DEPTH_TEST);
+
+    // the cloud as the viewer shows a file it opens: raw points, thresholded
+    // in the shader
+    float* points = FileIO::openBinaryPointsFile(path, size);
+    PointCloud cloud;
+    cloud.init(points, size / 4 / sizeof(float), options.threshold);
+    delete[] points;
+    const LodHierarchy& lod = cloud.getRawLod();
+
+    int status = 0;
+    {
+        Shader pointShader("shader/points.vs", "shader/shader.frag");
+        PointBuffer buffer;
+        buffer.create();
+        buffer.update(cloud.rawVertices.data(), (unsigned int)cloud.rawVertices.size() / 4, 0, cloud.rawDirty);
+        GLfloat rgb[256 * 3];
+        float curve[256], low;
+        cloud.getThresholdCurve(options.threshold, low, curve);
+        cloud.getColormap(curve, rgb);
+        buffer.updateColormap(rgb);
+        float lowStep = floor(low / cloud.ampMax * 65535.0f + 0.5f);
+
+        // same projection as the viewer, at the aspect of the images
+        glm::mat4 model(1.0f);
+        glm::mat4 projection = glm::perspective(70.0f, (float)width / height, 0.1f, 1000.0f);
+        glm::vec3 center = cloud.centerPoint;
+        float distance = cloud.boundingBoxSize * (0.5f + 0.6f * projection[1][1]);
+        vector<string> names;
+        vector<ArcballCamera> cameras;
+        if (options.turntable > 0) {
+            for (int k = 0; k < options.turntable; k++) {
+                float angle = 6.2831853f * k / options.turntable;
+                char name[32];
+                snprintf(name, sizeof(name), "turntable_%03d", k);
+                names.push_back(name);
+                cameras.push_back(ArcballCamera(center + distance * glm::vec3(cos(angle), 0.35f, sin(angle)), center, glm::vec3(0.0f, 1.0f, 0.0f)));
+            }
+        }
+        else {
+            names.push_back("default");
+            cameras.push_back(ArcballCamera(center + glm::vec3(100.0f, 0.0f, 0.0f), center, glm::vec3(0.0f, 1.0f, 0.0f)));
+            names.push_back("front");
+            cameras.push_back(ArcballCamera(center + glm::vec3(distance, 0.0f, 0.0f), center, glm::vec3(0.0f, 1.0f, 0.0f)));
+            names.push_back("side");
+            cameras.push_back(ArcballCamera(center + glm::vec3(0.0f, 0.0f, distance), center, glm::vec3(0.0f, 1.0f, 0.0f)));
+            names.push_back("top");
+            cameras.push_back(ArcballCamera(center + glm::vec3(0.0f, distance, 0.0f), center, glm::vec3(0.0f, 0.0f, -1.0f)));
+        }
+
+        vector<unsigned char> pixels((size_t)width * height * 3), image(pixels.size());
+        vector<int> nodes;
+        for (size_t v = 0; v < cameras.size(); v++) {
+            glm::mat4 view = cameras[v].transform();
+            glm::mat4 modelView = view * model;
+            glm::mat4 mvp = projection * modelView;
+            ConvexRegion frustum = ConvexRegion::frustum(glm::value_ptr(mvp), -1.0, -1.0, 1.0, 1.0);
+            glm::vec3 eye = glm::vec3(glm::inverse(modelView)[3]);
+            lod.select(frustum, glm::value_ptr(eye), 0.5f * height * projection[1][1], 16.0f, 0xffffffffu, nodes);
+
+            glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            glPointSize(4.0f);
+            pointShader.bind();
+            pointShader.setUniform("model", model);
+            pointShader.setUniform("view", view);
+            pointShader.setUniform("projection", projection);
+            pointShader.setUniform("colormap", 0);
+            pointShader.setUniform("ampThreshold", (lowStep - 0.5f) / 65535.0f);
+            pointShader.setUniform("ampLow", low / cloud.ampMax);
+            pointShader.setUniform("ampHigh", 1.0f);
+            buffer.bind();
+            buffer.draw(pointShader, lod, nodes, frustum);
+            glBindVertexArray(0);
+
+            // rows come bottom up from GL, PNG wants them top down
+            glPixelStorei(GL_PACK_ALIGNMENT, 1);
+            glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+            for (int y = 0; y < height; y++) {
+                memcpy(&image[(size_t)y * width * 3], &pixels[(size_t)(height - 1 - y) * width * 3], width * 3);
+            }
+            string file = options.outDir + "/" + FileIO::baseName(path) + "_" + names[v] + ".png";
+            if (!FileIO::savePng(file, image.data(), width, height)) {
+                cerr << "Cannot write " << file << endl;
+                status = 1;
+            }
+        }
+        buffer.destroy();
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteFramebuffers(1, &fbo);
+    glDeleteRenderbuffers(1, &color);
+    glDeleteRenderbuffers(1, &depth);
+    glfwDestroyWindow(window);
+    glfwTerminate();
+    return status;
+}
@@ -0,0 +1,119 @@
+#include "IdPicker.h"
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+
+IdPicker::IdPicker() : width(0), height(0), radius(0), fbo(0), idTexture(0), depthBuffer(0), current(0), readX(0), readY(0), readSize(0) {
+    pbos[0] = pbos[1] = 0;
+    fences[0] = fences[1] = 0;
+    tags[0] = tags[1] = 0;
+}
+void IdPicker::create(int width, int height, int radius) {
+    this->width = width;
+    this->height = height;
+    this->radius = radius;
+    readSize = 2 * radius + 1;
+
+    glGenTextures(1, &idTexture);
+    glBindTexture(GL_TEXTURE_2D, idTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R32UI, width, height, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, 0);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenRenderbuffers(1, &depthBuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, depthBuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    glGenFramebuffers(1, &fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, idTexture, 0);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthBuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    glGenBuffers(2, pbos);
+    for (int i = 0; i < 2; i++) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[i]);
+        glBufferData(GL_PIXEL_PACK_BUFFER, sizeof(GLuint) * readSize * readSize, 0, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+void IdPicker::destroy() {
+    discard();
+    glDeleteBuffers(2, pbos);
+    glDeleteFramebuffers(1, &fbo);
+    glDeleteRenderbuffers(1, &depthBuffer);
+    glDeleteTextures(1, &idTexture);
+    fbo = idTexture = depthBuffer = 0;
+}
+void IdPicker::discard() {
+    // readbacks in flight are of a scene that is gone
+    for (int i = 0; i < 2; i++) {
+        if (fences[i] != 0) {
+            glDeleteSync(fences[i]);
+            fences[i] = 0;
+        }
+    }
+}
+void IdPicker::begin(int x, int y) {
+    // window around the cursor, kept inside the target
+    readX = min(max(x - radius, 0), max(width - readSize, 0));
+    readY = min(max(y - radius, 0), max(height - readSize, 0));
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glViewport(0, 0, width, height);
+    glEnable(GL_SCISSOR_TEST);
+    glScissor(readX, readY, readSize, readSize);
+    GLuint background[4] = { 0, 0, 0, 0 };
+    glClearBufferuiv(GL_COLOR, 0, background);
+    glClear(GL_DEPTH_BUFFER_BIT);
+}
+void IdPicker::end(unsigned int tag) {
+    // a readback still in flight in this buffer is dropped
+    if (fences[current] != 0) {
+        glDeleteSync(fences[current]);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[current]);
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+    glReadPixels(readX, readY, readSize, readSize, GL_RED_INTEGER, GL_UNSIGNED_INT, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    fences[current] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    tags[current] = tag;
+    current = 1 - current;
+    glDisable(GL_SCISSOR_TEST);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+bool IdPicker::poll(unsigned int& slot, unsigned int& tag) {
+    // the oldest readback first, without waiting for it
+    for (int k = 0; k < 2; k++) {
+        int i = (current + k) % 2;
+        if (fences[i] == 0) {
+            continue;
+        }
+        if (glClientWaitSync(fences[i], 0, 0) == GL_TIMEOUT_EXPIRED) {
+            return false;
+        }
+        glDeleteSync(fences[i]);
+        fences[i] = 0;
+
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[i]);
+        const GLuint* ids = (const GLuint*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, sizeof(GLuint) * readSize * readSize, GL_MAP_READ_BIT);
+        // the point drawn closest to the window center
+        slot = 0;
+        int best = readSize * readSize;
+        for (int j = 0; ids != NULL && j < readSize * readSize; j++) {
+            int dx = j % readSize - radius, dy = j / readSize - radius;
+            if (ids[j] != 0 && dx * dx + dy * dy < best) {
+                best = dx * dx + dy * dy;
+                slot = ids[j];
+            }
+        }
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        tag = tags[i];
+        return true;
+    }
+    return false;
+}
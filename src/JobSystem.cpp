@@ -0,0 +1,97 @@
+#include "JobSystem.h"
+
+
+Job::Job(const string& name) : name(name), state(QUEUED), progress(0.0f), cancelled(false) {
+}
+bool Job::report(float progress) {
+    this->progress = progress;
+    return !cancelled;
+}
+void Job::cancel() {
+    cancelled = true;
+}
+
+JobSystem::JobSystem() : stopping(false) {
+}
+JobSystem::~JobSystem() {
+    stop();
+}
+void JobSystem::start(unsigned int workers) {
+    stopping = false;
+    for (unsigned int i = 0; i < workers; i++) {
+        this->workers.push_back(thread(&JobSystem::work, this));
+    }
+}
+void JobSystem::stop() {
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+        // the queued jobs will not run, the running ones stop at their next report
+        for (size_t i = 0; i < jobs.size(); i++) {
+            jobs[i]->cancel();
+        }
+    }
+    wakeup.notify_all();
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+    workers.clear();
+    queue.clear();
+    jobs.clear();
+}
+shared_ptr<Job> JobSystem::submit(const string& name, function<void(Job&)> run, function<void()> finish) {
+    shared_ptr<Job> job = make_shared<Job>(name);
+    job->run = run;
+    job->finish = finish;
+    {
+        lock_guard<mutex> guard(lock);
+        queue.push_back(job);
+        jobs.push_back(job);
+    }
+    wakeup.notify_one();
+    return job;
+}
+void JobSystem::work() {
+    while (true) {
+        shared_ptr<Job> job;
+        {
+            unique_lock<mutex> guard(lock);
+            wakeup.wait(guard, [this] { return stopping || !queue.empty(); });
+            if (stopping) {
+                return;
+            }
+            job = queue.front();
+            queue.pop_front();
+        }
+        if (!job->cancelled) {
+            job->state = Job::RUNNING;
+            job->run(*job);
+        }
+        job->state = job->cancelled ? Job::CANCELLED : Job::DONE;
+    }
+}
+void JobSystem::poll() {
+    // results in submission order: a job waits for the ones before it
+    while (true) {
+        shared_ptr<Job> job;
+        {
+            lock_guard<mutex> guard(lock);
+            if (jobs.empty() || (jobs[0]->state != Job::DONE && jobs[0]->state != Job::CANCELLED)) {
+                return;
+            }
+            job = jobs[0];
+            jobs.erase(jobs.begin());
+        }
+        if (job->state == Job::DONE && job->finish) {
+            job->finish();
+        }
+    }
+}
+bool JobSystem::isBusy() const {
+    lock_guard<mutex> guard(lock);
+    return !jobs.empty();
+}
+vector<shared_ptr<Job> > JobSystem::getJobs() const {
+    lock_guard<mutex> guard(lock);
+    return jobs;
+}
@@ -0,0 +1,204 @@
+#include "LodHierarchy.h"
+#include "Profiler.h"
+#include <queue>
+#include <cmath>
+#include <cstring>
+
+
+LodHierarchy::LodHierarchy() : version(0), stride(3) {
+}
+bool LodHierarchy::isValid(unsigned int version) const {
+    return !nodes.empty() && this->version == version;
+}
+void LodHierarchy::build(const float* points, int num, unsigned int version, unsigned int capacity, unsigned int stride) {
+    this->version = version;
+    this->stride = stride;
+    nodes.clear();
+    order.resize(num);
+    for (int i = 0; i < num; i++) {
+        order[i] = i;
+    }
+    if (num == 0) {
+        return;
+    }
+
+    float lower[3] = { points[0], points[1], points[2] };
+    float upper[3] = { points[0], points[1], points[2] };
+    for (int i = 0; i < num; i++) {
+        for (int k = 0; k < 3; k++) {
+            lower[k] = min(lower[k], points[i * stride + k]);
+            upper[k] = max(upper[k], points[i * stride + k]);
+        }
+    }
+    float size = max(max(upper[0] - lower[0], upper[1] - lower[1]), upper[2] - lower[2]);
+    size = 1.001f * max(size, 1e-6f);
+
+    Node root;
+    for (int k = 0; k < 3; k++) {
+        root.origin[k] = lower[k];
+    }
+    root.size = size;
+    nodes.push_back(root);
+
+    vector<unsigned int> tmp(num);
+    vector<unsigned char> cls(num);
+    vector<int> cells(4096, -1);
+    buildNode(0, points, 0, num, 0, capacity, tmp, cls, cells);
+}
+void LodHierarchy::buildNode(int node, const float* points, unsigned int begin, unsigned int end, int depth, unsigned int capacity, vector<unsigned int>& tmp, vector<unsigned char>& cls, vector<int>& cells) {
+    for (int i = 0; i < 8; i++) {
+        nodes[node].children[i] = -1;
+    }
+    nodes[node].first = begin;
+    nodes[node].slots = end - begin;
+    // small nodes, and nodes at the float precision, keep all their points
+    if (end - begin <= capacity || depth >= 20) {
+        nodes[node].count = end - begin;
+        return;
+    }
+
+    float origin[3] = { nodes[node].origin[0], nodes[node].origin[1], nodes[node].origin[2] };
+    float size = nodes[node].size;
+    float half = 0.5f * size;
+    // the first point of each grid cell represents the node, the others go
+    // down to the child of their octant
+    unsigned int counts[9] = { 0 };
+    for (unsigned int i = begin; i < end; i++) {
+        const float* p = points + order[i] * stride;
+        int key = 0, octant = 0;
+        for (int k = 0; k < 3; k++) {
+            int g = (int)((p[k] - origin[k]) / size * 16);
+            key = key * 16 + min(max(g, 0), 15);
+            octant = octant * 2 + (p[k] >= origin[k] + half ? 1 : 0);
+        }
+        if (cells[key] != node) {
+            cells[key] = node;
+            cls[i] = 8;
+        }
+        else {
+            cls[i] = octant;
+        }
+        counts[cls[i]]++;
+    }
+
+    // representatives first, then the octants in order
+    unsigned int offsets[9];
+    offsets[8] = begin;
+    offsets[0] = begin + counts[8];
+    for (int c = 1; c < 8; c++) {
+        offsets[c] = offsets[c - 1] + counts[c - 1];
+    }
+    unsigned int starts[9];
+    memcpy(starts, offsets, sizeof(offsets));
+    for (unsigned int i = begin; i < end; i++) {
+        tmp[offsets[cls[i]]++] = order[i];
+    }
+    memcpy(&order[begin], &tmp[begin], sizeof(unsigned int) * (end - begin));
+    nodes[node].count = nodes[node].slots = counts[8];
+
+    for (int c = 0; c < 8; c++) {
+        if (counts[c] == 0) {
+            continue;
+        }
+        Node child;
+        child.origin[0] = origin[0] + ((c >> 2) & 1) * half;
+        child.origin[1] = origin[1] + ((c >> 1) & 1) * half;
+        child.origin[2] = origin[2] + (c & 1) * half;
+        child.size = half;
+        int index = (int)nodes.size();
+        nodes.push_back(child);
+        nodes[node].children[c] = index;
+        buildNode(index, points, starts[c], starts[c] + counts[c], depth + 1, capacity, tmp, cls, cells);
+    }
+}
+void LodHierarchy::compact(const int* remap, unsigned int version, vector<RenderSpan>& changed) {
+    PROFILE_SCOPE("lod compact");
+    this->version = version;
+    for (size_t n = 0; n < nodes.size(); n++) {
+        Node& node = nodes[n];
+        unsigned int end = node.first + node.count;
+        unsigned int w = node.first;
+        unsigned int firstChanged = end;
+        for (unsigned int i = node.first; i < end; i++) {
+            int index = remap[order[i]];
+            if (index < 0) {
+                firstChanged = min(firstChanged, i);
+                continue;
+            }
+            order[w++] = index;
+        }
+        node.count = w - node.first;
+        // the slots left at the end of the node are not drawn anymore
+        if (firstChanged < w) {
+            changed.push_back(RenderSpan(firstChanged, w - firstChanged));
+        }
+    }
+}
+int LodHierarchy::findNode(unsigned int slot) const {
+    // the nodes are in depth first order, their slots follow each other
+    int lo = 0, hi = (int)nodes.size();
+    while (hi - lo > 1) {
+        int mid = (lo + hi) / 2;
+        if (nodes[mid].first <= slot) {
+            lo = mid;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+void LodHierarchy::clear() {
+    nodes.clear();
+    order.clear();
+}
+unsigned int LodHierarchy::select(const ConvexRegion& frustum, const float eye[3], float pixelFactor, float minPixels, unsigned int budget, vector<int>& selected) const {
+    PROFILE_SCOPE("lod select");
+    selected.clear();
+    if (nodes.empty()) {
+        return 0;
+    }
+    // nodes by decreasing projected size, those fully in view do not need
+    // to be culled again
+    priority_queue<pair<float, pair<int, bool> > > queue;
+    queue.push(make_pair(1e30f, make_pair(0, false)));
+    unsigned int total = 0;
+    while (!queue.empty()) {
+        int n = queue.top().second.first;
+        bool inside = queue.top().second.second;
+        queue.pop();
+        const Node& node = nodes[n];
+        if (!inside) {
+            ConvexRegion::Classification c = frustum.classify(Point(node.origin[0], node.origin[1], node.origin[2]), node.size);
+            if (c == ConvexRegion::OUTSIDE) {
+                continue;
+            }
+            inside = (c == ConvexRegion::INSIDE);
+        }
+        if (total + node.count > budget) {
+            break;
+        }
+        if (node.count > 0) {
+            selected.push_back(n);
+            total += node.count;
+        }
+        for (int i = 0; i < 8; i++) {
+            if (node.children[i] < 0) {
+                continue;
+            }
+            const Node& child = nodes[node.children[i]];
+            float radius = 0.866f * child.size;
+            float d2 = 0;
+            for (int k = 0; k < 3; k++) {
+                float d = child.origin[k] + 0.5f * child.size - eye[k];
+                d2 += d * d;
+            }
+            float distance = sqrt(d2) - radius;
+            float pixels = distance > 0 ? radius * pixelFactor / distance : 1e30f;
+            if (pixels >= minPixels) {
+                queue.push(make_pair(pixels, make_pair(node.children[i], inside)));
+            }
+        }
+    }
+    return total;
+}
@@ -0,0 +1,86 @@
+#include "NeighborhoodCache.h"
+#include "Sample.h"
+
+
+NeighborhoodCache::NeighborhoodCache() : radius(0), version(0) {
+}
+bool NeighborhoodCache::isValid(unsigned int version, float radius) const {
+    return !offsets.empty() && this->version == version && this->radius >= radius;
+}
+void NeighborhoodCache::assign(vector<size_t>& rowOffsets, vector<unsigned int>& rowIndices, vector<float>& rowSqDistances, int num, float radius, unsigned int version) {
+    this->radius = radius;
+    this->version = version;
+    // the arrays of the graph are taken over, not copied
+    offsets.swap(rowOffsets);
+    indices.swap(rowIndices);
+    sqDistances.swap(rowSqDistances);
+    rowOffsets.clear();
+    rowIndices.clear();
+    rowSqDistances.clear();
+
+    // sort each row by distance, in place
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+    {
+        vector<pair<float, unsigned int> > entries;
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 1024)
+#endif
+        for (int i = 0; i < num; i++) {
+            entries.clear();
+            for (size_t j = offsets[i]; j < offsets[i + 1]; j++) {
+                entries.push_back(make_pair(sqDistances[j], indices[j]));
+            }
+            sort(entries.begin(), entries.end());
+            for (size_t j = 0; j < entries.size(); j++) {
+                sqDistances[offsets[i] + j] = entries[j].first;
+                indices[offsets[i] + j] = entries[j].second;
+            }
+        }
+    }
+}
+void NeighborhoodCache::compact(const bool* keep, int num, unsigned int version) {
+    // new index of each kept point
+    vector<unsigned int> remap(num);
+    unsigned int kept = 0;
+    for (int i = 0; i < num; i++) {
+        remap[i] = kept;
+        if (keep[i]) { kept++; }
+    }
+    size_t k = 0;
+    size_t start = 0;
+    unsigned int row = 0;
+    for (int i = 0; i < num; i++) {
+        size_t end = offsets[i + 1];
+        if (keep[i]) {
+            offsets[row++] = k;
+            for (size_t j = start; j < end; j++) {
+                if (keep[indices[j]]) {
+                    indices[k] = remap[indices[j]];
+                    sqDistances[k++] = sqDistances[j];
+                }
+            }
+        }
+        start = end;
+    }
+    offsets[row] = k;
+    offsets.resize(row + 1);
+    indices.resize(k);
+    sqDistances.resize(k);
+    this->version = version;
+}
+void NeighborhoodCache::clear() {
+    offsets.clear();
+    indices.clear();
+    sqDistances.clear();
+    radius = 0;
+}
+size_t NeighborhoodCache::count(int i, float sqRadius) const {
+    vector<float>::const_iterator first = sqDistances.begin() + offsets[i];
+    vector<float>::const_iterator last = sqDistances.begin() + offsets[i + 1];
+    return upper_bound(first, last, sqRadius) - first;
+}
+const unsigned int* NeighborhoodCache::row(int i) const {
+    return indices.data() + offsets[i];
+}
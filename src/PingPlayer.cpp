@@ -0,0 +1,214 @@
+#include "PingPlayer.h"
+#include "FileIO.h"
+#include "Profiler.h"
+
+
+PingPlayer::PingPlayer() : rate(10.0f), speed(1.0f), playing(false), position(0), displayed(-1), stalls(0), threshold(0), stopping(false) {
+    for (int i = 0; i < RING; i++) {
+        slots[i].ping = -1;
+        slots[i].state = EMPTY;
+    }
+}
+PingPlayer::~PingPlayer() {
+    stopDecoder();
+}
+void PingPlayer::open(const vector<string>& files, int first, float threshold) {
+    close();
+    this->files = files;
+    this->threshold = threshold;
+    position = first;
+    displayed = -1;
+    stalls = 0;
+    playing = false;
+    for (int i = 0; i < RING; i++) {
+        slots[i].buffer.create();
+    }
+    stopping = false;
+    decoder = thread(&PingPlayer::decode, this);
+}
+void PingPlayer::close() {
+    if (!isOpen()) {
+        return;
+    }
+    stopDecoder();
+    for (int i = 0; i < RING; i++) {
+        slots[i].ping = -1;
+        slots[i].state = EMPTY;
+        slots[i].cloud.reset();
+        slots[i].buffer.destroy();
+    }
+    files.clear();
+    displayed = -1;
+    playing = false;
+}
+bool PingPlayer::isOpen() const {
+    return !files.empty();
+}
+void PingPlayer::seek(int ping) {
+    position = min(max(ping, 0), (int)files.size() - 1);
+}
+void PingPlayer::update(double elapsed, float threshold) {
+    if (!isOpen()) {
+        return;
+    }
+    PROFILE_SCOPE("playback");
+    int last = (int)files.size() - 1;
+    if (playing && displayed >= 0) {
+        position = min(position + elapsed * rate * speed, (double)last);
+    }
+    int target = (int)position;
+    // while playing, the window starts at the ping on screen so that a late
+    // ping is waited for instead of being pushed out of the ring
+    bool following = playing && displayed >= 0 && target > displayed;
+    int first = following ? displayed : target;
+    int end = min(first + RING - 1, last);
+    {
+        lock_guard<mutex> guard(lock);
+        this->threshold = threshold;
+        // each ping in the slot of its index; a slot being decoded is taken
+        // back once the decoder is done with it
+        for (int p = first; p <= end; p++) {
+            Slot& slot = slots[p % RING];
+            if (slot.ping != p && slot.state != DECODING) {
+                slot.ping = p;
+                slot.state = REQUESTED;
+                slot.cloud.reset();
+            }
+        }
+    }
+    wakeup.notify_one();
+
+    // the nearest decoded pings go to the GPU, two per frame at most
+    int uploads = 0;
+    for (int p = first; p <= end && uploads < 2; p++) {
+        Slot& slot = slots[p % RING];
+        bool decoded;
+        {
+            lock_guard<mutex> guard(lock);
+            decoded = slot.ping == p && slot.state == DECODED;
+        }
+        if (decoded) {
+            upload(slot);
+            uploads++;
+        }
+    }
+    // the colormaps follow the threshold slider, as the preview does
+    for (int p = first; p <= end; p++) {
+        Slot& slot = slots[p % RING];
+        if (isReady(p) && slot.threshold != threshold) {
+            updateColormap(slot);
+        }
+    }
+
+    if (following) {
+        // the pings ready in a row up to the target: the ones in between are
+        // only stepped over when the pings come faster than the frames
+        int p = displayed;
+        while (p < min(target, end) && isReady(p + 1)) {
+            p++;
+        }
+        if (p < target) {
+            position = p + 0.999;
+            stalls++;
+        }
+        displayed = p;
+    }
+    else if (isReady(target)) {
+        displayed = target;
+    }
+    if (playing && displayed == last) {
+        playing = false;
+    }
+}
+const PingPlayer::Slot* PingPlayer::getDisplayed() const {
+    if (displayed < 0) {
+        return NULL;
+    }
+    const Slot& slot = slots[displayed % RING];
+    return slot.ping == displayed && slot.state == READY ? &slot : NULL;
+}
+void PingPlayer::decode() {
+    while (true) {
+        int index;
+        string path;
+        float threshold;
+        {
+            unique_lock<mutex> guard(lock);
+            // the nearest requested ping first
+            auto next = [this]() {
+                int best = -1;
+                for (int i = 0; i < RING; i++) {
+                    if (slots[i].state == REQUESTED && (best < 0 || slots[i].ping < slots[best].ping)) {
+                        best = i;
+                    }
+                }
+                return best;
+            };
+            wakeup.wait(guard, [&] { return stopping || next() >= 0; });
+            if (stopping) {
+                return;
+            }
+            index = next();
+            slots[index].state = DECODING;
+            path = files[slots[index].ping];
+            threshold = this->threshold;
+        }
+        // the same thresholding and level of detail as an opened file, the
+        // raw points are drawn and thresholded in the shader
+        PROFILE_SCOPE("ping decode");
+        shared_ptr<PointCloud> cloud = make_shared<PointCloud>();
+        int size = FileIO::getFileSize(path);
+        int num = size / 4 / sizeof(float);
+        if (num > 0) {
+            float* points = FileIO::openBinaryPointsFile(path, size);
+            cloud->init(points, num, threshold);
+            delete[] points;
+            cloud->getRawLod();
+        }
+        {
+            lock_guard<mutex> guard(lock);
+            slots[index].cloud = cloud;
+            slots[index].state = DECODED;
+        }
+    }
+}
+void PingPlayer::stopDecoder() {
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    wakeup.notify_all();
+    if (decoder.joinable()) {
+        decoder.join();
+    }
+}
+bool PingPlayer::isReady(int ping) {
+    if (ping < 0 || ping >= (int)files.size()) {
+        return false;
+    }
+    lock_guard<mutex> guard(lock);
+    const Slot& slot = slots[ping % RING];
+    return slot.ping == ping && slot.state == READY;
+}
+void PingPlayer::upload(Slot& slot) {
+    // the decoder is done with the slot, only the main thread changes it now
+    PointCloud& cloud = *slot.cloud;
+    if (cloud.prNum > 0) {
+        slot.buffer.replace(cloud.rawVertices.data(), (unsigned int)cloud.rawVertices.size() / 4);
+        cloud.rawDirty.clear();
+        updateColormap(slot);
+    }
+    lock_guard<mutex> guard(lock);
+    slot.state = READY;
+}
+void PingPlayer::updateColormap(Slot& slot) {
+    slot.threshold = threshold;
+    if (slot.cloud->prNum == 0) {
+        return;
+    }
+    GLfloat rgb[256 * 3];
+    float curve[256];
+    slot.cloud->getThresholdCurve(threshold, slot.low, curve);
+    slot.cloud->getColormap(curve, rgb);
+    slot.buffer.updateColormap(rgb);
+}
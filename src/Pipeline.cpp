@@ -0,0 +1,269 @@
+#include "Pipeline.h"
+
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <iomanip>
+
+#include "PointCloud.h"
+#include "FileIO.h"
+#include "Profiler.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+
+PipelineOptions::PipelineOptions() : threshold(0.1f), hasCrop(false), radius(6.0f), isolate(2.5f), bilateral(0.0f), format("bin"), outDir("processed"), jobs(0), threads(0) {
+    const char* defaults[] = { "threshold", "crop", "segment", "bilateral", "export" };
+    stages.assign(defaults, defaults + 5);
+    for (int k = 0; k < 3; k++) {
+        cropLower[k] = cropUpper[k] = 0.0f;
+    }
+}
+
+int runPipeline(int argc, char** argv) {
+    PipelineOptions options;
+    vector<string> inputs;
+    bool stagesGiven = false;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool more = i + 1 < argc;
+        if (arg == "--stages" && more) {
+            options.stages.clear();
+            stagesGiven = true;
+            stringstream list(argv[++i]);
+            string stage;
+            while (getline(list, stage, ',')) {
+                options.stages.push_back(stage);
+            }
+        }
+        else if (arg == "--threshold" && more) {
+            options.threshold = (float)atof(argv[++i]);
+        }
+        else if (arg == "--crop" && i + 6 < argc) {
+            for (int k = 0; k < 3; k++) {
+                options.cropLower[k] = (float)atof(argv[++i]);
+            }
+            for (int k = 0; k < 3; k++) {
+                options.cropUpper[k] = (float)atof(argv[++i]);
+            }
+            options.hasCrop = true;
+        }
+        else if (arg == "--radius" && more) {
+            options.radius = (float)atof(argv[++i]);
+        }
+        else if (arg == "--isolate" && more) {
+            options.isolate = (float)atof(argv[++i]);
+        }
+        else if (arg == "--bilateral" && more) {
+            options.bilateral = (float)atof(argv[++i]);
+        }
+        else if (arg == "--format" && more) {
+            options.format = argv[++i];
+        }
+        else if (arg == "--out" && more) {
+            options.outDir = argv[++i];
+        }
+        else if (arg == "--jobs" && more) {
+            options.jobs = atoi(argv[++i]);
+        }
+        else if (arg == "--threads" && more) {
+            options.threads = atoi(argv[++i]);
+        }
+        else if (arg == "--trace" && more) {
+            options.trace = argv[++i];
+        }
+        else if (arg.compare(0, 2, "--") == 0) {
+            cerr << "Unknown argument " << arg << endl;
+            return 2;
+        }
+        else {
+            inputs.push_back(arg);
+        }
+    }
+
+    // the scan is loaded by the threshold stage, the others run on it
+    if (options.stages.empty() || options.stages[0] != "threshold") {
+        cerr << "The first stage must be threshold" << endl;
+        return 2;
+    }
+    for (size_t s = 1; s < options.stages.size(); s++) {
+        const string& stage = options.stages[s];
+        if (stage != "noise" && stage != "crop" && stage != "segment" && stage != "bilateral" && stage != "export") {
+            cerr << "Unknown stage " << stage << endl;
+            return 2;
+        }
+    }
+    if (!options.hasCrop && find(options.stages.begin(), options.stages.end(), "crop") != options.stages.end()) {
+        if (stagesGiven) {
+            cerr << "The crop stage needs --crop <x0 y0 z0 x1 y1 z1>" << endl;
+            return 2;
+        }
+        // the default stages crop only when a box is given
+        options.stages.erase(remove(options.stages.begin(), options.stages.end(), "crop"), options.stages.end());
+    }
+    if (options.format != "bin" && options.format != "obj") {
+        cerr << "Unknown format " << options.format << ": use bin or obj" << endl;
+        return 2;
+    }
+
+    vector<string> files;
+    for (size_t i = 0; i < inputs.size(); i++) {
+        // every file of a directory, or the file itself
+        vector<string> found;
+        FileIO::listFiles(inputs[i], found);
+        if (found.empty()) {
+            files.push_back(inputs[i]);
+        }
+        else {
+            files.insert(files.end(), found.begin(), found.end());
+        }
+    }
+    if (files.empty()) {
+        cerr << "Nothing to process: give scan files or directories" << endl;
+        return 2;
+    }
+#ifdef _WIN32
+    _mkdir(options.outDir.c_str());
+#else
+    mkdir(options.outDir.c_str(), 0755);
+#endif
+    return processBatch(files, options);
+}
+
+bool processScan(const string& path, const PipelineOptions& options, ScanReport& report) {
+    report.path = path;
+    report.inputPoints = report.outputPoints = 0;
+    report.stageTimes.assign(options.stages.size(), 0.0);
+    report.failed = true;
+    int size = FileIO::getFileSize(path);
+    if (size < (int)(4 * sizeof(float))) {
+        cerr << "Cannot read " << path << endl;
+        return false;
+    }
+
+    PointCloud cloud;
+    for (size_t s = 0; s < options.stages.size(); s++) {
+        const string& stage = options.stages[s];
+        double start = Profiler::now();
+        if (stage == "threshold") {
+            float* points = FileIO::openBinaryPointsFile(path, size);
+            cloud.init(points, size / 4 / sizeof(float), options.threshold);
+            delete[] points;
+            report.inputPoints = cloud.prNum;
+        }
+        else if (stage == "export") {
+            string out = options.outDir + "/" + FileIO::baseName(path) + "." + options.format;
+            bool written = true;
+            if (options.format == "obj") {
+                FileIO::savePointsAsObj(out, cloud.vPoints, cloud.pRegions, cloud.pvNum);
+            }
+            else {
+                written = FileIO::savePointsAsBinaryFile(out, cloud.vPoints, cloud.pAmp, cloud.pvNum);
+            }
+            if (!written) {
+                cerr << "Cannot write " << out << endl;
+                return false;
+            }
+        }
+        else if (cloud.pvNum == 0) {
+            // nothing left to process
+        }
+        else if (stage == "noise") {
+            cloud.clearSonarNoise();
+        }
+        else if (stage == "crop") {
+            const float* lower = options.cropLower;
+            const float* upper = options.cropUpper;
+            cloud.crop(ConvexRegion::box(Point(lower[0], lower[1], lower[2]), Point(upper[0], upper[1], upper[2])));
+        }
+        else if (stage == "segment") {
+            float radius = options.radius / 100.0f * cloud.boundingBoxSize;
+            cloud.segment(radius, int(options.isolate / 100.0f * cloud.pvNum));
+        }
+        else if (stage == "bilateral") {
+            // the radius the viewer starts with for the scan
+            float radius = options.bilateral > 0 ? options.bilateral : cloud.boundingBoxSize * sqrt(20.0f / cloud.pvNum);
+            cloud.useBilateralFilter(radius, radius);
+        }
+        report.stageTimes[s] = (Profiler::now() - start) / 1000.0;
+    }
+    report.outputPoints = cloud.pvNum;
+    report.failed = false;
+    return true;
+}
+
+int processBatch(const vector<string>& files, const PipelineOptions& options) {
+    // a scan at a time by default, its stages use all the cores; more jobs
+    // share the cores between scans
+    unsigned int cores = max(thread::hardware_concurrency(), 1u);
+    unsigned int jobs = options.jobs > 0 ? (unsigned int)options.jobs : 1;
+    jobs = min(jobs, (unsigned int)files.size());
+    unsigned int threads = options.threads > 0 ? (unsigned int)options.threads : max(cores / jobs, 1u);
+
+    double start = Profiler::now();
+    vector<ScanReport> reports(files.size());
+    atomic<size_t> next(0);
+    atomic<int> done(0);
+    mutex print;
+    vector<thread> workers;
+    for (unsigned int w = 0; w < jobs; w++) {
+        workers.push_back(thread([&]() {
+#ifdef _OPENMP
+            omp_set_num_threads(threads);
+#endif
+            for (size_t i = next++; i < files.size(); i = next++) {
+                ScanReport& report = reports[i];
+                processScan(files[i], options, report);
+                stringstream line;
+                line << "[" << ++done << "/" << files.size() << "] " << files[i];
+                if (report.failed) {
+                    line << " failed";
+                }
+                else {
+                    line << ": " << report.inputPoints << " -> " << report.outputPoints << " points";
+                    for (size_t s = 0; s < options.stages.size(); s++) {
+                        line << " | " << options.stages[s] << " " << fixed << setprecision(1) << report.stageTimes[s] << " ms";
+                    }
+                }
+                lock_guard<mutex> guard(print);
+                printf("%s\n", line.str().c_str());
+            }
+        }));
+    }
+    for (size_t w = 0; w < workers.size(); w++) {
+        workers[w].join();
+    }
+    double seconds = (Profiler::now() - start) / 1e6;
+
+    // every stage over the processed scans
+    int processed = 0;
+    double points = 0;
+    for (size_t i = 0; i < reports.size(); i++) {
+        if (!reports[i].failed) {
+            processed++;
+            points += reports[i].inputPoints;
+        }
+    }
+    printf("\n%-12s %12s %12s %12s\n", "stage", "total (s)", "mean (ms)", "max (ms)");
+    for (size_t s = 0; s < options.stages.size(); s++) {
+        double total = 0, longest = 0;
+        for (size_t i = 0; i < reports.size(); i++) {
+            if (!reports[i].failed) {
+                total += reports[i].stageTimes[s];
+                longest = max(longest, reports[i].stageTimes[s]);
+            }
+        }
+        printf("%-12s %12.3f %12.1f %12.1f\n", options.stages[s].c_str(), total / 1000.0, processed > 0 ? total / processed : 0.0, longest);
+    }
+    printf("%d of %u scans processed to %s in %.1f s, %u job(s) x %u thread(s), %.2fM input points/s\n",
+        processed, (unsigned int)files.size(), options.outDir.c_str(), seconds, jobs, threads, seconds > 0 ? points / seconds / 1e6 : 0.0);
+    if (!options.trace.empty() && !Profiler::get().exportTrace(options.trace)) {
+        cerr << "Cannot write " << options.trace << endl;
+    }
+    return processed == (int)files.size() ? 0 : 1;
+}
@@ -0,0 +1,112 @@
+#include "PointBuffer.h"
+#include "Profiler.h"
+#include "Shader.h"
+#include <algorithm>
+
+
+PointBuffer::PointBuffer() : vao(0), vbo(0), colormap(0), capacity(0), version(0), uploadedBytes(0) {
+}
+void PointBuffer::create() {
+    glGenVertexArrays(1, &vao);
+    glGenBuffers(1, &vbo);
+    glGenTextures(1, &colormap);
+    glBindTexture(GL_TEXTURE_1D, colormap);
+    glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_1D, 0);
+}
+void PointBuffer::destroy() {
+    glDeleteVertexArrays(1, &vao);
+    glDeleteBuffers(1, &vbo);
+    glDeleteTextures(1, &colormap);
+    vao = vbo = colormap = 0;
+    capacity = 0;
+}
+void PointBuffer::update(const GLushort* vertices, unsigned int num, unsigned int version, vector<RenderSpan>& dirty) {
+    uploadedBytes = 0;
+    if (dirty.empty()) {
+        this->version = version;
+        return;
+    }
+    PROFILE_SCOPE("buffer upload");
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    if (num > capacity) {
+        // grow with some headroom, everything is sent again
+        allocate(max(num, capacity + capacity / 2));
+        upload(vertices, 0, num);
+    }
+    else {
+        // spans in order, the close ones merged into one call
+        sort(dirty.begin(), dirty.end());
+        unsigned int first = dirty[0].first;
+        unsigned int end = dirty[0].first + dirty[0].second;
+        for (size_t i = 1; i < dirty.size(); i++) {
+            if (dirty[i].first > end + 1024) {
+                upload(vertices, first, end - first);
+                first = dirty[i].first;
+            }
+            end = max(end, dirty[i].first + dirty[i].second);
+        }
+        upload(vertices, first, min(end, num) - first);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    dirty.clear();
+    this->version = version;
+}
+void PointBuffer::replace(const GLushort* vertices, unsigned int num) {
+    PROFILE_SCOPE("buffer replace");
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    if (num > capacity) {
+        allocate(max(num, capacity + capacity / 2));
+    }
+    else {
+        // orphaned: new storage while the GPU may still draw from the old one
+        glBufferData(GL_ARRAY_BUFFER, sizeof(GLushort) * 4 * capacity, 0, GL_DYNAMIC_DRAW);
+    }
+    upload(vertices, 0, num);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    uploadedBytes = sizeof(GLushort) * 4 * num;
+}
+void PointBuffer::updateColormap(const GLfloat* rgb) {
+    glBindTexture(GL_TEXTURE_1D, colormap);
+    glTexImage1D(GL_TEXTURE_1D, 0, GL_RGB8, 256, 0, GL_RGB, GL_FLOAT, rgb);
+    glBindTexture(GL_TEXTURE_1D, 0);
+}
+void PointBuffer::bind() const {
+    glBindVertexArray(vao);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_1D, colormap);
+}
+void PointBuffer::draw(Shader& shader, const LodHierarchy& lod, const vector<int>& nodes, const ConvexRegion& region) const {
+    // one draw per node, in the frame of its quantization cube
+    for (size_t i = 0; i < nodes.size(); i++) {
+        const LodHierarchy::Node& node = lod.nodes[nodes[i]];
+        if (region.classify(Point(node.origin[0], node.origin[1], node.origin[2]), node.size) == ConvexRegion::OUTSIDE) {
+            continue;
+        }
+        shader.setUniform("tileOrigin", glm::vec3(node.origin[0], node.origin[1], node.origin[2]));
+        shader.setUniform("tileSize", node.size);
+        glDrawArrays(GL_POINTS, node.first, node.count);
+    }
+}
+void PointBuffer::allocate(unsigned int num) {
+    capacity = num;
+    glBindVertexArray(vao);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(GLushort) * 4 * capacity, 0, GL_DYNAMIC_DRAW);
+    // Position attribute, normalized in the node cube
+    glVertexAttribPointer(0, 3, GL_UNSIGNED_SHORT, GL_TRUE, 4 * sizeof(GLushort), (GLvoid*)0);
+    glEnableVertexAttribArray(0);
+    // Amplitude attribute, normalized between the amplitude bounds
+    glVertexAttribPointer(1, 1, GL_UNSIGNED_SHORT, GL_TRUE, 4 * sizeof(GLushort), (GLvoid*)(3 * sizeof(GLushort)));
+    glEnableVertexAttribArray(1);
+    glBindVertexArray(0);
+}
+void PointBuffer::upload(const GLushort* vertices, unsigned int first, unsigned int count) {
+    if (count == 0) {
+        return;
+    }
+    GLsizeiptr size = sizeof(GLushort) * 4 * count;
+    glBufferSubData(GL_ARRAY_BUFFER, sizeof(GLushort) * 4 * first, size, vertices + first * 4);
+    uploadedBytes += size;
+}
@@ -1,11 +1,50 @@
 #include "PointCloud.h"
+#include "FileIO.h"
 
 
 int nRegions = 0;
 
-PointCloud::PointCloud() : rPoints(NULL), vPoints(NULL), pFlag(NULL), pRegions(NULL), pAmp(NULL), pColor(NULL), prNum(0), pvNum(0), boundingBoxSize(0), centerPoint(glm::vec3(0.0f, 0.0f, 0.0f)) {
+// the snapshots go to the temporary directory, not to the working one
+static string getSnapshotRoot() {
+#ifdef _WIN32
+    const char* dir = getenv("TEMP");
+#else
+    const char* dir = getenv("TMPDIR");
+#endif
+    if (dir == NULL || *dir == 0) {
+#ifdef _WIN32
+        dir = ".";
+#else
+        dir = "/tmp";
+#endif
+    }
+    return string(dir) + "/3DSonalVis-snapshots";
+}
+
+PointCloud::PointCloud() : rPoints(NULL), vPoints(NULL), pColor(NULL), pAmp(NULL), pFlag(NULL), pRegions(NULL), prNum(0), pvNum(0), boundingBoxSize(0), centerPoint(glm::vec3(0.0f, 0.0f, 0.0f)), version(0), snapshotDir(getSnapshotRoot()), singlePrecision(true), spatialIndex(NULL), spatialVersion(0), ampMin(0), ampMax(1), colormapDirty(false), resetVersion(0) {
+}
+PointCloud::PointCloud(const PointCloud& other) : rPoints(NULL), vPoints(NULL), pColor(NULL), pAmp(NULL), pFlag(NULL), pRegions(NULL), prNum(other.prNum), pvNum(other.pvNum), boundingBoxSize(other.boundingBoxSize), centerPoint(other.centerPoint), version(other.version), neighborhoods(other.neighborhoods), snapshotDir(other.snapshotDir), singlePrecision(other.singlePrecision), spatialIndex(NULL), spatialVersion(0), lod(other.lod), ampMin(other.ampMin), ampMax(other.ampMax), colormapDirty(false), sortedAmp(other.sortedAmp), resetVersion(other.resetVersion), rawLod(other.rawLod), rawVertices(other.rawVertices), renderVertices(other.renderVertices) {
+    // a copy to process while the original is drawn, the spatial index is
+    // rebuilt on demand. The buffer bookkeeping (dirty spans and colormap)
+    // belongs to the thread drawing the original and is not copied
+    if (prNum > 0) {
+        rPoints = new GLfloat[prNum * 4];
+        vPoints = new GLfloat[prNum * 3];
+        pColor = new GLfloat[prNum * 3];
+        pAmp = new GLfloat[prNum];
+        pFlag = new bool[prNum];
+        pRegions = new int[prNum];
+        memcpy(rPoints, other.rPoints, sizeof(GLfloat) * prNum * 4);
+        memcpy(vPoints, other.vPoints, sizeof(GLfloat) * prNum * 3);
+        memcpy(pColor, other.pColor, sizeof(GLfloat) * prNum * 3);
+        memcpy(pAmp, other.pAmp, sizeof(GLfloat) * prNum);
+        memcpy(pFlag, other.pFlag, sizeof(bool) * prNum);
+        memcpy(pRegions, other.pRegions, sizeof(int) * prNum);
+    }
+    memcpy(ampCurve, other.ampCurve, sizeof(ampCurve));
 }
 void PointCloud::init(GLfloat* raw, int num, double threshold) {
+    PROFILE_SCOPE("init");
     prNum = num;
     rPoints = new GLfloat[num * 4];  
     vPoints = new GLfloat[num * 3];
@@ -18,20 +57,38 @@ void PointCloud::init(GLfloat* raw, int num, double threshold) {
     pvNum = heatmap(raw, num, vPoints, pColor, pAmp, threshold);
     for (int i = 0; i < pvNum; i++) {
         pFlag[i] = true;
-        ampMap[getPointStr(vPoints[i * 3], vPoints[i * 3 + 1], vPoints[i * 3 + 2])] = pAmp[i];
+        pRegions[i] = 0;
+    }
+    reportProgress(0.2f);
+    // sorted raw amplitudes: the curve of any threshold without a pass over
+    // the points
+    sortedAmp.resize(num);
+    for (int i = 0; i < num; i++) {
+        sortedAmp[i] = rPoints[i * 4 + 3];
     }
+    sort(sortedAmp.begin(), sortedAmp.end());
+    rawLod.clear();
+    version++;
+    resetVersion = version;
+    updateAmplitudeCurve(threshold);
     updateProperties();
 }
 void PointCloud::reset(double threshold) {
+    PROFILE_SCOPE("reset");
     pvNum = heatmap(rPoints, prNum, vPoints, pColor, pAmp, threshold);
-    ampMap.clear();
     for (int i = 0; i < pvNum; i++) {
         pFlag[i] = true;
-        ampMap[getPointStr(vPoints[i * 3], vPoints[i * 3 + 1], vPoints[i * 3 + 2])] = pAmp[i];
+        pRegions[i] = 0;
     }
+    reportProgress(0.5f);
+    version++;
+    resetVersion = version;
+    neighborhoods.clear();
+    updateAmplitudeCurve(threshold);
     updateProperties();
 }
 void PointCloud::clearSonarNoise() {
+    PROFILE_SCOPE("clear sonar noise");
     for (int i = 0; i < this->pvNum; i++) {
         GLfloat x = this->vPoints[i * 3];
         GLfloat y = this->vPoints[i * 3 + 1];
@@ -40,15 +97,49 @@ void PointCloud::clearSonarNoise() {
             pFlag[i] = false;
         }
     }
+    if (!reportProgress(0.2f)) {
+        return;
+    }
     transform();
 }
 void PointCloud::useBilateralFilter(double radius, double normal_radius) {
+    if (pvNum == 0) {
+        return;
+    }
+    // the input is single precision: compact samples halve the memory
+    // traffic of the filter, double precision samples stay available
+    if (singlePrecision) {
+        filterPoints<FloatSample>(radius, normal_radius);
+    }
+    else {
+        filterPoints<Sample>(radius, normal_radius);
+    }
+}
+template<class S>
+void PointCloud::filterPoints(double radius, double normal_radius) {
+    PROFILE_SCOPE("bilateral filter");
     int niter = 1;
-    Octree octree;
-    time_t start, end, globstart, globend;
-    std::time(&globstart);
-    double size = loadAndSortPoints(vPoints, pColor, pAmp, pvNum, octree, radius);
-    std::time(&end);
+    TOctree<S> octree;
+    double start = Profiler::now();
+    // the octree only depends on the points and the radius: reuse a snapshot
+    // of a previous run on the same cloud if there is one
+    uint64_t key = contentKey(radius, sizeof(S));
+    string snapshot = getSnapshotPath(key);
+    if (octree.loadSnapshot(snapshot.c_str(), key, vPoints, pvNum)) {
+        std::cout << "Octree restored from " << snapshot << std::endl;
+        loadProperties(pColor, pAmp, pvNum, octree);
+    }
+    else {
+        loadAndSortPoints(vPoints, pColor, pAmp, pvNum, octree, radius);
+        if (octree.saveSnapshot(snapshot.c_str(), key)) {
+            pruneSnapshots(snapshot);
+        }
+    }
+    double end = Profiler::now();
+    Profiler::get().record("filter octree", start, end - start);
+    if (!reportProgress(0.2f)) {
+        return;
+    }
 
     std::cout << "Parameters:" << std::endl;
     std::cout << "Radius: " << radius << std::endl;
@@ -57,57 +148,107 @@ void PointCloud::useBilateralFilter(double radius, double normal_radius) {
     std::cout << "Octree with depth " << octree.getDepth() << " created." << std::endl;
     std::cout << "Octree contains " << octree.getNpoints() << " points." << std::endl;
     std::cout << "The bounding box size is " << octree.getSize() << std::endl;
-    std::cout << "Reading and sorting the points took " << difftime(end, globstart)
+    std::cout << "Reading and sorting the points took " << (end - start) / 1e6
         << " s." << std::endl;
 
     std::cout << "Octree statistics" << std::endl;
     octree.printOctreeStat();
 
+    // the first pass filters the current points: their neighborhoods come
+    // from the same octree, unless they are too many to keep and the filter
+    // queries the octree
+    const NeighborhoodCache* nb = getNeighborhoods(radius, octree);
+
     //creating the bilateral filter
-    std::time(&start);
-    BilateralFilter bilateralfilter(&octree, radius, normal_radius, niter);
-    std::time(&end);
+    TBilateralFilter<S> bilateralfilter(&octree, radius, normal_radius, niter);
+    if (nb != NULL) {
+        bilateralfilter.setInitialNeighborhoods(nb->offsets.data(), nb->indices.data(), nb->sqDistances.data());
+    }
+    if (!reportProgress(0.4f)) {
+        return;
+    }
 
     //bilateralfilter.applyBilateralFilter();
-    bilateralfilter.parallelApplyBilateralFilter();
-    OctreeNode* node = octree.getRoot();
+    {
+        PROFILE_SCOPE("filter points");
+        bilateralfilter.parallelApplyBilateralFilter();
+    }
+    if (!reportProgress(0.8f)) {
+        return;
+    }
+    PROFILE_SCOPE("filter gather");
+    TOctreeNode<S>* node = octree.getRoot();
+    vector<unsigned int> indices;
+    indices.reserve(pvNum);
     pvNum = 0;
-    ampMap.clear();
-    saveContent(node, octree, bilateralfilter.getSetIndex(), false);
+    saveContent(node, bilateralfilter.getSetIndex(), indices);
+
+    // gather the untouched properties column by column
+    octree.gatherPropertyColumn(0, indices.data(), pvNum, pColor, 3);
+    octree.gatherPropertyColumn(1, indices.data(), pvNum, pColor + 1, 3);
+    octree.gatherPropertyColumn(2, indices.data(), pvNum, pColor + 2, 3);
+    octree.gatherPropertyColumn(3, indices.data(), pvNum, pAmp);
+    for (int i = 0; i < pvNum; i++) {
+        pFlag[i] = true;
+    }
+    version++;
+    neighborhoods.clear();
 }
-void PointCloud::saveContent(OctreeNode* node, Octree& octree, unsigned int index, bool isoriented)
+template<class S>
+void PointCloud::saveContent(TOctreeNode<S>* node, unsigned int index, vector<unsigned int>& indices)
 {
 
     if (node->getDepth() != 0)
     {
         for (int i = 0; i < 8; i++)
             if (node->getChild(i) != NULL)
-                saveContent(node->getChild(i), octree, index, isoriented);
+                saveContent(node->getChild(i), index, indices);
     }
     else if (node->getNpts(index) != 0)
     {
-        Sample_deque::const_iterator iter;
-        std::vector<double>::iterator pi;
+        typename TOctreeNode<S>::const_point_iterator iter;
         for (iter = node->points_begin(index);
             iter != node->points_end(index); ++iter)
         {
-            const Sample& s = *iter;
-            size_t sindex = s.index();
+            const S& s = *iter;
             vPoints[pvNum * 3] = s.x();
             vPoints[pvNum * 3 + 1] = s.y();
             vPoints[pvNum * 3 + 2] = s.z();
-
-            pColor[pvNum * 3] = octree.getProperty(sindex, 0);
-            pColor[pvNum * 3 + 1] = octree.getProperty(sindex, 1);
-            pColor[pvNum * 3 + 2] = octree.getProperty(sindex, 2);
-            pAmp[pvNum] = octree.getProperty(sindex, 3);
-            ampMap[getPointStr(s.x(), s.y(), s.z())] = pAmp[pvNum];
-            pFlag[pvNum++] = true;
+            indices.push_back(s.index());
+            pvNum++;
         }
     }
 }
 void PointCloud::transform() {
+    PROFILE_SCOPE("transform");
     int prevNum = pvNum;
+    // removing points keeps the neighborhoods of the remaining ones
+    if (neighborhoods.isValid(version, 0)) {
+        neighborhoods.compact(pFlag, prevNum, version + 1);
+    }
+    vector<int> remap(prevNum, -1);
+    int n = 0;
+    for (int i = 0; i < prevNum; i++) {
+        if (pFlag[i]) {
+            remap[i] = n++;
+        }
+    }
+    // and the spatial index only loses the removed samples
+    if (spatialIndex != NULL && spatialVersion == version) {
+        vector<Sample> removed;
+        for (int i = 0; i < prevNum; i++) {
+            if (!pFlag[i]) {
+                Sample s(vPoints[i * 3], vPoints[i * 3 + 1], vPoints[i * 3 + 2]);
+                s.setIndex(i);
+                removed.push_back(s);
+            }
+        }
+        spatialIndex->removePoints(removed.begin(), removed.end());
+        renumberSamples(spatialIndex->getRoot(), remap);
+        spatialVersion = version + 1;
+    }
+    bool lodValid = lod.isValid(version);
+    version++;
     pvNum = 0;
     for (int i = 0; i < prevNum; i++) {
         if (pFlag[i]) {
@@ -117,35 +258,44 @@ void PointCloud::transform() {
             pFlag[pvNum] = true;
             pRegions[pvNum++] = pRegions[i];
         }
-        else {
-            ampMap.erase(getPointStr(vPoints[i * 3], vPoints[i * 3 + 1], vPoints[i * 3 + 2]));
+    }
+    // the nodes of the level of detail are compacted in place: only their
+    // changed ranges are rewritten and uploaded
+    if (lodValid) {
+        size_t first = renderDirty.size();
+        lod.compact(&remap[0], version, renderDirty);
+        for (size_t j = first; j < renderDirty.size(); j++) {
+            updateRenderSpan(renderDirty[j]);
         }
     }
     updateProperties();
 }
 void PointCloud::segment(float radius, int thresh) {
+    PROFILE_SCOPE("segment");
     nRegions = 0;
     cout << "Segmentation begins\n";
-    int k;                   // number of nearest neighbors
-    int dim = 3;             // dimension
-    double eps = 0;          // error bound
     int nPts = this->pvNum;  // actual number of data points
-    ANNpointArray dataPts;   // data points
-    ANNpoint queryPt;        // query point
-    ANNidxArray nnIdx;       // near neighbor indices
-    ANNdistArray dists;      // near neighbor distances
-    ANNkd_tree* kdTree;      // serarch structure
-
-    queryPt = annAllocPt(dim);
-    cout << (int)&queryPt << endl;
-    dataPts = annAllocPts(nPts, dim);
-
-    for (int i = 0; i < nPts; i++) {
-        dataPts[i][0] = this->vPoints[i * 3];
-        dataPts[i][1] = this->vPoints[i * 3 + 1];
-        dataPts[i][2] = this->vPoints[i * 3 + 2];
+    // radius is a squared radius, as it used to be given to ANN's annkFRSearch
+    float sqRadius = radius;
+    if (nPts == 0) {
+        return;
+    }
+    // the neighborhoods of every point when they fit, or else a radius query
+    // per point on the octree, as the kd-tree search used to
+    Octree octree;
+    const NeighborhoodCache* nb = &neighborhoods;
+    if (!neighborhoods.isValid(version, sqrt(radius))) {
+        loadAndSortPoints(vPoints, NULL, NULL, pvNum, octree, sqrt(radius));
+        nb = getNeighborhoods(sqrt(radius), octree);
+    }
+    OctreeIterator iterator(&octree);
+    NeighborBuffer buffer;
+    if (nb == NULL) {
+        iterator.setR(sqrt(radius));
+    }
+    if (!reportProgress(0.4f)) {
+        return;
     }
-    kdTree = new ANNkd_tree(dataPts, nPts, dim);
 
     queue<int> q;
     int* crowd = new int[nPts];
@@ -154,6 +304,11 @@ void PointCloud::segment(float radius, int thresh) {
         flag[i] = false;
     }
     for (int i = 0; i < nPts; i++) {
+        if ((i & 0xffff) == 0 && !reportProgress(0.4f + 0.4f * i / nPts)) {
+            delete[] flag;
+            delete[] crowd;
+            return;
+        }
         if (flag[i]) { continue; }
         int count = 0;
         q.push(i);
@@ -161,36 +316,29 @@ void PointCloud::segment(float radius, int thresh) {
         while (!q.empty()) {
             int queryIdx = q.front();
             crowd[count++] = queryIdx;
-            queryPt[0] = dataPts[queryIdx][0];
-            queryPt[1] = dataPts[queryIdx][1];
-            queryPt[2] = dataPts[queryIdx][2];
 
-            k = kdTree->annkFRSearch(
-                queryPt,
-                radius,
-                0,
-                NULL,
-                NULL,
-                eps);
-            nnIdx = new ANNidx[k];
-            dists = new ANNdist[k];
-            kdTree->annkFRSearch(
-                queryPt,
-                radius,
-                k,
-                nnIdx,
-                dists,
-                eps);
-            for (int j = 0; j < k; j++) {
-                if (!flag[nnIdx[j]]) {
-                    q.push(nnIdx[j]);
-                    flag[nnIdx[j]] = true;
+            if (nb != NULL) {
+                int k = nb->count(queryIdx, sqRadius);
+                const unsigned int* nnIdx = nb->row(queryIdx);
+                for (int j = 0; j < k; j++) {
+                    if (!flag[nnIdx[j]]) {
+                        q.push(nnIdx[j]);
+                        flag[nnIdx[j]] = true;
+                    }
+                }
+            }
+            else {
+                const GLfloat* p = vPoints + queryIdx * 3;
+                int k = iterator.getNeighbors(Point(p[0], p[1], p[2]), buffer);
+                for (int j = 0; j < k; j++) {
+                    int index = buffer.neighbors[j]->index();
+                    if (!flag[index]) {
+                        q.push(index);
+                        flag[index] = true;
+                    }
                 }
             }
             q.pop();
-
-            delete[] dists;
-            delete[] nnIdx;
         }
         cout << count << endl;
         if (count <= thresh) {
@@ -210,10 +358,6 @@ void PointCloud::segment(float radius, int thresh) {
 
     delete[] flag;
     delete[] crowd;
-    delete kdTree;
-    annDeallocPt(queryPt);
-    annDeallocPts(dataPts);
-    annClose();
 
     transform();
     return;
@@ -234,7 +378,279 @@ void PointCloud::updateProperties() {
     centerPoint = glm::vec3((minx + maxx) / 2, (miny + maxy) / 2, (minz + maxz) / 2);
     boundingBoxSize = max(max(maxx - minx, maxy - miny), maxz - minz);
 }
+template<class S>
+const NeighborhoodCache* PointCloud::getNeighborhoods(float radius, TOctree<S>& octree) {
+    if (neighborhoods.isValid(version, radius)) {
+        return &neighborhoods;
+    }
+    PROFILE_SCOPE("neighborhoods");
+    // the points are in the octree at the radius already; when their
+    // neighborhoods would not fit, the caller queries them one at a time
+    if (estimateNeighborEdges(octree, radius) > MAX_NEIGHBOR_EDGES) {
+        return NULL;
+    }
+    vector<Point> queries;
+    queries.reserve(pvNum);
+    for (int i = 0; i < pvNum; i++) {
+        queries.push_back(Point(vPoints[i * 3], vPoints[i * 3 + 1], vPoints[i * 3 + 2]));
+    }
+    // set the active depth for the radius before the batch query, as
+    // estimateNeighborEdges does: at the constructor's depth the whole
+    // octree is one cell
+    TOctreeIterator<S> iterator(&octree);
+    iterator.setR(radius);
+    TNeighborGraph<S> graph;
+    iterator.getNeighborGraph(queries.begin(), queries.end(), radius, graph);
+    neighborhoods.assign(graph.offsets, graph.indices, graph.sqdistances, pvNum, radius, version);
+    return &neighborhoods;
+}
+template<class S>
+double PointCloud::estimateNeighborEdges(TOctree<S>& octree, float radius) const {
+    // the mean neighborhood size of a few points spread over the cloud
+    const int samples = min(pvNum, 256);
+    if (samples == 0) {
+        return 0;
+    }
+    TOctreeIterator<S> iterator(&octree);
+    iterator.setR(radius);
+    TNeighborBuffer<S> buffer;
+    double total = 0;
+    for (int k = 0; k < samples; k++) {
+        int i = (int)((long long)k * pvNum / samples);
+        total += iterator.getNeighbors(Point(vPoints[i * 3], vPoints[i * 3 + 1], vPoints[i * 3 + 2]), buffer);
+    }
+    return total / samples * pvNum;
+}
+uint64_t PointCloud::contentKey(double radius, size_t sampleSize) const {
+    uint64_t key = hashBytes(vPoints, sizeof(GLfloat) * 3 * pvNum);
+    key = hashBytes(&sampleSize, sizeof(sampleSize), key);
+    return hashBytes(&radius, sizeof(radius), key);
+}
+string PointCloud::getSnapshotPath(uint64_t key) const {
+#ifdef _WIN32
+    _mkdir(snapshotDir.c_str());
+#else
+    mkdir(snapshotDir.c_str(), 0755);
+#endif
+    stringstream ss;
+    ss << snapshotDir << "/" << std::hex << std::setw(16) << std::setfill('0') << key << ".oct";
+    return ss.str();
+}
+void PointCloud::pruneSnapshots(const string& keep) const {
+    // the oldest snapshots go once they take more than MAX_SNAPSHOT_BYTES,
+    // the one just written always stays
+    struct Snapshot {
+        time_t time;
+        uint64_t bytes;
+        string path;
+        bool operator<(const Snapshot& other) const { return time < other.time; }
+    };
+    vector<string> files;
+    FileIO::listFiles(snapshotDir, files);
+    vector<Snapshot> snapshots;
+    uint64_t total = 0;
+    for (size_t i = 0; i < files.size(); i++) {
+        struct stat info;
+        const string& path = files[i];
+        if (path.size() > 4 && path.compare(path.size() - 4, 4, ".oct") == 0 && stat(path.c_str(), &info) == 0) {
+            Snapshot snapshot = { info.st_mtime, (uint64_t)info.st_size, path };
+            snapshots.push_back(snapshot);
+            total += snapshot.bytes;
+        }
+    }
+    sort(snapshots.begin(), snapshots.end());
+    for (size_t i = 0; i < snapshots.size() && total > MAX_SNAPSHOT_BYTES; i++) {
+        if (snapshots[i].path != keep && remove(snapshots[i].path.c_str()) == 0) {
+            total -= snapshots[i].bytes;
+        }
+    }
+}
+Octree& PointCloud::getSpatialIndex() {
+    if (spatialIndex != NULL && spatialVersion == version) {
+        return *spatialIndex;
+    }
+    PROFILE_SCOPE("spatial index");
+    delete spatialIndex;
+    spatialIndex = new Octree();
+    if (pvNum > 0) {
+        // a few tens of points per leaf for a cloud lying on surfaces
+        int depth = (int)ceil(0.5 * log2(max(pvNum / 16.0, 1.0)));
+        depth = min(max(depth, 1), 16);
+        double cell = 1.1 * max(boundingBoxSize, 1e-6f) / pow2(depth);
+        loadAndSortPoints(vPoints, NULL, NULL, pvNum, *spatialIndex, cell);
+    }
+    spatialVersion = version;
+    return *spatialIndex;
+}
+int PointCloud::crop(const ConvexRegion& region) {
+    PROFILE_SCOPE("crop");
+    int n = 0;
+#pragma omp parallel for reduction(+:n)
+    for (int i = 0; i < pvNum; i++) {
+        pFlag[i] = region.contains(vPoints[i * 3], vPoints[i * 3 + 1], vPoints[i * 3 + 2]);
+        n += pFlag[i] ? 0 : 1;
+    }
+    if (n > 0) {
+        transform();
+    }
+    return n;
+}
+int PointCloud::removeSelected(const ScreenSelection& selection) {
+    if (!selection.isValid(version, pvNum)) {
+        return 0;
+    }
+    int n = 0;
+    for (int i = 0; i < pvNum; i++) {
+        if (selection.isSelected(i)) {
+            pFlag[i] = false;
+            n++;
+        }
+    }
+    // all the strokes of the selection are removed at once
+    if (n > 0) {
+        transform();
+    }
+    return n;
+}
+const LodHierarchy& PointCloud::getLod() {
+    if (lod.isValid(version)) {
+        return lod;
+    }
+    PROFILE_SCOPE("lod build");
+    lod.build(vPoints, pvNum, version);
+    // the render buffers follow the level of detail order
+    renderVertices.resize(pvNum * 4);
+    renderDirty.clear();
+    renderDirty.push_back(RenderSpan(0, pvNum));
+    updateRenderSpan(renderDirty[0]);
+    return lod;
+}
+const LodHierarchy& PointCloud::getRawLod() {
+    if (rawLod.isValid(0)) {
+        return rawLod;
+    }
+    PROFILE_SCOPE("raw lod build");
+    // the raw points never change, their buffer is filled once
+    rawLod.build(rPoints, prNum, 0, 4096, 4);
+    rawVertices.resize(prNum * 4);
+    rawDirty.clear();
+    rawDirty.push_back(RenderSpan(0, prNum));
+    quantizeSpan(rawLod, rawDirty[0], rPoints, 4, rPoints + 3, 4, sortedAmp.empty() ? 1.0f : sortedAmp.back(), rawVertices.data());
+    return rawLod;
+}
+bool PointCloud::reportProgress(float done) const {
+    // false once the job running the processing is cancelled
+    return !progress || progress(done);
+}
+void PointCloud::prepareRender() {
+    // the arrays of the buffer drawn next, built before the cloud is shown
+    if (isPristine()) {
+        getRawLod();
+    }
+    else {
+        getLod();
+    }
+}
+bool PointCloud::isPristine() const {
+    return version == resetVersion;
+}
+void PointCloud::updateRenderSpan(const RenderSpan& span) {
+    quantizeSpan(lod, span, vPoints, 3, pAmp, 1, ampMax, renderVertices.data());
+}
+void PointCloud::updateAmplitudeCurve(double threshold) {
+    getThresholdCurve(threshold, ampMin, ampCurve);
+    ampMax = sortedAmp.empty() ? 1.0f : sortedAmp.back();
+    colormapDirty = true;
+}
+void PointCloud::getThresholdCurve(double threshold, float& low, float* curve) const {
+    // same bins and levels as heatmap() computes over the kept points
+    if (sortedAmp.empty()) {
+        low = 0;
+        fill(curve, curve + 256, 0.0f);
+        return;
+    }
+    float amp_max = sortedAmp.back();
+    float amp_threshold = amp_max * (float)threshold;
+    vector<float>::const_iterator first = lower_bound(sortedAmp.begin(), sortedAmp.end(), amp_threshold);
+    low = first != sortedAmp.end() ? *first : amp_max;
+    size_t num = sortedAmp.end() - first;
+    float amp_min = low;
+    for (int b = 0; b < 256; b++) {
+        size_t count = partition_point(first, sortedAmp.end(), [&](float a) { return amplitudeBin(a, amp_min, amp_max) <= b; }) - first;
+        curve[b] = round(count * 255.0f / num) / 255.0f;
+    }
+}
+void PointCloud::getColormap(const float* curve, GLfloat* rgb) const {
+    // the heatmap colors of the 256 amplitude bins
+    ColorGradient colorGradient;
+    for (int i = 0; i < 256; i++) {
+        colorGradient.getColorAtValue(curve[i], rgb[i * 3], rgb[i * 3 + 1], rgb[i * 3 + 2]);
+    }
+}
+void quantizeSpan(const LodHierarchy& lod, const RenderSpan& span, const GLfloat* points, unsigned int stride, const float* amp, unsigned int ampStride, float ampMax, GLushort* vertices) {
+    // 16 bits positions in the cube of their node, 16 bits amplitudes
+    // relative to the largest raw amplitude
+    float ampScale = ampMax > 0 ? 65535.0f / ampMax : 0.0f;
+    int n = lod.findNode(span.first);
+    for (unsigned int i = span.first; i < span.first + span.second; i++) {
+        while (i >= lod.nodes[n].first + lod.nodes[n].slots) {
+            n++;
+        }
+        const LodHierarchy::Node& node = lod.nodes[n];
+        const GLfloat* p = points + lod.order[i] * stride;
+        for (int k = 0; k < 3; k++) {
+            float q = (p[k] - node.origin[k]) / node.size * 65535.0f + 0.5f;
+            vertices[i * 4 + k] = (GLushort)min(max(q, 0.0f), 65535.0f);
+        }
+        float a = amp[lod.order[i] * ampStride] * ampScale + 0.5f;
+        vertices[i * 4 + 3] = (GLushort)min(max(a, 0.0f), 65535.0f);
+    }
+}
+int PointCloud::pick(const glm::vec3& origin, const glm::vec3& direction, float tanRadius) {
+    if (pvNum == 0) {
+        return -1;
+    }
+    Sample* s = getSpatialIndex().pickOnRay(Point(origin.x, origin.y, origin.z), Point(direction.x, direction.y, direction.z), tanRadius);
+    return s == NULL ? -1 : s->index();
+}
+bool PointCloud::getRenderedPoint(unsigned int slot, glm::vec3& position, float& amp, int& region) const {
+    // slots index the render order of the buffer drawn: the raw points
+    // until the cloud is edited, the kept points after
+    if (isPristine()) {
+        if (slot >= rawLod.order.size()) {
+            return false;
+        }
+        const GLfloat* p = rPoints + rawLod.order[slot] * 4;
+        position = glm::vec3(p[0], p[1], p[2]);
+        amp = p[3];
+        region = 0;
+        return true;
+    }
+    if (slot >= lod.order.size()) {
+        return false;
+    }
+    unsigned int index = lod.order[slot];
+    position = glm::vec3(vPoints[index * 3], vPoints[index * 3 + 1], vPoints[index * 3 + 2]);
+    amp = pAmp[index];
+    region = pRegions[index];
+    return true;
+}
+void renumberSamples(OctreeNode* node, const vector<int>& remap) {
+    if (node == NULL) {
+        return;
+    }
+    if (node->getDepth() != 0) {
+        for (int i = 0; i < 8; i++)
+            renumberSamples(node->getChild(i), remap);
+        return;
+    }
+    OctreeNode::point_iterator iter;
+    for (iter = node->points_begin(0); iter != node->points_end(0); ++iter) {
+        iter->setIndex(remap[iter->index()]);
+    }
+}
 PointCloud::~PointCloud() {
+    delete spatialIndex;
     delete[] vPoints;
     delete[] rPoints;
     delete[] pColor;
@@ -242,10 +658,14 @@ PointCloud::~PointCloud() {
     delete[] pFlag;
     delete[] pRegions;
 }
-double loadAndSortPoints(GLfloat* points, GLfloat* color, float* amp, int num, Octree& octree, double min_radius)
+template<class S>
+double loadAndSortPoints(GLfloat* points, GLfloat* color, float* amp, int num, TOctree<S>& octree, double min_radius)
 {
-    int nprop = 4;
-    deque<Sample> input_vertices;
+    if (num == 0) {
+        return 0;
+    }
+    vector<S> input_vertices;
+    input_vertices.reserve(num);
 
     double xmin, ymin, zmin, xmax, ymax, zmax;
     xmin = xmax = points[0];
@@ -255,7 +675,7 @@ double loadAndSortPoints(GLfloat* points, GLfloat* color, float* amp, int num, O
     for (int i = 0; i < num; i++)
     {
         double x = points[i * 3], y = points[i * 3 + 1], z = points[i * 3 + 2];
-        Sample temp(x, y, z);
+        S temp(x, y, z);
         temp.setIndex(i);
         input_vertices.push_back(temp);
         xmin = std::min(x, xmin);
@@ -264,13 +684,11 @@ double loadAndSortPoints(GLfloat* points, GLfloat* color, float* amp, int num, O
         ymax = std::max(y, ymax);
         zmin = std::min(z, zmin);
         zmax = std::max(z, zmax);
+    }
 
-        //reading properties
-        octree.addProperty(nprop);
-        octree.setProperty(i, 0, color[i * 3]);
-        octree.setProperty(i, 1, color[i * 3 + 1]);
-        octree.setProperty(i, 2, color[i * 3 + 2]);
-        octree.setProperty(i, 3, amp[i]);
+    //reading properties
+    if (color != NULL && amp != NULL) {
+        loadProperties(color, amp, num, octree);
     }
 
     std::cout << input_vertices.size() << " points read" << std::endl;
@@ -282,6 +700,8 @@ double loadAndSortPoints(GLfloat* points, GLfloat* color, float* amp, int num, O
     double size = std::max(lx, ly);
     size = std::max(lz, size);
     size = 1.1 * size;//loose bounding box around the object
+    //a cell at least around coincident points
+    size = std::max(size, min_radius > 0 ? 2 * min_radius : 1e-6);
 
     double margin;
     if (min_radius > 0)
@@ -308,12 +728,17 @@ double loadAndSortPoints(GLfloat* points, GLfloat* color, float* amp, int num, O
     octree.initialize(origin, size);
 
     //add the points to the set with index 0 (initial set)
-    octree.addInitialPoints(input_vertices.begin(), input_vertices.end());
+    octree.bulkAddInitialPoints(input_vertices.begin(), input_vertices.end());
 
     return size;
 }
-string getPointStr(float x, float y, float z) {
-    stringstream ss;
-    ss << std::fixed << std::setprecision(0) << x << y << z;
-    return ss.str();
-}
\ No newline at end of file
+template<class S>
+void loadProperties(GLfloat* color, float* amp, int num, TOctree<S>& octree)
+{
+    int nprop = 4;
+    octree.declareProperties(num, nprop);
+    octree.setPropertyColumn(0, color, 3);
+    octree.setPropertyColumn(1, color + 1, 3);
+    octree.setPropertyColumn(2, color + 2, 3);
+    octree.setPropertyColumn(3, amp);
+}
@@ -0,0 +1,101 @@
+#include "Profiler.h"
+#include <chrono>
+#include <fstream>
+#include <algorithm>
+
+
+static const chrono::steady_clock::time_point origin = chrono::steady_clock::now();
+
+Profiler::Profiler() : enabled(true) {
+}
+Profiler& Profiler::get() {
+    static Profiler profiler;
+    return profiler;
+}
+double Profiler::now() {
+    return chrono::duration<double, micro>(chrono::steady_clock::now() - origin).count();
+}
+void Profiler::record(const char* name, double start, double duration) {
+    if (!enabled) {
+        return;
+    }
+    lock_guard<mutex> guard(lock);
+    // threads are numbered in the order they first record something
+    map<thread::id, unsigned int>::iterator it = threads.find(this_thread::get_id());
+    if (it == threads.end()) {
+        it = threads.insert(make_pair(this_thread::get_id(), (unsigned int)threads.size())).first;
+    }
+    Event e = { name, it->second, start, duration };
+    add(e);
+}
+void Profiler::record(const char* name, double start, double duration, unsigned int thread) {
+    if (!enabled) {
+        return;
+    }
+    lock_guard<mutex> guard(lock);
+    Event e = { name, thread, start, duration };
+    add(e);
+}
+void Profiler::add(const Event& e) {
+    events.push_back(e);
+    if (events.size() > MAX_EVENTS) {
+        events.pop_front();
+    }
+    History& h = histories[e.name];
+    float ms = (float)(e.duration / 1000.0);
+    if (h.values.size() < (size_t)HISTORY) {
+        h.values.push_back(ms);
+    }
+    else {
+        h.values[h.next] = ms;
+        h.next = (h.next + 1) % HISTORY;
+    }
+}
+void Profiler::getStats(vector<Stat>& stats) const {
+    lock_guard<mutex> guard(lock);
+    stats.clear();
+    for (map<string, History>::const_iterator it = histories.begin(); it != histories.end(); ++it) {
+        Stat s;
+        s.name = it->first;
+        s.history = it->second.values;
+        s.offset = it->second.next;
+        // nearest rank percentiles of the history
+        vector<float> sorted = s.history;
+        sort(sorted.begin(), sorted.end());
+        int n = (int)sorted.size();
+        s.p50 = sorted[min(n - 1, n * 50 / 100)];
+        s.p95 = sorted[min(n - 1, n * 95 / 100)];
+        s.p99 = sorted[min(n - 1, n * 99 / 100)];
+        stats.push_back(s);
+    }
+}
+bool Profiler::exportTrace(const string& path) const {
+    ofstream out(path.c_str());
+    if (!out) {
+        return false;
+    }
+    lock_guard<mutex> guard(lock);
+    // complete events ("X"), plus the name of the GPU timeline
+    out << "{\"traceEvents\":[\n";
+    out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" << GPU_THREAD << ",\"args\":{\"name\":\"GPU\"}}";
+    out.setf(ios::fixed);
+    out.precision(3);
+    for (size_t i = 0; i < events.size(); i++) {
+        const Event& e = events[i];
+        out << ",\n{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << e.thread
+            << ",\"ts\":" << e.start << ",\"dur\":" << e.duration << "}";
+    }
+    out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+    return true;
+}
+void Profiler::clear() {
+    lock_guard<mutex> guard(lock);
+    events.clear();
+    histories.clear();
+}
+
+ProfileScope::ProfileScope(const char* name) : name(name), start(Profiler::now()) {
+}
+ProfileScope::~ProfileScope() {
+    Profiler::get().record(name, start, Profiler::now() - start);
+}
@@ -0,0 +1,181 @@
+#include "ScreenSelection.h"
+#include "Profiler.h"
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SCREEN_SELECTION_SSE
+#include <emmintrin.h>
+#endif
+
+
+// x_clip between minx * w_clip and maxx * w_clip, no division needed
+struct RectangleShape {
+    float minx, miny, maxx, maxy;
+    bool test(float x, float y, float w) const {
+        return w > 0 && x >= minx * w && x <= maxx * w && y >= miny * w && y <= maxy * w;
+    }
+#ifdef SCREEN_SELECTION_SSE
+    int test4(__m128 x, __m128 y, __m128 w) const {
+        __m128 in = _mm_cmpgt_ps(w, _mm_setzero_ps());
+        in = _mm_and_ps(in, _mm_cmpge_ps(x, _mm_mul_ps(_mm_set1_ps(minx), w)));
+        in = _mm_and_ps(in, _mm_cmple_ps(x, _mm_mul_ps(_mm_set1_ps(maxx), w)));
+        in = _mm_and_ps(in, _mm_cmpge_ps(y, _mm_mul_ps(_mm_set1_ps(miny), w)));
+        in = _mm_and_ps(in, _mm_cmple_ps(y, _mm_mul_ps(_mm_set1_ps(maxy), w)));
+        return _mm_movemask_ps(in);
+    }
+#endif
+};
+
+// even-odd rule: the edges crossed by a ray going to +x, the points outside
+// the bounding box of the polygon are rejected first
+struct PolygonShape {
+    const float* polygon;
+    int count;
+    vector<float> slopes;
+    float minx, miny, maxx, maxy;
+    PolygonShape(const float* polygon, int count) : polygon(polygon), count(count), slopes(count) {
+        minx = miny = 1e30f;
+        maxx = maxy = -1e30f;
+        for (int i = 0; i < count; i++) {
+            const float* a = polygon + i * 2;
+            const float* b = polygon + ((i + 1) % count) * 2;
+            slopes[i] = a[1] != b[1] ? (b[0] - a[0]) / (b[1] - a[1]) : 0.0f;
+            minx = min(minx, a[0]);
+            maxx = max(maxx, a[0]);
+            miny = min(miny, a[1]);
+            maxy = max(maxy, a[1]);
+        }
+    }
+    bool test(float x, float y, float w) const {
+        if (!(w > 0)) {
+            return false;
+        }
+        x = x / w;
+        y = y / w;
+        if (x < minx || x > maxx || y < miny || y > maxy) {
+            return false;
+        }
+        bool in = false;
+        for (int i = 0; i < count; i++) {
+            const float* a = polygon + i * 2;
+            const float* b = polygon + ((i + 1) % count) * 2;
+            if ((a[1] > y) != (b[1] > y) && x < a[0] + (y - a[1]) * slopes[i]) {
+                in = !in;
+            }
+        }
+        return in;
+    }
+#ifdef SCREEN_SELECTION_SSE
+    int test4(__m128 x, __m128 y, __m128 w) const {
+        __m128 front = _mm_cmpgt_ps(w, _mm_setzero_ps());
+        x = _mm_div_ps(x, w);
+        y = _mm_div_ps(y, w);
+        __m128 box = _mm_and_ps(_mm_cmpge_ps(x, _mm_set1_ps(minx)), _mm_cmple_ps(x, _mm_set1_ps(maxx)));
+        box = _mm_and_ps(box, _mm_and_ps(_mm_cmpge_ps(y, _mm_set1_ps(miny)), _mm_cmple_ps(y, _mm_set1_ps(maxy))));
+        front = _mm_and_ps(front, box);
+        if (_mm_movemask_ps(front) == 0) {
+            return 0;
+        }
+        __m128 in = _mm_setzero_ps();
+        for (int i = 0; i < count; i++) {
+            const float* a = polygon + i * 2;
+            const float* b = polygon + ((i + 1) % count) * 2;
+            __m128 crosses = _mm_xor_ps(_mm_cmpgt_ps(_mm_set1_ps(a[1]), y), _mm_cmpgt_ps(_mm_set1_ps(b[1]), y));
+            __m128 edge = _mm_add_ps(_mm_set1_ps(a[0]), _mm_mul_ps(_mm_sub_ps(y, _mm_set1_ps(a[1])), _mm_set1_ps(slopes[i])));
+            in = _mm_xor_ps(in, _mm_and_ps(crosses, _mm_cmplt_ps(x, edge)));
+        }
+        return _mm_movemask_ps(_mm_and_ps(in, front));
+    }
+#endif
+};
+
+// bits of up to 32 points: clip coordinates, then the shape test
+template<class Shape>
+static uint32_t selectWord(const float* m, const float* points, int count, const Shape& shape) {
+    uint32_t word = 0;
+    int i = 0;
+#ifdef SCREEN_SELECTION_SSE
+    __m128 m0 = _mm_set1_ps(m[0]), m4 = _mm_set1_ps(m[4]), m8 = _mm_set1_ps(m[8]), m12 = _mm_set1_ps(m[12]);
+    __m128 m1 = _mm_set1_ps(m[1]), m5 = _mm_set1_ps(m[5]), m9 = _mm_set1_ps(m[9]), m13 = _mm_set1_ps(m[13]);
+    __m128 m3 = _mm_set1_ps(m[3]), m7 = _mm_set1_ps(m[7]), m11 = _mm_set1_ps(m[11]), m15 = _mm_set1_ps(m[15]);
+    for (; i + 4 <= count; i += 4) {
+        // x0 y0 z0 x1 | y1 z1 x2 y2 | z2 x3 y3 z3 to one register per coordinate
+        const float* p = points + i * 3;
+        __m128 a = _mm_loadu_ps(p), b = _mm_loadu_ps(p + 4), c = _mm_loadu_ps(p + 8);
+        __m128 t0 = _mm_shuffle_ps(b, c, _MM_SHUFFLE(2, 1, 3, 2));
+        __m128 t1 = _mm_shuffle_ps(a, b, _MM_SHUFFLE(1, 0, 2, 1));
+        __m128 x = _mm_shuffle_ps(a, t0, _MM_SHUFFLE(2, 0, 3, 0));
+        __m128 y = _mm_shuffle_ps(t1, t0, _MM_SHUFFLE(3, 1, 2, 0));
+        __m128 z = _mm_shuffle_ps(t1, c, _MM_SHUFFLE(3, 0, 3, 1));
+        __m128 cx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m0, x), _mm_mul_ps(m4, y)), _mm_add_ps(_mm_mul_ps(m8, z), m12));
+        __m128 cy = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m1, x), _mm_mul_ps(m5, y)), _mm_add_ps(_mm_mul_ps(m9, z), m13));
+        __m128 cw = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m3, x), _mm_mul_ps(m7, y)), _mm_add_ps(_mm_mul_ps(m11, z), m15));
+        word |= (uint32_t)shape.test4(cx, cy, cw) << i;
+    }
+#endif
+    for (; i < count; i++) {
+        const float* p = points + i * 3;
+        float cx = (m[0] * p[0] + m[4] * p[1]) + (m[8] * p[2] + m[12]);
+        float cy = (m[1] * p[0] + m[5] * p[1]) + (m[9] * p[2] + m[13]);
+        float cw = (m[3] * p[0] + m[7] * p[1]) + (m[11] * p[2] + m[15]);
+        if (shape.test(cx, cy, cw)) {
+            word |= 1u << i;
+        }
+    }
+    return word;
+}
+
+// whole words per iteration, the threads never share one
+template<class Shape>
+static void selectPoints(const float* mvp, const float* points, int num, const Shape& shape, ScreenSelection::Mode mode, vector<uint32_t>& bits) {
+    int words = (int)bits.size();
+#pragma omp parallel for schedule(static, 256)
+    for (int w = 0; w < words; w++) {
+        uint32_t word = selectWord(mvp, points + (size_t)w * 32 * 3, min(32, num - w * 32), shape);
+        if (mode == ScreenSelection::REPLACE) {
+            bits[w] = word;
+        }
+        else if (mode == ScreenSelection::ADD) {
+            bits[w] |= word;
+        }
+        else {
+            bits[w] &= ~word;
+        }
+    }
+}
+
+ScreenSelection::ScreenSelection() : version(0), num(0) {
+}
+bool ScreenSelection::isValid(unsigned int version, int num) const {
+    return this->version == version && this->num == num;
+}
+void ScreenSelection::clear(unsigned int version, int num) {
+    this->version = version;
+    this->num = num;
+    bits.assign((num + 31) / 32, 0);
+}
+void ScreenSelection::selectRectangle(const float* mvp, const float* points, float minx, float miny, float maxx, float maxy, Mode mode) {
+    PROFILE_SCOPE("select rectangle");
+    RectangleShape shape = { min(minx, maxx), min(miny, maxy), max(minx, maxx), max(miny, maxy) };
+    selectPoints(mvp, points, num, shape, mode, bits);
+}
+void ScreenSelection::selectPolygon(const float* mvp, const float* points, const float* polygon, int count, Mode mode) {
+    if (count < 3) {
+        return;
+    }
+    PROFILE_SCOPE("select lasso");
+    PolygonShape shape(polygon, count);
+    selectPoints(mvp, points, num, shape, mode, bits);
+}
+bool ScreenSelection::isSelected(int i) const {
+    return (bits[i >> 5] >> (i & 31)) & 1;
+}
+int ScreenSelection::count() const {
+    int n = 0;
+    for (size_t w = 0; w < bits.size(); w++) {
+        for (uint32_t word = bits[w]; word != 0; word &= word - 1) {
+            n++;
+        }
+    }
+    return n;
+}
@@ -0,0 +1,14 @@
+// Command line processing of scans, without OpenGL (see Pipeline.h). It only
+// needs the processing sources: Pipeline, PointCloud, NeighborhoodCache,
+// LodHierarchy, ScreenSelection, Sample and Profiler, built into the
+// SonarCore library. On Linux:
+//   g++ -O2 -std=c++14 -fopenmp -Iinclude -I3rdparty/include src/SonarProc.cpp
+//       src/Pipeline.cpp src/PointCloud.cpp src/NeighborhoodCache.cpp
+//       src/LodHierarchy.cpp src/ScreenSelection.cpp src/Sample.cpp
+//       src/Profiler.cpp -lpthread -o SonarProc
+#include "Pipeline.h"
+
+int main(int argc, char** argv)
+{
+    return runPipeline(argc, argv);
+}